@@ -32,11 +32,17 @@
 #include <string.h>
 #include <ctype.h>
 
+#include <unistd.h>
+#include <stdint.h>
+#include <limits.h>
+
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <dirent.h>
 
 #include <math.h>
+#include <pthread.h>
 
 #include "gtopo.h"
 #include "protos.h"
@@ -95,28 +101,58 @@ extern struct settings settings;
  *
  */
 
-/* This subsystem keeps a linked list of "sections"
+/* This subsystem keeps a table of "sections"
  * the idea being you can give a latitude and longitude
  * to the nearest degree and be able to get a path to
  * the directory holding the stuff for that 1x1 degree
  * chunk of the world.
+ *
+ * This used to be a linked list, searched from the top
+ * every time we went looking for a maplet.  Now the sections
+ * live in one array (in the order we found them), and a grid
+ * with a slot for every degree of latitude and longitude
+ * tells us where in the array to look.  Section names give
+ * latlong as lat*1000 + long (long being degrees west),
+ * so the grid is indexed by exactly that.
  */
 struct section {
-	struct section *next;
     	struct section_dir *dir_head;
 	int	latlong;
 	int	dir_count;
 };
 
+#define GRID_LATS	91
+#define GRID_LONGS	360
+
+struct section_grid {
+	struct section *sects;
+	int count;
+	int alloc;
+	/* index+1 into sects, 0 if we have no such section */
+	unsigned short cells[GRID_LATS*GRID_LONGS];
+};
+
+/* Quads within a section are named a-h (latitude) and 1-8 (longitude)
+ * in the TPQ filenames, so one 64 bit mask per series tells us which
+ * files a section directory holds.  The names themselves are kept
+ * series by series, in bit order, QUAD_NAME bytes each.
+ */
+#define QUAD_NAME	13
+#define QUAD_BIT(lat,long)	((lat) * 8 + (long))
+
 struct section_dir {
     	struct section_dir *next;
 	char *path;
 	int tpq_code[N_SERIES];
 	int tpq_count[N_SERIES];
+	unsigned long long quad_mask[N_SERIES];
+	short quad_first[N_SERIES];
+	int quad_count;
+	char *quad_names;
 };
 
 /* Used to build the comprehensive level 3,4,5 section list */
-static struct section *temp_section_head;
+static struct section_grid *temp_sections;
 
 /* Prototypes ... */
 static int add_new_archive ( char * );
@@ -124,9 +160,14 @@ static int add_disk ( char *, char * );
 static void add_full_usa ( char *, char * );
 static int add_dir ( char *, char * );
 static int add_usa ( char *, int );
-static int add_section ( char *, char *, struct section ** );
+static int add_section ( char *, char *, struct section_grid * );
+
+static struct section_grid *section_grid_new ( void );
+static struct section *lookup_section ( struct section_grid *, int );
+static struct section *grid_add ( struct section_grid *, int );
+static int grid_cell ( int );
 
-static struct section *lookup_section ( struct section *, int );
+static void file_grid_free ( struct series * );
 
 /* Each level has a list of methods that need to be run through
  * in an attempt to find the desired maplet.
@@ -203,16 +244,18 @@ add_file_method ( struct series *sp, char *path )
 	xp->type = M_FILE;
 
 	xp->tpq = tp;
-	xp->cache = NULL;
 
 	xp->next = sp->methods;
 	sp->methods = xp;
 
+	/* lookup_method() will build a new one */
+	file_grid_free ( sp );
+
 	return 1;
 }
 
 void
-add_section_method ( struct series *sp, struct section *head )
+add_section_method ( struct series *sp, struct section_grid *head )
 {
 	struct method *xp;
 
@@ -224,7 +267,6 @@ add_section_method ( struct series *sp, struct section *head )
 	xp->sections = head;
 	xp->next = sp->methods;
 	xp->tpq = NULL;
-	xp->cache = NULL;
 
 	xp->next = sp->methods;
 	sp->methods = xp;
@@ -234,12 +276,12 @@ static void
 series_init_one ( struct series *sp, enum s_type series )
 {
 	sp->series = series;
-	sp->cache = (struct maplet *) NULL;
 	sp->cache_count = 0;
 	sp->pixels = NULL;
 	sp->content = 0;
 	sp->methods = NULL;
 	sp->cur_method = NULL;
+	sp->file_grid = NULL;
 }
 
 void
@@ -279,8 +321,8 @@ wonk_series ( enum s_type series )
 void
 file_info ( char *path, int extra )
 {
-	struct maplet *mp;
 	struct tpq_info *tp;
+	int xdim, ydim;
 	struct series *sp;
 	double lat_scale;
 	double long_scale;
@@ -293,21 +335,19 @@ file_info ( char *path, int extra )
 	    return;
 	}
 
-	mp = load_maplet_any ( path, NULL );
-	if ( ! mp ) {
+	tp = tpq_lookup ( path );
+	if ( ! tp || ! maplet_pixel_size ( tp, &xdim, &ydim ) ) {
 	    printf ( "Cannot grog file: %s\n", path );
 	    return;
 	}
 
-	tp = mp->tpq;
-
 	sp = &info.series_info[tp->series];
 	series_init_one ( sp, tp->series );
 	info.series = sp;
 
-	lat_scale = mp->tpq->maplet_lat_deg / mp->ydim;
-	long_scale = mp->tpq->maplet_long_deg * cos ( tp->mid_lat * DEGTORAD ) / mp->xdim;
-	long_scale_raw = mp->tpq->maplet_long_deg / mp->xdim;
+	lat_scale = tp->maplet_lat_deg / ydim;
+	long_scale = tp->maplet_long_deg * cos ( tp->mid_lat * DEGTORAD ) / xdim;
+	long_scale_raw = tp->maplet_long_deg / xdim;
 
 	/* This is for gtopo -i */
 	if ( extra == 0 ) {
@@ -328,7 +368,7 @@ file_info ( char *path, int extra )
 	    printf ( " longitude range = %.4f to %.4f\n", tp->w_long, tp->e_long );
 	    printf ( " latitude range = %.4f to %.4f\n", tp->s_lat, tp->n_lat );
 	    printf ( " maplet size (long, lat) = %.4f by %.4f\n", tp->maplet_long_deg, tp->maplet_lat_deg );
-	    printf ( " maplet pixels (x, y) = %d by %d\n", mp->xdim, mp->ydim );
+	    printf ( " maplet pixels (x, y) = %d by %d\n", xdim, ydim );
 	    printf ( " lat scale: %.8f\n", lat_scale );
 	    printf ( " long scale: %.8f  (%.8f) at lat %.5f\n", long_scale, long_scale_raw, tp->mid_lat );
 	    printf ( " series: %s\n", wonk_series ( tp->series ) );
@@ -343,8 +383,8 @@ file_info ( char *path, int extra )
 	    printf ( " %.4f", tp->n_lat - tp->s_lat );
 	    printf ( " %.4f", tp->maplet_long_deg );
 	    printf ( " %.4f", tp->maplet_lat_deg );
-	    printf ( " %d", mp->xdim );
-	    printf ( " %d", mp->ydim );
+	    printf ( " %d", xdim );
+	    printf ( " %d", ydim );
 	    printf ( "\n" );
 	}
 
@@ -361,19 +401,18 @@ file_info ( char *path, int extra )
 int
 file_init ( char *path )
 {
-	struct maplet *mp;
 	struct series *sp;
 	struct tpq_info *tp;
+	int xdim, ydim;
 
 	if ( ! is_file(path) )
 	    return 0;
 
-	mp = load_maplet_any ( path, NULL );
-	if ( ! mp )
+	/* make sure we can make sense of the maplets */
+	tp = tpq_lookup ( path );
+	if ( ! tp || ! maplet_pixel_size ( tp, &xdim, &ydim ) )
 	    return 0;
 
-	tp = mp->tpq;
-
 	sp = &info.series_info[tp->series];
 	series_init_one ( sp, tp->series );
 	info.series = sp;
@@ -766,6 +805,554 @@ archive_add ( char *path )
 	}
 }
 
+/* The archive snapshot.
+ *
+ * Walking a big archive takes a long time, particularly on a NAS,
+ * where the ~1400 section directories of five states take many
+ * seconds to open and read.  The result of all that walking is
+ * just the section lists, the tpq_code/tpq_count tables and the
+ * quad filename table in each section_dir, and the file methods
+ * for each series.
+ * We save all that in ~/.gtopo/archive.snap and map it back in
+ * next time.  The section_dir paths and quad names point right
+ * into the mapping.
+ *
+ * As we scan, we note the modification time of every directory
+ * we open.  Adding or removing a file or directory changes the
+ * mtime of the directory holding it, so if all those mtimes
+ * (and the list of archives) are unchanged, the snapshot is good.
+ * Otherwise we just do the full scan and write a new one.
+ *
+ * The file is native byte order, a private cache for this machine.
+ */
+
+#define SNAP_MAGIC	0x47534e50	/* "GSNP" */
+#define SNAP_VERSION	2
+#define SNAP_NAME	"archive.snap"
+
+/* keep the 64 bit mtimes aligned in the mapping */
+#define SNAP_ALIGN(x)	(((x) + 7) & ~7)
+
+/* is this a sane index into the string table */
+#define SNAP_STR_OK(hp,x)	((x) >= 0 && (x) < (hp)->n_strings)
+
+struct snap_header {
+	int magic;
+	int version;
+
+	int have_usa;
+	int n_sections;
+	int tpq_count[N_SERIES];
+
+	int n_archive;
+	int n_dirs;
+	int n_sect;
+	int n_sdir;
+	int n_method;
+	int n_strings;
+
+	/* byte offsets from the start of the file */
+	int archive_off;
+	int dirs_off;
+	int sect_off;
+	int sdir_off;
+	int method_off;
+	int strings_off;
+};
+
+/* A directory we looked at during the scan.
+ * The mtime is in nanoseconds, whole seconds are too coarse
+ * to catch a file added just after we scanned.
+ */
+struct snap_dir {
+	int64_t mtime;
+	int path;
+};
+
+/* sections are stored list by list, in list order */
+struct snap_section {
+	int list;
+	int latlong;
+	int first_dir;
+	int dir_count;
+};
+
+struct snap_sdir {
+	unsigned long long quad_mask[N_SERIES];
+	int path;
+	int tpq_code[N_SERIES];
+	int tpq_count[N_SERIES];
+	short quad_first[N_SERIES];
+	int quad_count;
+	int quad_names;		/* quad_count names in the string table */
+};
+
+/* methods are stored series by series, head to tail */
+struct snap_method {
+	int series;
+	int type;
+	int list;	/* M_SECTION */
+	int path;	/* M_FILE */
+};
+
+/* Directories seen during a scan */
+struct scan_dir {
+	struct scan_dir *next;
+	char *path;
+	int64_t mtime;
+};
+
+static int64_t
+snap_mtime ( struct stat *st )
+{
+	return (int64_t) st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+}
+
+static struct scan_dir *scan_dir_head = NULL;
+static int scan_dir_count = 0;
+
+/* buf should be PATH_MAX bytes */
+static char *
+snap_path ( char *buf )
+{
+	char *home;
+
+	home = find_home ();
+	if ( ! home )
+	    return NULL;
+
+	if ( snprintf ( buf, PATH_MAX, "%s/.gtopo/%s", home, SNAP_NAME ) >= PATH_MAX )
+	    return NULL;
+
+	/* The directory first */
+	sprintf ( buf, "%s/.gtopo", home );
+	if ( ! is_directory ( buf ) )
+	    mkdir ( buf, 0755 );
+
+	strcat ( buf, "/" SNAP_NAME );
+	return buf;
+}
+
+/* All the scanning code opens directories through here,
+ * so we know what to check next time.
+ */
+static DIR *
+archive_opendir ( char *path )
+{
+	struct stat st;
+	struct scan_dir *dp;
+
+	if ( stat ( path, &st ) < 0 )
+	    return NULL;
+
+	dp = (struct scan_dir *) gmalloc ( sizeof(struct scan_dir) );
+	dp->path = strhide ( path );
+	dp->mtime = snap_mtime ( &st );
+	dp->next = scan_dir_head;
+	scan_dir_head = dp;
+	scan_dir_count++;
+
+	return opendir ( path );
+}
+
+/* A growable string table for writing a snapshot */
+struct snap_strings {
+	char *buf;
+	int size;
+	int len;
+};
+
+static int
+snap_string ( struct snap_strings *sp, char *s )
+{
+	int n = strlen ( s ) + 1;
+	int rv;
+
+	while ( sp->len + n > sp->size ) {
+	    sp->size = sp->size ? sp->size * 2 : 16384;
+	    sp->buf = realloc ( sp->buf, sp->size );
+	    if ( ! sp->buf )
+		error ( "snapshot strings - out of memory\n" );
+	}
+
+	rv = sp->len;
+	strcpy ( &sp->buf[rv], s );
+	sp->len += n;
+	return rv;
+}
+
+/* Raw bytes, for the quad names, which carry their own nulls */
+static int
+snap_bytes ( struct snap_strings *sp, char *data, int n )
+{
+	int rv;
+
+	if ( n == 0 )
+	    return sp->len;
+
+	while ( sp->len + n > sp->size ) {
+	    sp->size = sp->size ? sp->size * 2 : 16384;
+	    sp->buf = realloc ( sp->buf, sp->size );
+	    if ( ! sp->buf )
+		error ( "snapshot strings - out of memory\n" );
+	}
+
+	rv = sp->len;
+	memcpy ( &sp->buf[rv], data, n );
+	sp->len += n;
+	return rv;
+}
+
+#define SNAP_MAX_LISTS	8
+
+static void
+snap_save ( void )
+{
+	char path[PATH_MAX];
+	char tmp_path[PATH_MAX+16];
+	FILE *fp;
+	struct snap_header hdr;
+	struct snap_strings strs;
+	struct section_grid *lists[SNAP_MAX_LISTS];
+	int nlists;
+	struct archive_entry *ap;
+	struct scan_dir *sdp;
+	struct section *ep;
+	struct section_dir *dp;
+	struct method *xp;
+	struct snap_dir sd;
+	struct snap_section ss;
+	struct snap_sdir sr;
+	struct snap_method sm;
+	int s, l, n;
+	int i;
+
+	if ( ! settings.archive_snap )
+	    return;
+
+	if ( ! snap_path ( path ) )
+	    return;
+
+	/* Collect the distinct section lists.
+	 * Usually one for SI_D01 and one for all the states.
+	 */
+	nlists = 0;
+	for ( s=0; s<N_SERIES; s++ ) {
+	    for ( xp = info.series_info[s].methods; xp; xp = xp->next ) {
+		if ( xp->type != M_SECTION )
+		    continue;
+		for ( l=0; l<nlists; l++ )
+		    if ( lists[l] == xp->sections )
+			break;
+		if ( l < nlists )
+		    continue;
+		if ( nlists >= SNAP_MAX_LISTS )
+		    return;
+		lists[nlists++] = xp->sections;
+	    }
+	}
+
+	memset ( &hdr, 0, sizeof(hdr) );
+	memset ( &strs, 0, sizeof(strs) );
+
+	hdr.magic = SNAP_MAGIC;
+	hdr.version = SNAP_VERSION;
+	hdr.have_usa = info.have_usa;
+	hdr.n_sections = info.n_sections;
+	for ( s=0; s<N_SERIES; s++ )
+	    hdr.tpq_count[s] = info.series_info[s].tpq_count;
+
+	for ( ap = archive_head; ap; ap = ap->next )
+	    hdr.n_archive++;
+	hdr.n_dirs = scan_dir_count;
+	for ( l=0; l<nlists; l++ )
+	    for ( i=0; i<lists[l]->count; i++ ) {
+		hdr.n_sect++;
+		hdr.n_sdir += lists[l]->sects[i].dir_count;
+	    }
+	for ( s=0; s<N_SERIES; s++ )
+	    for ( xp = info.series_info[s].methods; xp; xp = xp->next )
+		hdr.n_method++;
+
+	hdr.archive_off = sizeof(struct snap_header);
+	hdr.dirs_off = SNAP_ALIGN ( hdr.archive_off + hdr.n_archive * sizeof(int) );
+	hdr.sect_off = hdr.dirs_off + hdr.n_dirs * sizeof(struct snap_dir);
+	hdr.sdir_off = hdr.sect_off + hdr.n_sect * sizeof(struct snap_section);
+	hdr.method_off = hdr.sdir_off + hdr.n_sdir * sizeof(struct snap_sdir);
+	hdr.strings_off = hdr.method_off + hdr.n_method * sizeof(struct snap_method);
+
+	snprintf ( tmp_path, sizeof(tmp_path), "%s.%d", path, getpid() );
+	fp = fopen ( tmp_path, "w" );
+	if ( ! fp )
+	    return;
+
+	fwrite ( &hdr, sizeof(hdr), 1, fp );
+
+	for ( ap = archive_head; ap; ap = ap->next ) {
+	    n = snap_string ( &strs, ap->path );
+	    fwrite ( &n, sizeof(int), 1, fp );
+	}
+	fseek ( fp, (long) hdr.dirs_off, SEEK_SET );
+
+	for ( sdp = scan_dir_head; sdp; sdp = sdp->next ) {
+	    sd.mtime = sdp->mtime;
+	    sd.path = snap_string ( &strs, sdp->path );
+	    fwrite ( &sd, sizeof(sd), 1, fp );
+	}
+
+	n = 0;
+	for ( l=0; l<nlists; l++ )
+	    for ( i=0; i<lists[l]->count; i++ ) {
+		ep = &lists[l]->sects[i];
+		ss.list = l;
+		ss.latlong = ep->latlong;
+		ss.first_dir = n;
+		ss.dir_count = ep->dir_count;
+		fwrite ( &ss, sizeof(ss), 1, fp );
+		n += ep->dir_count;
+	    }
+
+	for ( l=0; l<nlists; l++ )
+	    for ( i=0; i<lists[l]->count; i++ )
+		for ( dp = lists[l]->sects[i].dir_head; dp; dp = dp->next ) {
+		    memset ( &sr, 0, sizeof(sr) );
+		    sr.path = snap_string ( &strs, dp->path );
+		    memcpy ( sr.tpq_code, dp->tpq_code, sizeof(sr.tpq_code) );
+		    memcpy ( sr.tpq_count, dp->tpq_count, sizeof(sr.tpq_count) );
+		    memcpy ( sr.quad_mask, dp->quad_mask, sizeof(sr.quad_mask) );
+		    memcpy ( sr.quad_first, dp->quad_first, sizeof(sr.quad_first) );
+		    sr.quad_count = dp->quad_count;
+		    sr.quad_names = snap_bytes ( &strs, dp->quad_names, dp->quad_count * QUAD_NAME );
+		    fwrite ( &sr, sizeof(sr), 1, fp );
+		}
+
+	for ( s=0; s<N_SERIES; s++ )
+	    for ( xp = info.series_info[s].methods; xp; xp = xp->next ) {
+		sm.series = s;
+		sm.type = xp->type;
+		sm.list = -1;
+		sm.path = -1;
+		if ( xp->type == M_SECTION ) {
+		    for ( l=0; l<nlists; l++ )
+			if ( lists[l] == xp->sections )
+			    sm.list = l;
+		} else
+		    sm.path = snap_string ( &strs, xp->tpq->path );
+		fwrite ( &sm, sizeof(sm), 1, fp );
+	    }
+
+	fwrite ( strs.buf, 1, strs.len, fp );
+
+	/* Now we know how big the string table is */
+	hdr.n_strings = strs.len;
+	fseek ( fp, 0L, SEEK_SET );
+	fwrite ( &hdr, sizeof(hdr), 1, fp );
+
+	free ( strs.buf );
+
+	if ( fclose ( fp ) != 0 || rename ( tmp_path, path ) < 0 ) {
+	    remove ( tmp_path );
+	    return;
+	}
+
+	if ( settings.verbose & V_ARCHIVE )
+	    printf ( "Saved archive snapshot %s (%d dirs, %d sections)\n", path, hdr.n_dirs, hdr.n_sect );
+}
+
+/* Map in the snapshot, check it, and if it is still good
+ * set everything up from it just like a scan would.
+ * Returns the number of archives, or 0 if we need to scan.
+ */
+static int
+snap_load ( void )
+{
+	char path[PATH_MAX];
+	struct stat st;
+	struct snap_header *hp;
+	struct archive_entry *ap;
+	int *arp;
+	struct snap_dir *sd;
+	struct snap_section *ss;
+	struct snap_sdir *sr;
+	struct snap_method *sm;
+	struct section_dir *sdirs;
+	struct section_grid *lists[SNAP_MAX_LISTS];
+	struct section *ep;
+	struct section_dir *dp;
+	char *base;
+	char *strs;
+	off_t map_size;
+	int fd;
+	int i, j, s;
+
+	if ( ! settings.archive_snap )
+	    return 0;
+
+	if ( ! snap_path ( path ) )
+	    return 0;
+
+	fd = open ( path, O_RDONLY );
+	if ( fd < 0 )
+	    return 0;
+
+	if ( fstat ( fd, &st ) < 0 || st.st_size < sizeof(struct snap_header) ) {
+	    close ( fd );
+	    return 0;
+	}
+
+	/* st gets used again below, for the directories */
+	map_size = st.st_size;
+
+	base = mmap ( NULL, map_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+	close ( fd );
+	if ( base == MAP_FAILED )
+	    return 0;
+
+	hp = (struct snap_header *) base;
+
+	if ( hp->magic != SNAP_MAGIC || hp->version != SNAP_VERSION )
+	    goto stale;
+	if ( hp->n_archive < 0 || hp->n_dirs < 0 || hp->n_sect < 0 ||
+	     hp->n_sdir < 0 || hp->n_method < 0 || hp->n_strings < 1 )
+	    goto stale;
+	if ( (long) hp->strings_off + hp->n_strings != map_size )
+	    goto stale;
+	if ( base[map_size-1] != '\0' )
+	    goto stale;
+
+	/* The tables must be laid out just the way snap_save() does it.
+	 * The counts are not negative, and we do this in long so that
+	 * a wild count can't wrap around, so this also keeps every table
+	 * inside the file.
+	 */
+	if ( hp->archive_off != sizeof(struct snap_header) ||
+	     hp->dirs_off != SNAP_ALIGN ( hp->archive_off + (long) hp->n_archive * sizeof(int) ) ||
+	     hp->sect_off != hp->dirs_off + (long) hp->n_dirs * sizeof(struct snap_dir) ||
+	     hp->sdir_off != hp->sect_off + (long) hp->n_sect * sizeof(struct snap_section) ||
+	     hp->method_off != hp->sdir_off + (long) hp->n_sdir * sizeof(struct snap_sdir) ||
+	     hp->strings_off != hp->method_off + (long) hp->n_method * sizeof(struct snap_method) )
+	    goto stale;
+
+	arp = (int *) (base + hp->archive_off);
+	sd = (struct snap_dir *) (base + hp->dirs_off);
+	ss = (struct snap_section *) (base + hp->sect_off);
+	sr = (struct snap_sdir *) (base + hp->sdir_off);
+	sm = (struct snap_method *) (base + hp->method_off);
+	strs = base + hp->strings_off;
+
+	/* Every string we are about to look at had better be
+	 * in the string table (which we know ends with a null).
+	 */
+	for ( i=0; i<hp->n_archive; i++ )
+	    if ( ! SNAP_STR_OK ( hp, arp[i] ) )
+		goto stale;
+	for ( i=0; i<hp->n_dirs; i++ )
+	    if ( ! SNAP_STR_OK ( hp, sd[i].path ) )
+		goto stale;
+	for ( i=0; i<hp->n_sdir; i++ )
+	    if ( ! SNAP_STR_OK ( hp, sr[i].path ) )
+		goto stale;
+	for ( i=0; i<hp->n_method; i++ )
+	    if ( sm[i].type == M_FILE && ! SNAP_STR_OK ( hp, sm[i].path ) )
+		goto stale;
+
+	/* Same archives, in the same order */
+	i = 0;
+	for ( ap = archive_head; ap; ap = ap->next ) {
+	    if ( i >= hp->n_archive )
+		goto stale;
+	    if ( strcmp ( ap->path, &strs[arp[i]] ) != 0 )
+		goto stale;
+	    i++;
+	}
+	if ( i != hp->n_archive )
+	    goto stale;
+
+	/* and nothing has changed in them */
+	for ( i=0; i<hp->n_dirs; i++ ) {
+	    if ( stat ( &strs[sd[i].path], &st ) < 0 )
+		goto stale;
+	    if ( snap_mtime ( &st ) != sd[i].mtime )
+		goto stale;
+	}
+
+	/* Check the sections over before we commit to anything */
+	for ( i=0; i<hp->n_sect; i++ ) {
+	    if ( ss[i].list < 0 || ss[i].list >= SNAP_MAX_LISTS )
+		goto stale;
+	    if ( ss[i].first_dir < 0 || ss[i].first_dir + ss[i].dir_count > hp->n_sdir )
+		goto stale;
+	    if ( grid_cell ( ss[i].latlong ) < 0 )
+		goto stale;
+	}
+
+	/* and make sure the quad tables stay inside the strings */
+	for ( i=0; i<hp->n_sdir; i++ ) {
+	    if ( sr[i].quad_count < 0 || sr[i].quad_names < 0 ||
+		 (long) sr[i].quad_names + (long) sr[i].quad_count * QUAD_NAME > hp->n_strings )
+		goto stale;
+	    for ( s=0; s<N_SERIES; s++ )
+		if ( sr[i].quad_first[s] < 0 ||
+		     sr[i].quad_first[s] + __builtin_popcountll ( sr[i].quad_mask[s] ) > sr[i].quad_count )
+		    goto stale;
+	}
+
+	/* Looks good, rebuild the section tables */
+	sdirs = (struct section_dir *) gmalloc ( hp->n_sdir * sizeof(struct section_dir) + 1 );
+
+	for ( i=0; i<SNAP_MAX_LISTS; i++ )
+	    lists[i] = NULL;
+
+	for ( i=0; i<hp->n_sect; i++ ) {
+	    if ( ! lists[ss[i].list] )
+		lists[ss[i].list] = section_grid_new ();
+
+	    ep = grid_add ( lists[ss[i].list], ss[i].latlong );
+	    ep->dir_count = ss[i].dir_count;
+	    for ( j=ss[i].dir_count-1; j>=0; j-- ) {
+		dp = &sdirs[ss[i].first_dir + j];
+		dp->path = &strs[sr[ss[i].first_dir + j].path];
+		memcpy ( dp->tpq_code, sr[ss[i].first_dir + j].tpq_code, sizeof(dp->tpq_code) );
+		memcpy ( dp->tpq_count, sr[ss[i].first_dir + j].tpq_count, sizeof(dp->tpq_count) );
+		memcpy ( dp->quad_mask, sr[ss[i].first_dir + j].quad_mask, sizeof(dp->quad_mask) );
+		memcpy ( dp->quad_first, sr[ss[i].first_dir + j].quad_first, sizeof(dp->quad_first) );
+		dp->quad_count = sr[ss[i].first_dir + j].quad_count;
+		dp->quad_names = &strs[sr[ss[i].first_dir + j].quad_names];
+		dp->next = ep->dir_head;
+		ep->dir_head = dp;
+	    }
+	}
+
+	/* and the methods, also backwards */
+	for ( i=hp->n_method-1; i>=0; i-- ) {
+	    s = sm[i].series;
+	    if ( s < 0 || s >= N_SERIES )
+		continue;
+	    if ( sm[i].type == M_SECTION && sm[i].list >= 0 && sm[i].list < SNAP_MAX_LISTS && lists[sm[i].list] )
+		add_section_method ( &info.series_info[s], lists[sm[i].list] );
+	    if ( sm[i].type == M_FILE )
+		(void) add_file_method ( &info.series_info[s], &strs[sm[i].path] );
+	}
+
+	for ( s=0; s<N_SERIES; s++ )
+	    info.series_info[s].tpq_count = hp->tpq_count[s];
+
+	info.have_usa = hp->have_usa;
+	info.n_sections = hp->n_sections;
+
+	if ( settings.verbose & V_BASIC )
+	    printf ( "Using archive snapshot %s (%d sections)\n", path, hp->n_sect );
+
+	/* The mapping stays, the section_dir paths and names live in it */
+	return hp->n_archive;
+
+stale:
+	if ( settings.verbose & V_ARCHIVE )
+	    printf ( "Archive snapshot %s is stale, scanning\n", path );
+	munmap ( base, map_size );
+	return 0;
+}
+
 /* This is the usual initialization when we want to setup to
  * view a whole collection of potentially multiple states.
  */
@@ -780,7 +1367,9 @@ archive_init ( void )
 
 	series_init_mapinfo ();
 
-	nar = 0;
+	nar = snap_load ();
+	if ( nar )
+	    return nar;
 
 	info.n_sections = 0;
 
@@ -792,7 +1381,7 @@ archive_init ( void )
 
 	info.have_usa = nar;
 
-	temp_section_head = NULL;
+	temp_sections = section_grid_new ();
 
 	for ( ap = archive_head; ap; ap = ap->next ) {
 	    if ( add_new_archive ( ap->path ) )
@@ -800,20 +1389,24 @@ archive_init ( void )
 	}
 
 	/* XXX - These all use the same section list */
-	add_section_method ( &info.series_info[S_24K], temp_section_head );
-	add_section_method ( &info.series_info[S_24K_AK], temp_section_head );
-	add_section_method ( &info.series_info[S_50K], temp_section_head );
-	add_section_method ( &info.series_info[S_63K], temp_section_head );
-	add_section_method ( &info.series_info[S_100K], temp_section_head );
-	add_section_method ( &info.series_info[S_250K], temp_section_head );
+	add_section_method ( &info.series_info[S_24K], temp_sections );
+	add_section_method ( &info.series_info[S_24K_AK], temp_sections );
+	add_section_method ( &info.series_info[S_50K], temp_sections );
+	add_section_method ( &info.series_info[S_63K], temp_sections );
+	add_section_method ( &info.series_info[S_100K], temp_sections );
+	add_section_method ( &info.series_info[S_250K], temp_sections );
 
 	/* Won't need this if we have the full USA set */
 	if ( ! info.have_usa )
-	    add_section_method ( &info.series_info[S_500K], temp_section_head );
+	    add_section_method ( &info.series_info[S_500K], temp_sections );
 
 	if ( settings.verbose & V_ARCHIVE2 )
 	    show_statistics ();
 
+	/* Everything we just read is worth remembering */
+	tpq_cache_save ();
+	snap_save ();
+
 	return nar;
 }
 
@@ -858,6 +1451,177 @@ show_statistics ( void )
 	    	printf ( "\n" );
 	    show_methods ( &info.series_info[s] );
 	}
+
+	jpeg_cache_stats ();
+}
+
+/* The file methods of a series, bucketed by whole degree.
+ * Back when there were just a handful of state files we could
+ * afford to check them all on every motion event, but with
+ * a few states worth of level 1/2/3 files, plus whatever the
+ * -f switch adds, that list gets long.
+ *
+ * The grid covers the union of all the file bounding boxes.
+ * Each cell holds the methods whose box touches it, in method
+ * list order, so lookup_method() still finds the same file the
+ * plain list walk would have.  The cells are packed: the methods
+ * for cell i are list[first[i]] up to list[first[i+1]].
+ */
+struct file_grid {
+	int lat0;
+	int long0;
+	int nlat;
+	int nlong;
+	int *first;
+	struct method **list;
+	int linear;	/* too spread out, just walk the list */
+};
+
+/* Don't bother if the files are scattered all over the globe */
+#define FILE_GRID_MAX	(180*360)
+
+static void
+file_grid_free ( struct series *sp )
+{
+	struct file_grid *gp = sp->file_grid;
+
+	if ( ! gp )
+	    return;
+
+	free ( (char *) gp->first );
+	free ( (char *) gp->list );
+	free ( (char *) gp );
+	sp->file_grid = NULL;
+}
+
+/* The cells a bounding box touches, clipped to the grid.
+ * A point right on the edge belongs to both files,
+ * so we take the cell on each side of it.
+ */
+static void
+file_grid_span ( struct file_grid *gp, struct tpq_info *tp, int *lat1, int *lat2, int *long1, int *long2 )
+{
+	*lat1 = (int) floor ( tp->s_lat ) - gp->lat0;
+	*lat2 = (int) floor ( tp->n_lat ) - gp->lat0;
+	*long1 = (int) floor ( tp->w_long ) - gp->long0;
+	*long2 = (int) floor ( tp->e_long ) - gp->long0;
+
+	if ( *lat1 < 0 ) *lat1 = 0;
+	if ( *long1 < 0 ) *long1 = 0;
+	if ( *lat2 >= gp->nlat ) *lat2 = gp->nlat - 1;
+	if ( *long2 >= gp->nlong ) *long2 = gp->nlong - 1;
+}
+
+static struct file_grid *
+file_grid_build ( struct series *sp )
+{
+	struct file_grid *gp;
+	struct method *xp;
+	struct tpq_info *tp;
+	double s_lat, n_lat, w_long, e_long;
+	int lat1, lat2, long1, long2;
+	int lat, lng;
+	int ncells;
+	int count;
+	int cell;
+	int n;
+
+	gp = (struct file_grid *) gmalloc ( sizeof(struct file_grid) );
+	memset ( (char *) gp, 0, sizeof(struct file_grid) );
+
+	count = 0;
+	s_lat = w_long = 1000.0;
+	n_lat = e_long = -1000.0;
+	for ( xp = sp->methods; xp; xp = xp->next ) {
+	    if ( xp->type != M_FILE )
+		continue;
+	    tp = xp->tpq;
+	    if ( tp->s_lat < s_lat ) s_lat = tp->s_lat;
+	    if ( tp->n_lat > n_lat ) n_lat = tp->n_lat;
+	    if ( tp->w_long < w_long ) w_long = tp->w_long;
+	    if ( tp->e_long > e_long ) e_long = tp->e_long;
+	    count++;
+	}
+
+	/* An empty grid just says "no file methods" */
+	if ( count == 0 )
+	    return gp;
+
+	gp->lat0 = (int) floor ( s_lat );
+	gp->long0 = (int) floor ( w_long );
+	gp->nlat = (int) floor ( n_lat ) - gp->lat0 + 1;
+	gp->nlong = (int) floor ( e_long ) - gp->long0 + 1;
+
+	if ( gp->nlat < 1 || gp->nlong < 1 || gp->nlat * gp->nlong > FILE_GRID_MAX ) {
+	    gp->nlat = gp->nlong = 0;
+	    gp->linear = 1;
+	    return gp;
+	}
+
+	ncells = gp->nlat * gp->nlong;
+	gp->first = (int *) gmalloc ( (ncells + 1) * sizeof(int) );
+	memset ( (char *) gp->first, 0, (ncells + 1) * sizeof(int) );
+
+	/* Count the methods in each cell ... */
+	n = 0;
+	for ( xp = sp->methods; xp; xp = xp->next ) {
+	    if ( xp->type != M_FILE )
+		continue;
+	    file_grid_span ( gp, xp->tpq, &lat1, &lat2, &long1, &long2 );
+	    for ( lat=lat1; lat<=lat2; lat++ )
+		for ( lng=long1; lng<=long2; lng++ ) {
+		    gp->first[lat * gp->nlong + lng + 1]++;
+		    n++;
+		}
+	}
+
+	for ( cell=0; cell<ncells; cell++ )
+	    gp->first[cell+1] += gp->first[cell];
+
+	/* ... then fill them in, using first[] as a cursor.
+	 * Afterwards first[i] has moved up to where cell i+1 starts,
+	 * so we shift everything back down one.
+	 */
+	gp->list = (struct method **) gmalloc ( (n + 1) * sizeof(struct method *) );
+
+	for ( xp = sp->methods; xp; xp = xp->next ) {
+	    if ( xp->type != M_FILE )
+		continue;
+	    file_grid_span ( gp, xp->tpq, &lat1, &lat2, &long1, &long2 );
+	    for ( lat=lat1; lat<=lat2; lat++ )
+		for ( lng=long1; lng<=long2; lng++ )
+		    gp->list[gp->first[lat * gp->nlong + lng]++] = xp;
+	}
+
+	for ( cell=ncells; cell>0; cell-- )
+	    gp->first[cell] = gp->first[cell-1];
+	gp->first[0] = 0;
+
+	if ( settings.verbose & V_ARCHIVE )
+	    printf ( "File grid for %s: %d files, %d x %d cells at %d %d\n",
+		wonk_series(sp->series), count, gp->nlat, gp->nlong, gp->lat0, gp->long0 );
+
+	return gp;
+}
+
+static int
+file_method_hit ( struct tpq_info *tp )
+{
+	if ( settings.verbose & V_ARCHIVE ) {
+	    printf ( "lookup method checking: %s\n", tp->path );
+	    printf ( "lookup method, long %.4f (%.4f - %.4f)\n", info.long_deg, tp->w_long, tp->e_long );
+	    printf ( "lookup method, lat %.4f (%.4f - %.4f)\n", info.lat_deg, tp->s_lat, tp->n_lat );
+	}
+
+	if ( info.long_deg < tp->w_long )
+	    return 0;
+	if ( info.long_deg > tp->e_long )
+	    return 0;
+	if ( info.lat_deg < tp->s_lat )
+	    return 0;
+	if ( info.lat_deg > tp->n_lat )
+	    return 0;
+	return 1;
 }
 
 /* For a given series, find out if it has a file method
@@ -866,36 +1630,44 @@ show_statistics ( void )
  * since they are the normal cases that use file methods,
  * BUT when we use the -f switch, we inject a single file
  * method in any series, so we need to handle that here too.
+ *
+ * We only look at the files in the grid cell holding the point,
+ * if for some reason we could not build a grid, we check them all.
  */
 static struct method *
 lookup_method ( struct series *sp )
 {
 	struct method *xp;
-	struct tpq_info *tp;
+	struct file_grid *gp;
+	int lat, lng;
+	int cell;
+	int i;
 
-	for ( xp = sp->methods; xp; xp = xp->next ) {
-	    if ( xp->type != M_FILE )
-		continue;
+	if ( ! sp->file_grid )
+	    sp->file_grid = file_grid_build ( sp );
 
-	    tp = xp->tpq;
+	gp = sp->file_grid;
 
-	    if ( settings.verbose & V_ARCHIVE ) {
-		printf ( "lookup method checking: %s\n", tp->path );
-	    	printf ( "lookup method, long %.4f (%.4f - %.4f)\n", info.long_deg, tp->w_long, tp->e_long );
-	    	printf ( "lookup method, lat %.4f (%.4f - %.4f)\n", info.lat_deg, tp->s_lat, tp->n_lat );
+	if ( gp->linear ) {
+	    for ( xp = sp->methods; xp; xp = xp->next ) {
+		if ( xp->type != M_FILE )
+		    continue;
+		if ( file_method_hit ( xp->tpq ) )
+		    return xp;
 	    }
-
-	    if ( info.long_deg < tp->w_long )
-		continue;
-	    if ( info.long_deg > tp->e_long )
-		continue;
-	    if ( info.lat_deg < tp->s_lat )
-		continue;
-	    if ( info.lat_deg > tp->n_lat )
-		continue;
-	    return xp;
+	    return NULL;
 	}
 
+	lat = (int) floor ( info.lat_deg ) - gp->lat0;
+	lng = (int) floor ( info.long_deg ) - gp->long0;
+	if ( lat < 0 || lat >= gp->nlat || lng < 0 || lng >= gp->nlong )
+	    return NULL;
+
+	cell = lat * gp->nlong + lng;
+	for ( i=gp->first[cell]; i<gp->first[cell+1]; i++ )
+	    if ( file_method_hit ( gp->list[i]->tpq ) )
+		return gp->list[i];
+
 	return NULL;
 }
 
@@ -1041,7 +1813,7 @@ setup_series ( void )
 	struct method *xp;
 	struct series *sp;
 	struct tpq_info *tp;
-	struct maplet *mp;
+	int xdim, ydim;
 
 	sp = info.series;
 
@@ -1062,13 +1834,14 @@ setup_series ( void )
 	sp->maplet_long_deg = tp->maplet_long_deg;
 	sp->maplet_lat_deg = tp->maplet_lat_deg;
 
-	/* Just so we can set pixel scale ! */
-	mp = load_maplet_any ( tp->path, sp );
-	if ( ! mp )
+	/* Just so we can set pixel scale !
+	 * This only looks at a JPEG header, once per file.
+	 */
+	if ( ! maplet_pixel_size ( tp, &xdim, &ydim ) )
 	    return 0;
 
-	sp->x_pixel_scale = sp->maplet_long_deg / (double) mp->xdim;
-	sp->y_pixel_scale = sp->maplet_lat_deg / (double) mp->ydim;
+	sp->x_pixel_scale = sp->maplet_long_deg / (double) xdim;
+	sp->y_pixel_scale = sp->maplet_lat_deg / (double) ydim;
 
 	return 1;
 }
@@ -1146,76 +1919,63 @@ iterate_series_method ( mfptr handler )
 }
 #endif
 
-/* Try both upper and lower case path names for the tpq file.
- * It turns out we have to allow the file extension to be
- * lower case, while the name may be upper case, i.e. we
- * must try:
+/* Find the tpq file for a quad within a section directory.
+ * We used to try both upper and lower case path names here,
+ * i.e. all four of:
  * 	c41120A1.tpq
  * 	C41120A1.TPQ
  * 	C41120A1.tpq
  * 	c41120A1.TPQ
+ * which was up to four stat calls per lookup, per section_dir.
+ * Now scan_section() remembers the actual name of every file it
+ * saw, so this is just a table lookup, no system calls at all.
  *
  * Note:
  *  A1 is in the lower right, ABC run from bottom to top.
  *  D6 (or the moral equivalent) is in the upper left, 123 run right to left.
+ *
+ * Now that load_maplet() runs this on every cache lookup, we hand back
+ * a static buffer rather than a fresh copy of the path.  The caller
+ * passes it straight to tpq_lookup(), which keeps its own copy.
  */
 static char *
-section_map_path ( struct section_dir *sdp, int lat_section, int long_section, int lat_quad, int long_quad )
+section_map_path ( struct section_dir *sdp, int lat_quad, int long_quad )
 {
-	char path_buf[100];
+	static char path_buf[100];
+	unsigned long long mask;
 	int lat_q, long_q;
-	int series_letter;
+	int series;
+	int bit;
+	int n;
 
 	/* give a-h for latitude (a at the south)
 	 *  and 1-8 for longitude (1 at the east)
 	 * These run through the full range for the 24K series
 	 * For the 100K series, within a section, we only get 
 	 *  k37118a1 and k37118e1
+	 * (here as 0-7, the offset from 'a' or '1')
 	 */
-	lat_q  = 'a' + lat_quad * info.series->quad_lat_count;
-	long_q = '1' + long_quad * info.series->quad_long_count;
+	lat_q  = lat_quad * info.series->quad_lat_count;
+	long_q = long_quad * info.series->quad_long_count;
 
-	series_letter = sdp->tpq_code[info.series->series];
-
-	/* 1 - try all lower case */
-	sprintf ( path_buf, "%s/%c%2d%03d%c%c.tpq", sdp->path, series_letter, lat_section, long_section, lat_q, long_q );
-	if ( settings.verbose & V_ARCHIVE )
-	    printf ( "Trying %d %d -- %s\n", lat_quad, long_quad, path_buf );
-
-	if ( is_file(path_buf) )
-	    return strhide ( path_buf );
-
-	/* 2 - try all upper case */
-	lat_q  = toupper(lat_q);
-	series_letter = toupper(series_letter);
-
-	sprintf ( path_buf, "%s/%c%2d%03d%c%c.TPQ", sdp->path, series_letter, lat_section, long_section, lat_q, long_q );
-	if ( settings.verbose & V_ARCHIVE )
-	    printf ( "Trying %d %d -- %s\n", lat_quad, long_quad, path_buf );
-
-	if ( is_file(path_buf) )
-	    return strhide ( path_buf );
+	if ( lat_q < 0 || lat_q > 7 || long_q < 0 || long_q > 7 )
+	    return NULL;
 
-	/* 3 - try upper case name, with lower case .tpq */
-	sprintf ( path_buf, "%s/%c%2d%03d%c%c.tpq", sdp->path, series_letter, lat_section, long_section, lat_q, long_q );
-	if ( settings.verbose & V_ARCHIVE )
-	    printf ( "Trying %d %d -- %s\n", lat_quad, long_quad, path_buf );
+	series = info.series->series;
+	bit = QUAD_BIT ( lat_q, long_q );
+	mask = sdp->quad_mask[series];
 
-	if ( is_file(path_buf) )
-	    return strhide ( path_buf );
+	if ( ! (mask & (1ULL << bit)) )
+	    return NULL;
 
-	/* 4 - unlikely, but try lower case name, with upper case .TPQ */
-	lat_q  = tolower(lat_q);
-	series_letter = tolower(series_letter);
+	/* count the files before ours in this series */
+	n = sdp->quad_first[series] + __builtin_popcountll ( mask & ((1ULL << bit) - 1) );
 
-	sprintf ( path_buf, "%s/%c%2d%03d%c%c.TPQ", sdp->path, series_letter, lat_section, long_section, lat_q, long_q );
+	sprintf ( path_buf, "%s/%s", sdp->path, &sdp->quad_names[n*QUAD_NAME] );
 	if ( settings.verbose & V_ARCHIVE )
-	    printf ( "Trying %d %d -- %s\n", lat_quad, long_quad, path_buf );
-
-	if ( is_file(path_buf) )
-	    return strhide ( path_buf );
+	    printf ( "Found %d %d -- %s\n", lat_quad, long_quad, path_buf );
 
-	return NULL;
+	return path_buf;
 }
 
 /* In the current scheme of things (which is handling equal sized maps
@@ -1227,7 +1987,7 @@ section_map_path ( struct section_dir *sdp, int lat_section, int long_section, i
  * within the usual degree section setup.  Other states, who knows.
  */
 static char *
-section_find_map ( struct section *head, int lat_section, int long_section, int lat_quad, int long_quad )
+section_find_map ( struct section_grid *head, int lat_section, int long_section, int lat_quad, int long_quad )
 {
 	struct section *ep;
 	struct section_dir *sdp;
@@ -1242,7 +2002,7 @@ section_find_map ( struct section *head, int lat_section, int long_section, int
 	 * where one section directory comes from each state).
 	 */
 	for ( sdp=ep->dir_head; sdp; sdp = sdp->next ) {
-	    rv = section_map_path ( sdp, lat_section, long_section, lat_quad, long_quad );
+	    rv = section_map_path ( sdp, lat_quad, long_quad );
 	    if ( rv )
 	    	return rv;
 	}
@@ -1386,6 +2146,25 @@ lookup_series ( struct maplet *mp )
 	return 0;
 }
 
+/* None of the above is thread safe (and lookups change info.series
+ * and the position in info as they go).  The GUI and --export do all
+ * their lookups on the main thread, but the tile server (serve.c) has
+ * no main thread to speak of, so its workers take turns with this.
+ */
+static pthread_mutex_t archive_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+void
+archive_lock ( void )
+{
+	pthread_mutex_lock ( &archive_mutex );
+}
+
+void
+archive_unlock ( void )
+{
+	pthread_mutex_unlock ( &archive_mutex );
+}
+
 /* Look for the SI_D01 directory (either case)
  * Notice recursion limited to one level.
  */
@@ -1398,7 +2177,7 @@ add_usa ( char *archive, int depth )
 	if ( ! is_directory ( archive ) )
 	    return 0;
 
-	if ( ! (dd = opendir ( archive )) )
+	if ( ! (dd = archive_opendir ( archive )) )
 	    return 0;
 
 	/* Loop through this possible archive, looking
@@ -1442,7 +2221,7 @@ add_new_archive ( char *archive )
 	if ( ! is_directory ( archive ) )
 	    return 0;
 
-	if ( ! (dd = opendir ( archive )) )
+	if ( ! (dd = archive_opendir ( archive )) )
 	    return 0;
 
 	/* Loop through this possible archive, look
@@ -1480,7 +2259,7 @@ add_disk ( char *archive, char *disk )
 	if ( ! is_directory ( disk_path ) )
 	    return 0;
 
-	if ( ! (dd = opendir ( disk_path )) )
+	if ( ! (dd = archive_opendir ( disk_path )) )
 	    return 0;
 
 	if ( settings.verbose & V_BASIC )
@@ -1499,7 +2278,7 @@ add_disk ( char *archive, char *disk )
 	    if ( strcmp_l("si_d01", dp->d_name) == 0 )
 		continue;
 	    if ( dp->d_name[0] == 'D' || dp->d_name[0] == 'd' )
-	    	add_section ( disk_path, dp->d_name, &temp_section_head );
+	    	add_section ( disk_path, dp->d_name, temp_sections );
 	}
 
 	closedir ( dd );
@@ -1537,24 +2316,83 @@ add_disk ( char *archive, char *disk )
  * 	the "standard" letters which is also present.
  */
 
+
+/* Which quad slot a filename like "c41120A1.tpq" is for, or -1.
+ * The lat/long digits must match the section it lives in,
+ * since section_map_path() never used to look for anything else.
+ */
+static int
+quad_slot ( char *name, int latlong )
+{
+	char digits[8];
+	int lat_q, long_q;
+
+	sprintf ( digits, "%2d%03d", latlong / 1000, latlong % 1000 );
+	if ( strncmp ( &name[1], digits, 5 ) != 0 )
+	    return -1;
+
+	lat_q = tolower ( name[6] ) - 'a';
+	long_q = name[7] - '1';
+	if ( lat_q < 0 || lat_q > 7 || long_q < 0 || long_q > 7 )
+	    return -1;
+
+	return QUAD_BIT ( lat_q, long_q );
+}
+
+/* Pack the names scan_section() collected into the section_dir */
+static void
+quad_pack ( struct section_dir *sdp, char names[N_SERIES][64][QUAD_NAME] )
+{
+	int series;
+	int bit;
+	int n;
+
+	n = 0;
+	for ( series=0; series<N_SERIES; series++ )
+	    n += __builtin_popcountll ( sdp->quad_mask[series] );
+
+	sdp->quad_count = n;
+	sdp->quad_names = NULL;
+	if ( n == 0 )
+	    return;
+
+	sdp->quad_names = gmalloc ( n * QUAD_NAME );
+
+	n = 0;
+	for ( series=0; series<N_SERIES; series++ ) {
+	    sdp->quad_first[series] = n;
+	    for ( bit=0; bit<64; bit++ )
+		if ( sdp->quad_mask[series] & (1ULL << bit) ) {
+		    memcpy ( &sdp->quad_names[n*QUAD_NAME], names[series][bit], QUAD_NAME );
+		    n++;
+		}
+	}
+}
+
 static int
-scan_section ( struct section_dir *sdp, char *path )
+scan_section ( struct section_dir *sdp, char *path, int latlong )
 {
 	DIR *dd;
 	struct dirent *dp;
 	int total_count;
 	int letter;
 	int series;
+	int bit;
+	char names[N_SERIES][64][QUAD_NAME];
 
 	for ( series=0; series<N_SERIES; series++ ) {
 	    sdp->tpq_count[series] = 0;
 	    sdp->tpq_code[series] = ' ';
+	    sdp->quad_mask[series] = 0;
+	    sdp->quad_first[series] = 0;
 	}
+	sdp->quad_count = 0;
+	sdp->quad_names = NULL;
 
 	if ( ! is_directory ( path ) )
 	    return 0;
 
-	if ( ! (dd = opendir ( path )) )
+	if ( ! (dd = archive_opendir ( path )) )
 	    return 0;
 
 	total_count = 0;
@@ -1609,11 +2447,30 @@ scan_section ( struct section_dir *sdp, char *path )
 		total_count ++;
 	    } else {
 	    	printf ( "Unrecognizable TPQ file: %s/%s\n", path, dp->d_name );
+		continue;
+	    }
+
+	    /* Remember the actual name for section_map_path().
+	     * If we see the same quad twice (only possible with mixed case
+	     * names), prefer the lower case one, which is what we used to try first.
+	     */
+	    bit = quad_slot ( dp->d_name, latlong );
+	    if ( bit < 0 ) {
+		if ( settings.verbose & V_ARCHIVE2 )
+		    printf ( "Not a quad of this section: %s/%s\n", path, dp->d_name );
+		continue;
+	    }
+
+	    if ( ! (sdp->quad_mask[series] & (1ULL << bit)) || strcmp ( dp->d_name, names[series][bit] ) > 0 ) {
+		strcpy ( names[series][bit], dp->d_name );
+		sdp->quad_mask[series] |= 1ULL << bit;
 	    }
 	}
 
 	closedir ( dd );
 
+	quad_pack ( sdp, names );
+
 	return total_count;
 }
 
@@ -1628,7 +2485,7 @@ scan_section ( struct section_dir *sdp, char *path )
  * if it is on the boundary of several states.
  */
 static int
-add_section ( char *disk, char *section, struct section **head )
+add_section ( char *disk, char *section, struct section_grid *grid )
 {
 	char section_path[100];
 	struct section_dir *sdp;
@@ -1650,14 +2507,17 @@ add_section ( char *disk, char *section, struct section **head )
 	sdp->path = strhide ( section_path );
 	sdp->next = (struct section_dir *) NULL;
 
-	count = scan_section ( sdp, section_path );
+	count = scan_section ( sdp, section_path, latlong );
 
 	/* Alaska */
 	if ( lat > 52 ) {
 	    sdp->tpq_code[S_24K_AK] = sdp->tpq_code[S_24K];
 	    sdp->tpq_count[S_24K_AK] = sdp->tpq_count[S_24K];
+	    sdp->quad_mask[S_24K_AK] = sdp->quad_mask[S_24K];
+	    sdp->quad_first[S_24K_AK] = sdp->quad_first[S_24K];
 	    sdp->tpq_code[S_24K] = ' ';
 	    sdp->tpq_count[S_24K] = 0;
+	    sdp->quad_mask[S_24K] = 0;
 	}
 
 	/* is there anything in there that we recognize ? */
@@ -1670,23 +2530,19 @@ add_section ( char *disk, char *section, struct section **head )
 	for ( i=0; i<N_SERIES; i++ )
 	    info.series_info[i].tpq_count += sdp->tpq_count[i];
 
-	ep = lookup_section ( *head, latlong );
+	ep = lookup_section ( grid, latlong );
 
 	if ( ! ep ) {
-	    /* Does not yet exist on main list */
-	    ep = (struct section *) gmalloc ( sizeof(struct section) );
-	    if ( ! ep )
-		error ("Section new - out of memory\n");
-
-	    ep->latlong = latlong;
-	    ep->dir_head = (struct section_dir *) NULL;
-	    ep->dir_count = 0;
+	    /* Does not yet exist in the table */
+	    ep = grid_add ( grid, latlong );
+	    if ( ! ep ) {
+		printf ("Section out of range: %s\n", section_path );
+		return 0;
+	    }
 
 	    if ( settings.verbose & V_ARCHIVE )
 		printf ( "Added section:" );
 
-	    ep->next = *head;
-	    *head = ep;
 	    info.n_sections++;
 	} else {
 	    if ( settings.verbose & V_ARCHIVE )
@@ -1711,16 +2567,76 @@ add_section ( char *disk, char *section, struct section **head )
 	return 1;
 }
 
+static struct section_grid *
+section_grid_new ( void )
+{
+	struct section_grid *gp;
+
+	gp = (struct section_grid *) gmalloc ( sizeof(struct section_grid) );
+	memset ( gp, 0, sizeof(struct section_grid) );
+	return gp;
+}
+
+/* where latlong goes in the grid, or -1 if off the grid */
+static int
+grid_cell ( int latlong )
+{
+	int lat, lng;
+
+	if ( latlong < 0 )
+	    return -1;
+
+	lat = latlong / 1000;
+	lng = latlong % 1000;
+	if ( lat >= GRID_LATS || lng >= GRID_LONGS )
+	    return -1;
+
+	return lat * GRID_LONGS + lng;
+}
+
 static struct section *
-lookup_section ( struct section *head, int latlong )
+lookup_section ( struct section_grid *grid, int latlong )
+{
+	int cell;
+
+	if ( ! grid )
+	    return NULL;
+
+	cell = grid_cell ( latlong );
+	if ( cell < 0 || ! grid->cells[cell] )
+	    return NULL;
+
+	return &grid->sects[grid->cells[cell] - 1];
+}
+
+/* Add a new (empty) section to the table.
+ * Note that this can move the others around.
+ */
+static struct section *
+grid_add ( struct section_grid *grid, int latlong )
 {
 	struct section *ep;
+	int cell;
+
+	cell = grid_cell ( latlong );
+	if ( cell < 0 )
+	    return NULL;
 
-	for ( ep = head; ep; ep = ep->next ) {
-	    if ( ep->latlong == latlong )
-	    	return ep;
+	if ( grid->count >= grid->alloc ) {
+	    grid->alloc = grid->alloc ? grid->alloc * 2 : 256;
+	    grid->sects = (struct section *) realloc ( grid->sects, grid->alloc * sizeof(struct section) );
+	    if ( ! grid->sects )
+		error ("Section new - out of memory\n");
 	}
-	return NULL;
+
+	ep = &grid->sects[grid->count++];
+	ep->latlong = latlong;
+	ep->dir_head = (struct section_dir *) NULL;
+	ep->dir_count = 0;
+
+	grid->cells[cell] = grid->count;
+
+	return ep;
 }
 
 struct dir_table {
@@ -1818,7 +2734,7 @@ add_dir ( char *archive, char *dir )
 	if ( settings.verbose & V_ARCHIVE )
 	    printf ( "add dir: %d %s\n", series, dir_path );
 
-	if ( ! (dd = opendir ( dir_path )) )
+	if ( ! (dd = archive_opendir ( dir_path )) )
 	    return 0;
 
 	for ( ;; ) {
@@ -1893,7 +2809,7 @@ add_usa_12 ( char *path, char *name )
 	if ( ! is_directory ( map_path ) )
 	    return;
 
-	if ( ! (dd = opendir ( map_path )) )
+	if ( ! (dd = archive_opendir ( map_path )) )
 	    return;
 
 	/* Loop through this directory
@@ -1943,7 +2859,7 @@ add_usa_500k ( char *path, char *name )
 	if ( ! is_directory ( map_path ) )
 	    return;
 
-	if ( ! (dd = opendir ( map_path )) )
+	if ( ! (dd = archive_opendir ( map_path )) )
 	    return;
 
 	/* Loop through this directory
@@ -1960,7 +2876,7 @@ add_usa_500k ( char *path, char *name )
 		continue;
 	    }
 	    if ( dp->d_name[0] == 'd' || dp->d_name[0] == 'D' ) {
-	    	add_section ( map_path, dp->d_name, &temp_section_head );
+	    	add_section ( map_path, dp->d_name, temp_sections );
 		continue;
 	    }
 	}
@@ -1985,10 +2901,10 @@ add_full_usa ( char *path, char *name )
 	if ( settings.verbose & V_BASIC )
 	    printf ( "Found level 123 for full USA at %s\n", si_path );
 
-	if ( ! (dd = opendir ( si_path )) )
+	if ( ! (dd = archive_opendir ( si_path )) )
 	    return;
 
-	temp_section_head = NULL;
+	temp_sections = section_grid_new ();
 
 	/* Loop through this directory
 	 */
@@ -2011,7 +2927,7 @@ add_full_usa ( char *path, char *name )
 
 	closedir ( dd );
 
-	add_section_method ( &info.series_info[S_500K], temp_section_head );
+	add_section_method ( &info.series_info[S_500K], temp_sections );
 }
 
 /* THE END */
@@ -0,0 +1,443 @@
+/*
+ *  GTopo
+ *
+ *  Copyright (C) 2007, Thomas J. Trebisky
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Street #330, Boston, MA 02111-1307, USA.
+ */
+
+/* bench.c -- part of gtopo
+ * Tom Trebisky  MMT Observatory, Tucson, Arizona
+ *
+ * A benchmark for panning and zooming, i.e.
+ *  gtopo --bench ../tools/bench.txt [--cold] [--size 640x800]
+ *
+ * Whenever somebody makes a change to make panning faster, the
+ * question is always "did it?", and wiggling the mouse around and
+ * squinting is no way to answer that.  So this reads a script of
+ * the same moves the GUI makes:
+ *
+ *  set_position long lat	(go someplace, like the places window does)
+ *  move_map dx dy		(the arrow keys, quarter screens)
+ *  shift_xy x y		(a mouse drag, in pixels)
+ *  up_series			(less detail)
+ *  down_series			(more detail)
+ *  series 24k			(switch to a series directly)
+ *  cold			(throw away everything we have cached)
+ *  repeat N ... end		(do the lines in between N times)
+ *
+ * After every move (a frame) we draw the whole view, the same way
+ * --render does, and time the move and the drawing together.
+ * With --cold, every frame starts with nothing cached.
+ * At the end we tell how the frames went (percentiles for each kind
+ * of move), and how many maplets that took, how many bytes we read,
+ * and how much time went into decoding JPEG.
+ *
+ * This runs without a display, so it cannot time what the GUI does
+ * with pixmaps (pixmap_scroll in particular), and the loader threads
+ * sit it out.  What it does time is finding, reading and decoding
+ * maplets, which is where the time goes on a cold start anyway.
+ */
+
+#include <gtk/gtk.h>
+#include <glib/gstdio.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "gtopo.h"
+#include "protos.h"
+
+extern struct topo_info info;
+extern struct settings settings;
+extern struct viewport vp_info;
+
+#define MAX_NEST	8
+
+enum b_type { B_SET, B_MOVE, B_SHIFT, B_UP, B_DOWN, B_SERIES, N_MOVES,
+	B_COLD = N_MOVES, B_REPEAT, B_END };
+
+static char *b_names[] = {
+	"set_position", "move_map", "shift_xy", "up_series", "down_series", "series",
+	"cold", "repeat", "end"
+};
+
+struct b_op {
+	enum b_type type;
+	double a;
+	double b;
+};
+
+static struct b_op *ops = NULL;
+static int num_ops = 0;
+static int ops_alloc = 0;
+
+/* What we learn, one entry per frame */
+static double *frame_time = NULL;
+static enum b_type *frame_type = NULL;
+static int num_frames = 0;
+static int frames_alloc = 0;
+
+static double
+bench_time ( void )
+{
+	struct timeval tv;
+
+	gettimeofday ( &tv, NULL );
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static struct b_op *
+op_add ( enum b_type type )
+{
+	if ( num_ops >= ops_alloc ) {
+	    ops_alloc = ops_alloc ? ops_alloc * 2 : 64;
+	    ops = (struct b_op *) realloc ( ops, ops_alloc * sizeof(struct b_op) );
+	    if ( ! ops )
+		error ( "bench, out of memory\n" );
+	}
+
+	ops[num_ops].type = type;
+	ops[num_ops].a = 0.0;
+	ops[num_ops].b = 0.0;
+	return &ops[num_ops++];
+}
+
+static void
+frame_add ( enum b_type type, double secs )
+{
+	if ( num_frames >= frames_alloc ) {
+	    frames_alloc = frames_alloc ? frames_alloc * 2 : 256;
+	    frame_time = (double *) realloc ( frame_time, frames_alloc * sizeof(double) );
+	    frame_type = (enum b_type *) realloc ( frame_type, frames_alloc * sizeof(enum b_type) );
+	    if ( ! frame_time || ! frame_type )
+		error ( "bench, out of memory\n" );
+	}
+
+	frame_time[num_frames] = secs;
+	frame_type[num_frames] = type;
+	num_frames++;
+}
+
+/* Read the script.  Blank lines and anything after a # are ignored.
+ * Returns 0 (after saying why) if we don't like it.
+ */
+static int
+bench_read ( char *path )
+{
+	FILE *fp;
+	char line[256];
+	char word[32];
+	char arg1[64];
+	char arg2[64];
+	struct b_op *op;
+	char *p;
+	int depth;
+	int lineno;
+	int series;
+	int nargs;
+	int i;
+
+	if ( ! (fp = fopen ( path, "r" )) ) {
+	    printf ( "Cannot open bench script %s\n", path );
+	    return 0;
+	}
+
+	depth = 0;
+	lineno = 0;
+
+	while ( fgets ( line, sizeof(line), fp ) ) {
+	    lineno++;
+	    if ( p = strchr ( line, '#' ) )
+		*p = '\0';
+
+	    nargs = sscanf ( line, "%31s %63s %63s", word, arg1, arg2 );
+	    if ( nargs < 1 )
+		continue;
+
+	    for ( i=0; i <= B_END; i++ )
+		if ( strcmp ( word, b_names[i] ) == 0 )
+		    break;
+
+	    if ( i > B_END ) {
+		printf ( "%s line %d: no such thing as %s\n", path, lineno, word );
+		goto bad;
+	    }
+
+	    op = op_add ( i );
+
+	    switch ( op->type ) {
+		case B_SET:
+		    if ( nargs < 3 )
+			goto args;
+		    op->a = parse_dms ( arg1 );
+		    op->b = parse_dms ( arg2 );
+		    break;
+		case B_MOVE:
+		case B_SHIFT:
+		    if ( nargs < 3 )
+			goto args;
+		    op->a = atof ( arg1 );
+		    op->b = atof ( arg2 );
+		    break;
+		case B_SERIES:
+		    if ( nargs < 2 )
+			goto args;
+		    series = -1;
+		    gronk_series ( &series, arg1 );
+		    if ( series < 0 ) {
+			printf ( "%s line %d: no such series as %s\n", path, lineno, arg1 );
+			goto bad;
+		    }
+		    op->a = series;
+		    break;
+		case B_REPEAT:
+		    if ( nargs < 2 || atoi ( arg1 ) < 1 )
+			goto args;
+		    if ( ++depth > MAX_NEST ) {
+			printf ( "%s line %d: repeats nested too deep\n", path, lineno );
+			goto bad;
+		    }
+		    op->a = atoi ( arg1 );
+		    break;
+		case B_END:
+		    if ( --depth < 0 ) {
+			printf ( "%s line %d: end without repeat\n", path, lineno );
+			goto bad;
+		    }
+		    break;
+		default:
+		    break;
+	    }
+	    continue;
+args:
+	    printf ( "%s line %d: not enough for %s\n", path, lineno, word );
+	    goto bad;
+	}
+
+	fclose ( fp );
+
+	if ( depth ) {
+	    printf ( "%s: repeat without end\n", path );
+	    return 0;
+	}
+
+	return 1;
+
+bad:
+	fclose ( fp );
+	return 0;
+}
+
+/* Make the move, just the way the GUI would.
+ * Everything here that would redraw the pixmap
+ * knows better when we are running headless.
+ */
+static void
+bench_move ( struct b_op *op )
+{
+	switch ( op->type ) {
+	    case B_SET:
+		set_position ( op->a, op->b );
+		break;
+	    case B_MOVE:
+		move_map ( (int) op->a, (int) op->b );
+		break;
+	    case B_SHIFT:
+		shift_xy ( op->a, op->b );
+		break;
+	    case B_UP:
+		up_series ();
+		break;
+	    case B_DOWN:
+		down_series ();
+		break;
+	    case B_SERIES:
+		set_series ( (int) op->a );
+		break;
+	    default:
+		break;
+	}
+}
+
+static void
+bench_cold ( void )
+{
+	maplet_cache_flush ();
+	tpq_pool_flush ();
+}
+
+static int
+time_compare ( const void *a, const void *b )
+{
+	double ta = *(const double *) a;
+	double tb = *(const double *) b;
+
+	if ( ta < tb )
+	    return -1;
+	return ta > tb;
+}
+
+/* nearest rank, on a sorted list */
+static double
+percentile ( double *list, int n, double pct )
+{
+	int i;
+
+	i = (int) (pct / 100.0 * n + 0.999999) - 1;
+	if ( i < 0 )
+	    i = 0;
+	if ( i >= n )
+	    i = n - 1;
+	return list[i];
+}
+
+static void
+report_line ( char *name, enum b_type type, int all )
+{
+	double *list;
+	double sum;
+	int n;
+	int i;
+
+	list = (double *) gmalloc ( (num_frames + 1) * sizeof(double) );
+
+	n = 0;
+	sum = 0.0;
+	for ( i=0; i<num_frames; i++ ) {
+	    if ( ! all && frame_type[i] != type )
+		continue;
+	    list[n++] = frame_time[i] * 1000.0;
+	    sum += frame_time[i] * 1000.0;
+	}
+
+	if ( n ) {
+	    qsort ( list, n, sizeof(double), time_compare );
+	    printf ( "  %-14s %6d %8.2f %8.2f %8.2f %8.2f %8.2f\n", name, n,
+		sum / n,
+		percentile ( list, n, 50.0 ),
+		percentile ( list, n, 90.0 ),
+		percentile ( list, n, 99.0 ),
+		list[n-1] );
+	}
+
+	free ( (char *) list );
+}
+
+static void
+bench_report ( char *path, int cold, double total, struct load_stats *sp )
+{
+	int i;
+
+	printf ( "Bench %s: %d frames at %d by %d, %s\n", path, num_frames,
+	    vp_info.vx, vp_info.vy, cold ? "cold every frame" : "warm" );
+
+	printf ( "  %-14s %6s %8s %8s %8s %8s %8s  (ms)\n",
+	    "", "frames", "mean", "p50", "p90", "p99", "max" );
+	for ( i=0; i<N_MOVES; i++ )
+	    report_line ( b_names[i], i, 0 );
+	report_line ( "all", 0, 1 );
+
+	printf ( "Maplets decoded: %ld, %ld read from TPQ files (%ld bytes), %ld from the JPEG cache\n",
+	    sp->loads, sp->reads, sp->bytes, sp->loads - sp->reads );
+	if ( sp->loads )
+	    printf ( "Decode time: %.3f seconds, %.2f ms per maplet\n",
+		sp->decode, sp->decode * 1000.0 / sp->loads );
+	printf ( "Total time: %.3f seconds in frames\n", total );
+}
+
+/* Run a benchmark script from where first_series put us.
+ * Returns a status for exit().
+ */
+int
+bench_run ( char *path, int cold )
+{
+	struct load_stats before, after;
+	struct { int pc; int left; } stack[MAX_NEST];
+	cairo_surface_t *surface;
+	cairo_t *cr;
+	struct b_op *op;
+	double total;
+	double t1;
+	int depth;
+	int pc;
+
+	if ( ! bench_read ( path ) )
+	    return 1;
+
+	render_setup ();
+
+	surface = cairo_image_surface_create ( CAIRO_FORMAT_RGB24, vp_info.vx, vp_info.vy );
+	cr = cairo_create ( surface );
+
+	tpq_load_stats ( &before );
+
+	total = 0.0;
+	depth = 0;
+
+	for ( pc = 0; pc < num_ops; pc++ ) {
+	    op = &ops[pc];
+
+	    if ( op->type == B_REPEAT ) {
+		stack[depth].pc = pc;
+		stack[depth].left = (int) op->a;
+		depth++;
+		continue;
+	    }
+	    if ( op->type == B_END ) {
+		if ( --stack[depth-1].left > 0 )
+		    pc = stack[depth-1].pc;
+		else
+		    depth--;
+		continue;
+	    }
+	    if ( op->type == B_COLD ) {
+		bench_cold ();
+		continue;
+	    }
+
+	    if ( cold )
+		bench_cold ();
+
+	    t1 = bench_time ();
+	    bench_move ( op );
+	    render_frame ( cr );
+	    t1 = bench_time () - t1;
+
+	    if ( settings.verbose & V_BASIC )
+		printf ( "bench: %s to %.4f, %.4f (%s) in %.2f ms\n", b_names[op->type],
+		    info.long_deg, info.lat_deg, wonk_series ( info.series->series ), t1 * 1000.0 );
+
+	    frame_add ( op->type, t1 );
+	    total += t1;
+	}
+
+	tpq_load_stats ( &after );
+
+	cairo_destroy ( cr );
+	cairo_surface_destroy ( surface );
+
+	after.loads -= before.loads;
+	after.reads -= before.reads;
+	after.bytes -= before.bytes;
+	after.decode -= before.decode;
+
+	bench_report ( path, cold, total, &after );
+
+	return 0;
+}
+
+/* THE END */
@@ -0,0 +1,971 @@
+/*
+ *  GTopo
+ *
+ *  Copyright (C) 2007, Thomas J. Trebisky
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Street #330, Boston, MA 02111-1307, USA.
+ */
+
+/* export.c -- part of gtopo
+ * Tom Trebisky  MMT Observatory, Tucson, Arizona
+ *
+ * Export a tile pyramid, i.e.
+ *  gtopo --export tiles --bbox -111.0,31.5,-110.5,32.0 [--zoom 10-15]
+ *
+ * This gives the usual "slippy map" web mercator tiles, 256 pixels
+ * square, in tiles/z/x/y.png, which just about any map program on a
+ * tablet or phone knows what to do with.  If the name ends in .mbtiles
+ * (and we were built with MBTILES) we put them all in one sqlite file
+ * instead, which is easier to copy around.
+ *
+ * For each zoom level we pick a series from the chain
+ *  24K -> 100K -> 500K -> ATLAS
+ * whose pixels are about the size of the tile pixels, or a bit smaller.
+ * Past the end of the chain we just use what we have.
+ *
+ * Finding maplets goes through maplet_lookup(), which means
+ * lookup_series() and all the methods, so whatever archive layout
+ * the GUI can show, we can export.  That part is not thread safe,
+ * so the work goes in batches of tiles, in three steps:
+ *
+ *  1) the main thread works out which maplets cover each tile,
+ *     and makes a list of the ones not already in the cache.
+ *  2) the threads decode the list, each maplet once, into the cache.
+ *  3) the threads resample the tiles and write them out.
+ *
+ * Nothing gets trimmed out of the cache until the batch is done
+ * (only the main thread does that), so we can hang onto maplet
+ * pointers in step 3.  A batch is a run of tiles down one column,
+ * and the next column shares most of its maplets, so with a decent
+ * maplet_cache_mb nothing gets decoded twice.
+ */
+
+#include <gtk/gtk.h>
+#include <glib/gstdio.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+
+#ifdef MBTILES
+#include <sqlite3.h>
+#endif
+
+#include "gtopo.h"
+#include "protos.h"
+
+extern struct topo_info info;
+extern struct settings settings;
+
+#define TILE_SIZE	256
+#define EXPORT_BATCH	64
+#define MAX_EXPORTERS	64
+
+/* web mercator gives out here */
+#define MERC_LAT	85.0511
+
+/* just enough to get us over a maplet edge */
+#define CELL_EPS	1.0e-9
+
+/* We will use a series with pixels up to this much
+ * bigger than the tile pixels rather than go to a finer one.
+ */
+#define SERIES_STRETCH	1.5
+
+/* widest box we will average over when shrinking */
+#define MAX_BOX		8
+
+static enum s_type export_chain[] = { S_24K, S_100K, S_500K, S_ATLAS };
+#define N_CHAIN		(sizeof(export_chain) / sizeof(export_chain[0]))
+
+/* A maplet and where it is, in degrees */
+struct cell {
+	struct maplet *mp;
+	struct tpq_info *tpq;
+	int index;
+	int box;
+	double west;
+	double north;
+	double width;
+	double height;
+};
+
+struct tile {
+	int z;
+	int x;
+	int y;
+	int series;
+	struct cell *cells;
+	int ncells;
+	int acells;
+
+	/* the encoded tile, for MBTiles and the tile server */
+	int in_memory;
+	unsigned char *png;
+	long png_size;
+	long png_alloc;
+};
+
+/* maplets waiting to be decoded */
+struct joblist {
+	struct maplet **jobs;
+	int count;
+	int alloc;
+};
+
+static char *export_path;
+static int export_mb = 0;
+static int num_exporters;
+
+static struct tile batch[EXPORT_BATCH];
+static int batch_count;
+
+static struct joblist batch_jobs;
+
+static long tiles_done;
+static long maplets_done;
+
+/* ---------------------------------------------------- */
+
+/* A simple pool of threads, all working on the same list of jobs.
+ * The main thread pitches in, so this works with no threads at all.
+ */
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static int pool_next;
+static int pool_count;
+static void (*pool_func) ( int );
+
+static void *
+pool_worker ( void *arg )
+{
+	int j;
+
+	for ( ;; ) {
+	    pthread_mutex_lock ( &pool_lock );
+	    j = pool_next++;
+	    pthread_mutex_unlock ( &pool_lock );
+
+	    if ( j >= pool_count )
+		break;
+	    (*pool_func) ( j );
+	}
+
+	return NULL;
+}
+
+static void
+pool_run ( void (*func) ( int ), int count )
+{
+	pthread_t threads[MAX_EXPORTERS];
+	int n, i;
+
+	pool_func = func;
+	pool_next = 0;
+	pool_count = count;
+
+	n = num_exporters - 1;
+	if ( n > count - 1 )
+	    n = count - 1;
+
+	for ( i=0; i<n; i++ )
+	    if ( pthread_create ( &threads[i], NULL, pool_worker, NULL ) != 0 )
+		break;
+	n = i;
+
+	pool_worker ( NULL );
+
+	for ( i=0; i<n; i++ )
+	    pthread_join ( threads[i], NULL );
+}
+
+/* ---------------------------------------------------- */
+
+/* Tile numbers to and from long/lat (the usual slippy map formulas) */
+
+static double
+tile_long ( int z, double x )
+{
+	return x / (double) (1<<z) * 360.0 - 180.0;
+}
+
+static double
+tile_lat ( int z, double y )
+{
+	double n;
+
+	n = PI * ( 1.0 - 2.0 * y / (double) (1<<z) );
+	return atan ( sinh ( n ) ) * RADTODEG;
+}
+
+static int
+long_tile ( int z, double long_deg )
+{
+	int n = 1<<z;
+	int x;
+
+	x = floor ( (long_deg + 180.0) / 360.0 * n );
+	if ( x < 0 ) x = 0;
+	if ( x >= n ) x = n - 1;
+	return x;
+}
+
+static int
+lat_tile ( int z, double lat_deg )
+{
+	int n = 1<<z;
+	double r;
+	int y;
+
+	if ( lat_deg > MERC_LAT ) lat_deg = MERC_LAT;
+	if ( lat_deg < -MERC_LAT ) lat_deg = -MERC_LAT;
+
+	r = lat_deg * DEGTORAD;
+	y = floor ( (1.0 - log ( tan(r) + 1.0/cos(r) ) / PI) / 2.0 * n );
+	if ( y < 0 ) y = 0;
+	if ( y >= n ) y = n - 1;
+	return y;
+}
+
+/* degrees per pixel (east-west) at zoom z */
+static double
+zoom_scale ( int z )
+{
+	return 360.0 / (double) (TILE_SIZE << z);
+}
+
+/* The zoom at which a series is shown pixel for pixel */
+static int
+series_zoom ( struct series *sp )
+{
+	return floor ( log ( 360.0 / (TILE_SIZE * sp->x_pixel_scale) ) / log ( 2.0 ) + 0.5 );
+}
+
+/* ---------------------------------------------------- */
+
+/* Queue a maplet to be decoded, unless it already is */
+static void
+job_add ( struct joblist *jp, struct maplet *probe )
+{
+	int i;
+
+	for ( i=0; i<jp->count; i++ )
+	    if ( jp->jobs[i]->tpq == probe->tpq && jp->jobs[i]->tpq_index == probe->tpq_index )
+		return;
+
+	if ( jp->count >= jp->alloc ) {
+	    jp->alloc = jp->alloc ? jp->alloc * 2 : 256;
+	    jp->jobs = (struct maplet **) realloc ( jp->jobs, jp->alloc * sizeof(struct maplet *) );
+	}
+
+	jp->jobs[jp->count++] = maplet_dup ( probe );
+}
+
+/* Which maplet is at long, lat in the current series, and
+ * where are its edges.  This is the same dance pixmap_redraw does
+ * (setup_series and synch_position) so we see what the GUI would.
+ * This fills in the cell, with the maplet if it is in the cache,
+ * and queues it to be decoded if it is not.
+ * (cell->tpq is NULL if there is no map here).
+ */
+static void
+export_cell ( double long_deg, double lat_deg, struct cell *cp, struct joblist *jp )
+{
+	struct maplet probe;
+
+	info.long_deg = long_deg;
+	info.lat_deg = lat_deg;
+	setup_series ();
+	synch_position ();
+
+	cp->width = info.series->maplet_long_deg;
+	cp->height = info.series->maplet_lat_deg;
+
+	/* fx is the fraction of the way from the west edge,
+	 * fy is the fraction of the way down from the north edge.
+	 */
+	cp->west = long_deg - info.fx * cp->width;
+	cp->north = lat_deg + info.fy * cp->height;
+
+	cp->mp = maplet_lookup ( info.maplet_x, info.maplet_y, &probe );
+	cp->tpq = probe.tpq;
+	cp->index = probe.tpq_index;
+
+	if ( cp->mp && cp->mp->scale > 1 )
+	    cp->mp = NULL;
+
+	if ( ! cp->mp && probe.tpq )
+	    job_add ( jp, &probe );
+}
+
+static void
+tile_add_cell ( struct tile *tp, struct cell *cp )
+{
+	int i;
+
+	for ( i=0; i<tp->ncells; i++ )
+	    if ( tp->cells[i].tpq == cp->tpq && tp->cells[i].index == cp->index )
+		return;
+
+	if ( tp->ncells >= tp->acells ) {
+	    tp->acells = tp->acells ? tp->acells * 2 : 16;
+	    tp->cells = (struct cell *) realloc ( tp->cells, tp->acells * sizeof(struct cell) );
+	}
+
+	tp->cells[tp->ncells++] = *cp;
+}
+
+/* Walk across the tile maplet by maplet, a row at a time,
+ * collecting every maplet that covers part of it.
+ * Maplets from different files need not line up, so each
+ * row starts just below the highest bottom edge we saw.
+ */
+static void
+tile_cells ( struct tile *tp, struct joblist *jp )
+{
+	double w, e, n, s;
+	double lo, la;
+	double next_la;
+	double edge;
+	struct cell c;
+
+	w = tile_long ( tp->z, tp->x );
+	e = tile_long ( tp->z, tp->x + 1 );
+	n = tile_lat ( tp->z, tp->y );
+	s = tile_lat ( tp->z, tp->y + 1 );
+
+	tp->ncells = 0;
+	tp->series = info.series->series;
+
+	la = n - CELL_EPS;
+	while ( la > s ) {
+	    next_la = s;
+	    lo = w + CELL_EPS;
+	    while ( lo < e ) {
+		export_cell ( lo, la, &c, jp );
+		if ( c.tpq )
+		    tile_add_cell ( tp, &c );
+
+		edge = c.north - c.height;
+		if ( edge > next_la )
+		    next_la = edge;
+
+		/* be sure we make progress */
+		edge = c.west + c.width;
+		if ( edge <= lo )
+		    edge = lo + c.width;
+		lo = edge + CELL_EPS;
+	    }
+	    if ( next_la >= la )
+		next_la = la - c.height;
+	    la = next_la - CELL_EPS;
+	}
+}
+
+/* ---------------------------------------------------- */
+
+static void
+job_decode ( int j )
+{
+	maplet_decode ( batch_jobs.jobs[j] );
+}
+
+/* Get pointers to the maplets that just got decoded,
+ * and work out how much shrinking each one needs.
+ */
+static void
+tile_resolve ( struct tile *tp )
+{
+	struct cell *cp;
+	double scale;
+	int j;
+
+	scale = zoom_scale ( tp->z );
+	for ( j=0; j<tp->ncells; j++ ) {
+	    cp = &tp->cells[j];
+	    if ( ! cp->mp )
+		cp->mp = maplet_find ( tp->series, cp->tpq, cp->index );
+	    if ( ! cp->mp )
+		continue;
+
+	    /* how many source pixels to a tile pixel */
+	    cp->box = scale * gdk_pixbuf_get_width ( cp->mp->pixbuf ) / cp->width + 0.5;
+	    if ( cp->box < 1 ) cp->box = 1;
+	    if ( cp->box > MAX_BOX ) cp->box = MAX_BOX;
+	}
+}
+
+/* Average a box of pixels around long, lat.
+ * With a box of 1 this is just the nearest pixel.
+ */
+static guint32
+cell_sample ( struct cell *cp, double long_deg, double lat_deg )
+{
+	GdkPixbuf *pb = cp->mp->pixbuf;
+	guchar *pixels, *p;
+	int rowstride, nch;
+	int w, h;
+	int px, py;
+	int x1, x2, y1, y2;
+	int x, y;
+	int r, g, b, n;
+
+	pixels = gdk_pixbuf_get_pixels ( pb );
+	rowstride = gdk_pixbuf_get_rowstride ( pb );
+	nch = gdk_pixbuf_get_n_channels ( pb );
+	w = gdk_pixbuf_get_width ( pb );
+	h = gdk_pixbuf_get_height ( pb );
+
+	px = (long_deg - cp->west) / cp->width * w;
+	py = (cp->north - lat_deg) / cp->height * h;
+
+	x1 = px - cp->box / 2;
+	y1 = py - cp->box / 2;
+	x2 = x1 + cp->box - 1;
+	y2 = y1 + cp->box - 1;
+
+	if ( x1 < 0 ) x1 = 0;
+	if ( y1 < 0 ) y1 = 0;
+	if ( x2 >= w ) x2 = w - 1;
+	if ( y2 >= h ) y2 = h - 1;
+	if ( x1 > x2 ) x1 = x2;
+	if ( y1 > y2 ) y1 = y2;
+
+	r = g = b = n = 0;
+	for ( y = y1; y <= y2; y++ ) {
+	    p = pixels + y * rowstride + x1 * nch;
+	    for ( x = x1; x <= x2; x++ ) {
+		r += p[0];
+		g += p[1];
+		b += p[2];
+		n++;
+		p += nch;
+	    }
+	}
+
+	return ((r/n) << 16) | ((g/n) << 8) | (b/n);
+}
+
+static cairo_status_t
+png_append ( void *closure, const unsigned char *data, unsigned int length )
+{
+	struct tile *tp = (struct tile *) closure;
+
+	if ( tp->png_size + length > tp->png_alloc ) {
+	    tp->png_alloc = (tp->png_size + length) * 2;
+	    tp->png = (unsigned char *) realloc ( tp->png, tp->png_alloc );
+	}
+	memcpy ( tp->png + tp->png_size, data, length );
+	tp->png_size += length;
+
+	return CAIRO_STATUS_SUCCESS;
+}
+
+/* Resample one tile from its maplets and write it out
+ * (or keep it in memory for MBTiles or the tile server).
+ */
+static void
+tile_draw ( struct tile *tp )
+{
+	struct cell *cp;
+	struct cell *last;
+	cairo_surface_t *surface;
+	unsigned char *data;
+	guint32 *row;
+	double lo[TILE_SIZE];
+	double la;
+	int stride;
+	int x, y, i;
+	char path[1024];
+
+	surface = cairo_image_surface_create ( CAIRO_FORMAT_RGB24, TILE_SIZE, TILE_SIZE );
+	cairo_surface_flush ( surface );
+	data = cairo_image_surface_get_data ( surface );
+	stride = cairo_image_surface_get_stride ( surface );
+
+	/* Mercator is kind enough to have long depend only on x
+	 * and lat only on y (we sample pixel centers).
+	 */
+	for ( x=0; x<TILE_SIZE; x++ )
+	    lo[x] = tile_long ( tp->z, tp->x + (x + 0.5) / TILE_SIZE );
+
+	last = NULL;
+	for ( y=0; y<TILE_SIZE; y++ ) {
+	    la = tile_lat ( tp->z, tp->y + (y + 0.5) / TILE_SIZE );
+	    row = (guint32 *) (data + y * stride);
+	    for ( x=0; x<TILE_SIZE; x++ ) {
+		cp = last;
+		if ( ! cp || lo[x] < cp->west || lo[x] >= cp->west + cp->width ||
+			la > cp->north || la <= cp->north - cp->height ) {
+		    cp = NULL;
+		    for ( i=0; i<tp->ncells; i++ ) {
+			last = &tp->cells[i];
+			if ( ! last->mp )
+			    continue;
+			if ( lo[x] >= last->west && lo[x] < last->west + last->width &&
+				la <= last->north && la > last->north - last->height ) {
+			    cp = last;
+			    break;
+			}
+		    }
+		}
+		last = cp;
+
+		if ( cp )
+		    row[x] = cell_sample ( cp, lo[x], la );
+		else
+		    row[x] = 0xffffff;
+	    }
+	}
+
+	cairo_surface_mark_dirty ( surface );
+
+	if ( tp->in_memory ) {
+	    tp->png_size = 0;
+	    cairo_surface_write_to_png_stream ( surface, png_append, tp );
+	} else {
+	    sprintf ( path, "%s/%d/%d/%d.png", export_path, tp->z, tp->x, tp->y );
+	    if ( cairo_surface_write_to_png ( surface, path ) != CAIRO_STATUS_SUCCESS )
+		printf ( "Cannot write %s\n", path );
+	}
+
+	cairo_surface_destroy ( surface );
+}
+
+static void
+tile_render ( int j )
+{
+	tile_draw ( &batch[j] );
+}
+
+/* ---------------------------------------------------- */
+
+#ifdef MBTILES
+static sqlite3 *mb_db;
+static sqlite3_stmt *mb_insert;
+
+static void
+mb_meta ( char *name, char *value )
+{
+	sqlite3_stmt *st;
+
+	sqlite3_prepare_v2 ( mb_db, "INSERT INTO metadata (name, value) VALUES (?, ?)", -1, &st, NULL );
+	sqlite3_bind_text ( st, 1, name, -1, SQLITE_TRANSIENT );
+	sqlite3_bind_text ( st, 2, value, -1, SQLITE_TRANSIENT );
+	sqlite3_step ( st );
+	sqlite3_finalize ( st );
+}
+
+static int
+mb_open ( char *path, double bbox[4], int zmin, int zmax )
+{
+	char buf[128];
+
+	unlink ( path );
+	if ( sqlite3_open ( path, &mb_db ) != SQLITE_OK ) {
+	    printf ( "Cannot create %s: %s\n", path, sqlite3_errmsg ( mb_db ) );
+	    return 0;
+	}
+
+	sqlite3_exec ( mb_db,
+	    "CREATE TABLE metadata (name text, value text);"
+	    "CREATE TABLE tiles (zoom_level integer, tile_column integer, tile_row integer, tile_data blob);"
+	    "CREATE UNIQUE INDEX tile_index ON tiles (zoom_level, tile_column, tile_row);",
+	    NULL, NULL, NULL );
+
+	mb_meta ( "name", "gtopo" );
+	mb_meta ( "type", "baselayer" );
+	mb_meta ( "version", "1" );
+	mb_meta ( "description", "Exported by gtopo" );
+	mb_meta ( "format", "png" );
+	sprintf ( buf, "%.6f,%.6f,%.6f,%.6f", bbox[0], bbox[1], bbox[2], bbox[3] );
+	mb_meta ( "bounds", buf );
+	sprintf ( buf, "%d", zmin );
+	mb_meta ( "minzoom", buf );
+	sprintf ( buf, "%d", zmax );
+	mb_meta ( "maxzoom", buf );
+
+	sqlite3_prepare_v2 ( mb_db,
+	    "INSERT OR REPLACE INTO tiles (zoom_level, tile_column, tile_row, tile_data) VALUES (?, ?, ?, ?)",
+	    -1, &mb_insert, NULL );
+
+	return 1;
+}
+
+/* Only the main thread talks to sqlite.
+ * MBTiles rows count up from the south (TMS), ours count down.
+ */
+static void
+mb_batch ( void )
+{
+	struct tile *tp;
+	int i;
+
+	sqlite3_exec ( mb_db, "BEGIN", NULL, NULL, NULL );
+	for ( i=0; i<batch_count; i++ ) {
+	    tp = &batch[i];
+	    if ( ! tp->png_size )
+		continue;
+	    sqlite3_bind_int ( mb_insert, 1, tp->z );
+	    sqlite3_bind_int ( mb_insert, 2, tp->x );
+	    sqlite3_bind_int ( mb_insert, 3, (1<<tp->z) - 1 - tp->y );
+	    sqlite3_bind_blob ( mb_insert, 4, tp->png, tp->png_size, SQLITE_STATIC );
+	    sqlite3_step ( mb_insert );
+	    sqlite3_reset ( mb_insert );
+	}
+	sqlite3_exec ( mb_db, "COMMIT", NULL, NULL, NULL );
+}
+
+static void
+mb_close ( void )
+{
+	sqlite3_finalize ( mb_insert );
+	sqlite3_close ( mb_db );
+}
+#endif
+
+/* ---------------------------------------------------- */
+
+static int
+make_dir ( char *path )
+{
+	if ( mkdir ( path, 0755 ) < 0 && errno != EEXIST ) {
+	    printf ( "Cannot make directory %s\n", path );
+	    return 0;
+	}
+	return 1;
+}
+
+/* Run the three steps on whatever is in the batch */
+static void
+batch_run ( void )
+{
+	struct tile tmp;
+	int n, i;
+
+	/* 1) - find the maplets, main thread only */
+	batch_jobs.count = 0;
+	n = 0;
+	for ( i=0; i<batch_count; i++ ) {
+	    batch[i].in_memory = export_mb;
+	    tile_cells ( &batch[i], &batch_jobs );
+	    if ( ! batch[i].ncells )
+		continue;
+	    /* swap, the cells arrays get reused */
+	    tmp = batch[n];
+	    batch[n++] = batch[i];
+	    batch[i] = tmp;
+	}
+	batch_count = n;
+	if ( ! batch_count )
+	    return;
+
+	/* 2) - decode what we don't have */
+	if ( batch_jobs.count ) {
+	    tpq_willneed_maplets ( batch_jobs.jobs, batch_jobs.count );
+	    pool_run ( job_decode, batch_jobs.count );
+	}
+	maplets_done += batch_jobs.count;
+
+	for ( i=0; i<batch_count; i++ )
+	    tile_resolve ( &batch[i] );
+
+	/* 3) - make the tiles */
+	pool_run ( tile_render, batch_count );
+	tiles_done += batch_count;
+
+#ifdef MBTILES
+	if ( export_mb )
+	    mb_batch ();
+#endif
+}
+
+/* Pick a series for this zoom level, NULL if we have nothing suitable */
+static struct series *
+zoom_series ( int z )
+{
+	struct series *sp;
+	struct series *best;
+	int i;
+
+	best = NULL;
+	for ( i=0; i<N_CHAIN; i++ ) {
+	    sp = &info.series_info[export_chain[i]];
+	    if ( ! sp->methods )
+		continue;
+	    if ( ! best || sp->x_pixel_scale <= zoom_scale ( z ) * SERIES_STRETCH )
+		best = sp;
+	}
+
+	/* Shrinking any more than this looks bad, and
+	 * takes forever, with hundreds of maplets per tile.
+	 */
+	if ( best && best->x_pixel_scale * MAX_BOX < zoom_scale ( z ) )
+	    return NULL;
+
+	return best;
+}
+
+static int
+export_zoom ( int z, double bbox[4] )
+{
+	struct series *sp;
+	struct tile *tp;
+	int x1, x2, y1, y2;
+	int x, y;
+	char path[1024];
+
+	sp = zoom_series ( z );
+	if ( ! sp ) {
+	    printf ( "Zoom %d: no series coarse enough, skipped\n", z );
+	    return 1;
+	}
+
+	initial_series ( sp->series );
+
+	x1 = long_tile ( z, bbox[0] );
+	x2 = long_tile ( z, bbox[2] );
+	y1 = lat_tile ( z, bbox[3] );
+	y2 = lat_tile ( z, bbox[1] );
+
+	printf ( "Zoom %d: %d tiles from %s\n", z, (x2-x1+1) * (y2-y1+1), wonk_series ( sp->series ) );
+
+	if ( ! export_mb ) {
+	    sprintf ( path, "%s/%d", export_path, z );
+	    if ( ! make_dir ( path ) )
+		return 0;
+	}
+
+	for ( x = x1; x <= x2; x++ ) {
+	    if ( ! export_mb ) {
+		sprintf ( path, "%s/%d/%d", export_path, z, x );
+		if ( ! make_dir ( path ) )
+		    return 0;
+	    }
+
+	    batch_count = 0;
+	    for ( y = y1; y <= y2; y++ ) {
+		tp = &batch[batch_count++];
+		tp->z = z;
+		tp->x = x;
+		tp->y = y;
+		if ( batch_count == EXPORT_BATCH || y == y2 ) {
+		    /* Only now, between batches, is it safe to let go of maplets */
+		    maplet_cache_trim ();
+		    batch_run ();
+		    batch_count = 0;
+		}
+	    }
+	}
+
+	return 1;
+}
+
+/* Make one tile as a PNG in memory, for the tile server (serve.c).
+ * This gets called from any number of threads at once, so the
+ * lookups take turns with archive_lock() and we keep the maplets
+ * we are using from being trimmed with maplet_hold().
+ * Returns 0 if there are no maps here at all,
+ * otherwise the caller gets the PNG to free.
+ */
+int
+tile_make ( int z, int x, int y, unsigned char **png, long *size )
+{
+	struct tile t;
+	struct joblist jobs;
+	struct series *sp;
+	int i;
+
+	memset ( &t, 0, sizeof(t) );
+	memset ( &jobs, 0, sizeof(jobs) );
+	t.z = z;
+	t.x = x;
+	t.y = y;
+	t.in_memory = 1;
+
+	if ( z < 0 || z > 22 || x < 0 || x >= (1<<z) || y < 0 || y >= (1<<z) )
+	    return 0;
+
+	maplet_hold ();
+
+	archive_lock ();
+	sp = zoom_series ( z );
+	if ( sp ) {
+	    initial_series ( sp->series );
+	    tile_cells ( &t, &jobs );
+	}
+	archive_unlock ();
+
+	if ( jobs.count )
+	    tpq_willneed_maplets ( jobs.jobs, jobs.count );
+	for ( i=0; i<jobs.count; i++ )
+	    maplet_decode ( jobs.jobs[i] );
+	free ( (char *) jobs.jobs );
+
+	if ( t.ncells ) {
+	    tile_resolve ( &t );
+	    tile_draw ( &t );
+	}
+
+	maplet_release ();
+
+	free ( (char *) t.cells );
+
+	if ( ! t.ncells || ! t.png_size ) {
+	    free ( (char *) t.png );
+	    return 0;
+	}
+
+	*png = t.png;
+	*size = t.png_size;
+	return 1;
+}
+
+/* Parse "w,s,e,n" -- any of which may be d:m:s */
+static int
+parse_bbox ( char *arg, double bbox[4] )
+{
+	char *buf;
+	char *p;
+	int i;
+	double tmp;
+
+	buf = strhide ( arg );
+	p = buf;
+	for ( i=0; i<4; i++ ) {
+	    if ( ! p )
+		break;
+	    bbox[i] = parse_dms ( p );
+	    p = strchr ( p, ',' );
+	    if ( p )
+		*p++ = '\0';
+	}
+	free ( buf );
+
+	if ( i < 4 )
+	    return 0;
+
+	if ( bbox[0] > bbox[2] ) {
+	    tmp = bbox[0]; bbox[0] = bbox[2]; bbox[2] = tmp;
+	}
+	if ( bbox[1] > bbox[3] ) {
+	    tmp = bbox[1]; bbox[1] = bbox[3]; bbox[3] = tmp;
+	}
+	return 1;
+}
+
+/* Export tiles covering bbox (w,s,e,n) to path for the zoom
+ * levels given by zoom ("z" or "z1-z2"), or if zoom is NULL,
+ * from where the coarsest series we have is shown pixel for pixel
+ * to where the finest one is.  Returns a status for exit().
+ */
+int
+export_tiles ( char *path, char *bbox_arg, char *zoom )
+{
+	double bbox[4];
+	struct series *sp;
+	struct timeval t1, t2;
+	int zmin, zmax;
+	int z;
+	int i;
+	int n;
+
+	if ( ! bbox_arg || ! parse_bbox ( bbox_arg, bbox ) ) {
+	    printf ( "Export needs --bbox west,south,east,north\n" );
+	    return 1;
+	}
+
+	/* Pixel scales, the file method series need a position for this */
+	info.long_deg = (bbox[0] + bbox[2]) / 2.0;
+	info.lat_deg = (bbox[1] + bbox[3]) / 2.0;
+
+	zmin = 99;
+	zmax = -1;
+	for ( i=0; i<N_CHAIN; i++ ) {
+	    sp = &info.series_info[export_chain[i]];
+	    if ( ! sp->methods )
+		continue;
+	    initial_series ( sp->series );
+	    z = series_zoom ( sp );
+	    if ( z < zmin ) zmin = z;
+	    if ( z > zmax ) zmax = z;
+	}
+
+	if ( zmax < 0 ) {
+	    printf ( "No maps to export\n" );
+	    return 1;
+	}
+
+	if ( zoom ) {
+	    n = sscanf ( zoom, "%d-%d", &zmin, &zmax );
+	    if ( n == 1 )
+		zmax = zmin;
+	    if ( n < 1 || zmin < 0 || zmax > 22 || zmin > zmax ) {
+		printf ( "Bad zoom range: %s\n", zoom );
+		return 1;
+	    }
+	}
+
+	n = strlen ( path );
+	if ( n > 8 && strcmp ( &path[n-8], ".mbtiles" ) == 0 ) {
+#ifdef MBTILES
+	    export_mb = 1;
+	    if ( ! mb_open ( path, bbox, zmin, zmax ) )
+		return 1;
+#else
+	    printf ( "Not built with MBTILES, cannot write %s\n", path );
+	    return 1;
+#endif
+	} else {
+	    if ( ! make_dir ( path ) )
+		return 1;
+	}
+	export_path = path;
+
+	num_exporters = settings.loader_threads;
+	if ( num_exporters < 1 )
+	    num_exporters = sysconf ( _SC_NPROCESSORS_ONLN );
+	if ( num_exporters > MAX_EXPORTERS )
+	    num_exporters = MAX_EXPORTERS;
+
+	printf ( "Exporting %.4f,%.4f to %.4f,%.4f, zoom %d to %d, with %d threads\n",
+	    bbox[0], bbox[1], bbox[2], bbox[3], zmin, zmax, num_exporters );
+
+	gettimeofday ( &t1, NULL );
+
+	tiles_done = 0;
+	maplets_done = 0;
+	for ( z = zmin; z <= zmax; z++ )
+	    if ( ! export_zoom ( z, bbox ) )
+		break;
+
+#ifdef MBTILES
+	if ( export_mb )
+	    mb_close ();
+#endif
+
+	gettimeofday ( &t2, NULL );
+
+	printf ( "%ld tiles from %ld maplets in %.1f seconds\n", tiles_done, maplets_done,
+	    (t2.tv_sec - t1.tv_sec) + (t2.tv_usec - t1.tv_usec) / 1000000.0 );
+
+	return 0;
+}
+
+/* THE END */
@@ -171,6 +171,9 @@ struct info_info i_info = { GONE };
 static void cursor_show ( int );
 static int try_position ( double, double );
 
+/* No display (--render, --export, --serve or --bench) */
+static int headless = 0;
+
 gint
 destroy_handler ( GtkWidget *w, GdkEvent *event, gpointer data )
 {
@@ -181,13 +184,16 @@ destroy_handler ( GtkWidget *w, GdkEvent *event, gpointer data )
 	return FALSE;
 }
 
+/* Arguments are in viewport coordinates, the pixmap
+ * may have margins around the part we are showing.
+ */
 void
 pixmap_expose ( gint x, gint y, gint nx, gint ny )
 {
 	gdk_draw_pixmap ( vp_info.da->window,
 		vp_info.da->style->fg_gc[GTK_WIDGET_STATE(vp_info.da)],
 		info.series->pixels,
-		x, y, x, y, nx, ny );
+		info.series->view_x + x, info.series->view_y + y, x, y, nx, ny );
 
 	overlay_redraw ();
 	cursor_show ( 1 );
@@ -314,6 +320,273 @@ state_handler ( struct maplet *mp )
 }
 #endif
 
+/* Draw the maplet boundaries (the "show_maplets" option)
+ * for the frame as laid out by the last redraw.
+ */
+static void
+pixmap_grid ( struct series *sp )
+{
+	struct frame *fp = &sp->frame;
+	int x, y;
+	int xx, yy;
+
+	for ( x = fp->nx1+1; x <= fp->nx2; x++ ) {
+	    xx = fp->origx - fp->px * x,
+	    gdk_draw_line ( sp->pixels, vp_info.da->style->black_gc,
+		xx, 0, xx, sp->pix_h );
+	}
+	for ( y = fp->ny1+1; y <= fp->ny2; y++ ) {
+	    yy = fp->origy - fp->py * y,
+	    gdk_draw_line ( sp->pixels, vp_info.da->style->black_gc,
+		0, yy, sp->pix_w, yy );
+	}
+}
+
+/* Bounding box of what has come in from the loaders since we
+ * last put anything on the screen (in pixmap coordinates).
+ */
+static int dirty = 0;
+static int dirty_x1, dirty_y1, dirty_x2, dirty_y2;
+
+/* A maplet that pixmap_redraw handed off to the background loaders
+ * has arrived.  If the pixmap it was meant for has not been redrawn
+ * since (the gen still matches), draw it where it belongs.
+ * This may well not be the series we are looking at any more,
+ * but its pixmap may be reused by redraw_series, so we draw it anyway.
+ */
+static void frame_draw ( struct series *, struct maplet *, int, int );
+
+void
+pixmap_maplet ( struct maplet *mp, int gen, int x, int y )
+{
+	struct series *sp;
+	struct frame *fp;
+
+	sp = &info.series_info[mp->series];
+	fp = &sp->frame;
+
+	if ( ! sp->pixels || ! sp->content || fp->gen != gen )
+	    return;
+
+	if ( settings.verbose & V_DRAW2 )
+	    printf ( "late maplet for %d %d\n", x, y );
+
+	if ( mp->scale > 1 )
+	    fp->previews++;
+
+	frame_draw ( sp, mp, x, y );
+}
+
+/* Draw a maplet where it belongs in the frame,
+ * and note that part of the screen needs updating.
+ */
+static void
+frame_draw ( struct series *sp, struct maplet *mp, int x, int y )
+{
+	struct frame *fp = &sp->frame;
+	int mx, my;
+
+	mx = fp->origx - mp->xdim * x;
+	my = fp->origy - mp->ydim * y;
+
+	gdk_draw_pixbuf ( sp->pixels, NULL, mp->pixbuf,
+		SRC_X, SRC_Y, mx, my, -1, -1,
+		GDK_RGB_DITHER_NONE, 0, 0 );
+
+	if ( sp != info.series )
+	    return;
+
+	if ( ! dirty ) {
+	    dirty_x1 = mx;
+	    dirty_y1 = my;
+	    dirty_x2 = mx + mp->xdim;
+	    dirty_y2 = my + mp->ydim;
+	    dirty = 1;
+	} else {
+	    if ( mx < dirty_x1 ) dirty_x1 = mx;
+	    if ( my < dirty_y1 ) dirty_y1 = my;
+	    if ( mx + mp->xdim > dirty_x2 ) dirty_x2 = mx + mp->xdim;
+	    if ( my + mp->ydim > dirty_y2 ) dirty_y2 = my + mp->ydim;
+	}
+}
+
+/* Called after a batch of pixmap_maplet calls, to show the result.
+ */
+void
+pixmap_maplet_done ( void )
+{
+	if ( ! dirty )
+	    return;
+	dirty = 0;
+
+	/* the new maplets were drawn over the lines */
+	if ( settings.show_maplets )
+	    pixmap_grid ( info.series );
+
+	dirty_x1 -= info.series->view_x;
+	dirty_x2 -= info.series->view_x;
+	dirty_y1 -= info.series->view_y;
+	dirty_y2 -= info.series->view_y;
+
+	if ( dirty_x1 < 0 ) dirty_x1 = 0;
+	if ( dirty_y1 < 0 ) dirty_y1 = 0;
+	if ( dirty_x2 > vp_info.vx ) dirty_x2 = vp_info.vx;
+	if ( dirty_y2 > vp_info.vy ) dirty_y2 = vp_info.vy;
+
+	if ( dirty_x2 > dirty_x1 && dirty_y2 > dirty_y1 )
+	    pixmap_expose ( dirty_x1, dirty_y1, dirty_x2 - dirty_x1, dirty_y2 - dirty_y1 );
+}
+
+static int frame_gen = 0;
+
+/* Division that rounds toward minus infinity (b > 0),
+ * the reference maplet can be well off the screen.
+ */
+static int
+floor_div ( int a, int b )
+{
+	if ( a >= 0 )
+	    return a / b;
+	return - ((-a + b - 1) / b);
+}
+
+/* Get the maplet at x, y (relative to the reference maplet of the frame)
+ * ready to draw.  What we have in the cache gets handed back right now,
+ * anything we would have to read and decode goes off to the loader threads
+ * and gets drawn by pixmap_maplet when it is ready, in which case we
+ * return NULL.  This also hands back NULL if there is no such maplet.
+ */
+static struct maplet *
+frame_maplet ( struct frame *fp, int x, int y )
+{
+	struct maplet *mp;
+	struct maplet probe;
+
+	if ( info.series->terra )
+	    mp = maplet_lookup ( fp->ref_x - x, fp->ref_y + y, &probe );
+	else
+	    mp = maplet_lookup ( fp->ref_x + x, fp->ref_y + y, &probe );
+
+	/* While dragging, a quick preview will do */
+	if ( ! mp && probe.tpq ) {
+	    if ( vp_info.dragging )
+		probe.scale = settings.drag_scale;
+	    if ( loader_visible ( &probe, fp->gen, x, y ) )
+		return NULL;
+	    mp = maplet_load_now ( &probe );
+	}
+
+	/* We have a preview of this one, draw that,
+	 * and have the real thing drawn over it later.
+	 */
+	if ( mp && mp->scale > 1 && ! vp_info.dragging ) {
+	    if ( ! loader_visible ( &probe, fp->gen, x, y ) )
+		mp = maplet_load_now ( &probe );
+	}
+
+	if ( mp && mp->scale > 1 )
+	    fp->previews++;
+
+	return mp;
+}
+
+/* Work out the range of maplets that cover the whole pixmap */
+static void
+frame_range ( struct series *sp )
+{
+	struct frame *fp = &sp->frame;
+
+	if ( info.center_only ) {
+	    fp->nx1 = fp->nx2 = 0;
+	    fp->ny1 = fp->ny2 = 0;
+	    return;
+	}
+
+	fp->nx1 = floor_div ( fp->origx - sp->pix_w, fp->px ) + 1;
+	fp->nx2 = floor_div ( fp->origx + fp->px - 1, fp->px );
+	fp->ny1 = floor_div ( fp->origy - sp->pix_h, fp->py ) + 1;
+	fp->ny2 = floor_div ( fp->origy + fp->py - 1, fp->py );
+}
+
+/* When the pixmap is bigger than the viewport (pixmap_margin),
+ * pixmap_redraw only does what is on the screen, and the margins
+ * get filled in here when we have nothing better to do, a few
+ * maplets at a time.  Anything not in the cache gets handed to the
+ * loader threads just like pixmap_redraw does.
+ * If the frame gets redrawn (a new gen) we give up, if it just gets
+ * scrolled we keep going, and skip anything that scrolled off.
+ */
+#define MARGIN_BATCH	4
+
+static guint margin_id = 0;
+static int margin_gen;
+static int margin_cur_x, margin_cur_y;
+static int margin_nx1, margin_nx2, margin_ny1, margin_ny2;
+
+static gboolean
+margin_idle ( gpointer data )
+{
+	struct series *sp = info.series;
+	struct frame *fp = &sp->frame;
+	struct maplet *mp;
+	int x, y;
+	int n;
+
+	if ( fp->gen != margin_gen || ! sp->content ) {
+	    margin_id = 0;
+	    return FALSE;
+	}
+
+	n = 0;
+	while ( n < MARGIN_BATCH ) {
+	    if ( margin_cur_y > fp->ny2 ) {
+		margin_id = 0;
+		loader_start ();
+		pixmap_maplet_done ();
+		return FALSE;
+	    }
+
+	    x = margin_cur_x;
+	    y = margin_cur_y;
+	    if ( ++margin_cur_x > fp->nx2 ) {
+		margin_cur_x = fp->nx1;
+		margin_cur_y++;
+	    }
+
+	    /* already done by pixmap_redraw */
+	    if ( x >= margin_nx1 && x <= margin_nx2 && y >= margin_ny1 && y <= margin_ny2 )
+		continue;
+	    if ( x < fp->nx1 || x > fp->nx2 || y < fp->ny1 )
+		continue;
+
+	    mp = frame_maplet ( fp, x, y );
+	    if ( mp )
+		frame_draw ( sp, mp, x, y );
+	    n++;
+	}
+
+	loader_start ();
+
+	/* in case we have scrolled onto any of it */
+	pixmap_maplet_done ();
+	return TRUE;
+}
+
+static void
+margin_start ( struct frame *fp, int nx1, int nx2, int ny1, int ny2 )
+{
+	margin_gen = fp->gen;
+	margin_cur_x = fp->nx1;
+	margin_cur_y = fp->ny1;
+	margin_nx1 = nx1;
+	margin_nx2 = nx2;
+	margin_ny1 = ny1;
+	margin_ny2 = ny2;
+
+	if ( ! margin_id )
+	    margin_id = g_idle_add ( margin_idle, NULL );
+}
+
 /* SIGNS, Signs, signs, keeping signs straight is what this is all about!
  * Watch out for a multitude of sign conventions, here is a
  * quick orientation:
@@ -325,28 +598,29 @@ state_handler ( struct maplet *mp )
  * 	pixmap x,y  - x increases to the right (east), y increases down (south)
  *	viewport    - x increases to right, y increases down
  *
- * pixmap_redraw is the guts of what goes on during a reconfigure.
+ * frame_setup does the arithmetic, the drawing goes on elsewhere.
+ * It lays out the frame for the current series and position: it loads
+ * the center maplet to get the maplet pixel size, puts our position
+ * at the center of the viewport part of the pixmap (which starts at
+ * view_x, view_y), and works out which maplets cover the whole pixmap.
+ * What it hands back in nx1 .. ny2 is the range on the screen itself.
+ * Nothing here touches the pixmap, so the headless renderer (render.c)
+ * uses it with a client side buffer standing in for the pixmap.
  */
-void
-pixmap_redraw ( void )
+struct frame *
+frame_setup ( int *nx1, int *nx2, int *ny1, int *ny2 )
 {
 	int vxdim, vydim;
-	int nx1, nx2, ny1, ny2;
 	int offx, offy;
 	int origx, origy;
-	int x, y;
 	struct maplet *mp;
-	int xx, yy;
+	struct frame *fp;
 	int px, py;	/* maplet size in pixels */
 
 	/* get the viewport size */
 	vxdim = vp_info.vx;
 	vydim = vp_info.vy;
 
-	/* clear the whole pixmap to white */
-	gdk_draw_rectangle ( info.series->pixels, vp_info.da->style->white_gc, TRUE, 0, 0, vxdim, vydim );
-	info.series->content = 1;
-
 #ifdef notdef
 	/* The state series are a special case.  In fact the usual
 	 * thing here (if there is a usual thing) is that the whole
@@ -380,7 +654,7 @@ pixmap_redraw ( void )
 	/* load the maplet containing the current position so
 	 * we can get the maplet pixel size up front.
 	 * we fetch the center maplet here to get some info from
-	 * it, the loop below will get it again (but from our cache).
+	 * it, the loop in pixmap_redraw will get it again (but from our cache).
 	 */
 	mp = load_maplet ( info.maplet_x, info.maplet_y );
 
@@ -405,8 +679,9 @@ pixmap_redraw ( void )
 	offx = info.fx * px;
 	offy = info.fy * py;
 
-	origx = vp_info.vxcent - offx;
-	origy = vp_info.vycent - offy;
+	/* in pixmap coordinates */
+	origx = info.series->view_x + vp_info.vxcent - offx;
+	origy = info.series->view_y + vp_info.vycent - offy;
 
 	if ( settings.verbose & V_DRAW ) {
 	    printf ( "Maplet off, orig: %d %d -- %d %d\n", offx, offy, origx, origy );
@@ -414,34 +689,76 @@ pixmap_redraw ( void )
 	    printf ( "vxdim, vydim = %d, %d\n", vxdim, vydim );
 	}
 
+	/* Just what is on the screen, for now.
+	 * maplet x covers origx - px*x up to origx - px*x + px
+	 */
 	if ( info.center_only ) {
-	    nx1 = nx2 = 0;
-	    ny1 = ny2 = 0;
+	    *nx1 = *nx2 = 0;
+	    *ny1 = *ny2 = 0;
 	} else {
-	    nx1 = - (vxdim - (origx + px) + px - 1 ) / px;
-	    nx2 = + (origx + px - 1 ) / px;
-	    ny1 = - (vydim - (origy + py) + py - 1 ) / py;
-	    ny2 = + (origy + py - 1 ) / py;
+	    *nx1 = floor_div ( origx - info.series->view_x - vxdim, px ) + 1;
+	    *nx2 = floor_div ( origx - info.series->view_x + px - 1, px );
+	    *ny1 = floor_div ( origy - info.series->view_y - vydim, py ) + 1;
+	    *ny2 = floor_div ( origy - info.series->view_y + py - 1, py );
 	}
 
 	if ( settings.verbose & V_DRAW ) {
 	    printf ( "redraw -- viewport: %d %d -- maplet %d %d -- offset: %d %d\n",
 		vxdim, vydim, px, py, offx, offy );
-	    printf ( "redraw range: x,y = %d %d %d %d\n", nx1, nx2, ny1, ny2 );
+	    printf ( "redraw range: x,y = %d %d %d %d\n", *nx1, *nx2, *ny1, *ny2 );
 	}
 
+	/* Remember all this, for maplets that show up later */
+	fp = &info.series->frame;
+	fp->gen = ++frame_gen;
+	fp->ref_x = info.maplet_x;
+	fp->ref_y = info.maplet_y;
+	fp->method = info.series->cur_method;
+	fp->origx = origx;
+	fp->origy = origy;
+	fp->px = px;
+	fp->py = py;
+	fp->previews = 0;
+
+	/* The frame covers the whole pixmap */
+	frame_range ( info.series );
+
+	return fp;
+}
+
+/* pixmap_redraw is the guts of what goes on during a reconfigure.
+ */
+void
+pixmap_redraw ( void )
+{
+	int nx1, nx2, ny1, ny2;
+	int x, y;
+	struct maplet *mp;
+	struct frame *fp;
+
+	/* clear the whole pixmap to white, margins and all */
+	gdk_draw_rectangle ( info.series->pixels, vp_info.da->style->white_gc, TRUE,
+		0, 0, info.series->pix_w, info.series->pix_h );
+	info.series->content = 1;
+	info.series->view_x = info.series->margin_x;
+	info.series->view_y = info.series->margin_y;
+
+	fp = frame_setup ( &nx1, &nx2, &ny1, &ny2 );
+
 	/* This loop works in maplet indices, with
 	 * x increasing to the west (left), and y increasing to the north (up).
 	 * which is exactly opposite of the GTK pixel coordinates, which have
 	 * the origin at the upper left of the screen.
+	 *
+	 * What we have in the cache gets drawn right now, anything we
+	 * would have to read and decode goes off to the loader threads
+	 * (all at once, so they get done in parallel), and gets drawn
+	 * by pixmap_maplet when it is ready.
 	 */
 	for ( y = ny1; y <= ny2; y++ ) {
 	    for ( x = nx1; x <= nx2; x++ ) {
 
-		if ( info.series->terra )
-		    mp = load_maplet ( info.maplet_x - x, info.maplet_y + y );
-		else
-		    mp = load_maplet ( info.maplet_x + x, info.maplet_y + y );
+		mp = frame_maplet ( fp, x, y );
 
 		if ( ! mp ) {
 		    if ( settings.verbose & V_DRAW2 )
@@ -451,24 +768,26 @@ pixmap_redraw ( void )
 
 		if ( settings.verbose & V_DRAW2 )
 		    printf ( "redraw OK for %d %d, draw at %d %d\n",
-			x, y, origx - mp->xdim*x, origy - mp->ydim*y );
+			x, y, fp->origx - mp->xdim*x, fp->origy - mp->ydim*y );
 		draw_maplet ( mp,
-			origx - mp->xdim * x,
-			origy - mp->ydim * y );
+			fp->origx - mp->xdim * x,
+			fp->origy - mp->ydim * y );
 	    }
 	}
 
-	if ( settings.show_maplets ) {
-	    for ( x = nx1+1; x <= nx2; x++ ) {
-		xx = origx - px * x,
-		gdk_draw_line ( info.series->pixels, vp_info.da->style->black_gc,
-		    xx, 0, xx, vp_info.vy );
-	    }
-	    for ( y = ny1+1; y <= ny2; y++ ) {
-		yy = origy - py * y,
-		gdk_draw_line ( info.series->pixels, vp_info.da->style->black_gc,
-		    0, yy, vp_info.vx, yy );
-	    }
+	/* The loaders get the whole screen at once */
+	loader_start ();
+
+	if ( settings.show_maplets )
+	    pixmap_grid ( info.series );
+
+	if ( ! info.center_only ) {
+	    /* Fill in the margins when we get a chance */
+	    if ( fp->nx1 < nx1 || fp->nx2 > nx2 || fp->ny1 < ny1 || fp->ny2 > ny2 )
+		margin_start ( fp, nx1, nx2, ny1, ny2 );
+
+	    /* Get the maplets just off the pixmap loading in the background */
+	    loader_prefetch ( fp->nx1, fp->nx2, fp->ny1, fp->ny2 );
 	}
 
 	// This won't work here, everything gets overwritten
@@ -476,20 +795,40 @@ pixmap_redraw ( void )
 	// overlay_redraw ();
 }
 
+/* Make the pixmap for a series, with margins all around it if
+ * pixmap_margin asks for them.  The margin is given in maplets,
+ * so how many pixels that is depends on the series.
+ */
+static void
+series_pixmap ( struct series *sp )
+{
+	int n;
+
+	n = settings.pixmap_margin;
+	if ( n < 0 || info.center_only )
+	    n = 0;
+
+	sp->margin_x = n * sp->xdim;
+	sp->margin_y = n * sp->ydim;
+	sp->pix_w = vp_info.vx + 2 * sp->margin_x;
+	sp->pix_h = vp_info.vy + 2 * sp->margin_y;
+	sp->view_x = sp->margin_x;
+	sp->view_y = sp->margin_y;
+
+	sp->pixels = gdk_pixmap_new ( vp_info.da->window, sp->pix_w, sp->pix_h, -1 );
+}
+
 /* We are changing location, and maybe also series, so we should not
  * take for granted we already have a pixmap allocated for that series.
  */
 void
 new_redraw ( void )
 {
-	int i;
-
-	/* invalidate content of any prior pixmaps */
-	for ( i=0; i<N_SERIES; i++ )
-	    info.series_info[i].content = 0;
-
+	/* Any other pixmaps stay as they are, each frame
+	 * knows where it was drawn (see redraw_series).
+	 */
 	if ( ! info.series->pixels )
-	    info.series->pixels = gdk_pixmap_new ( vp_info.da->window, vp_info.vx, vp_info.vy, -1 );
+	    series_pixmap ( info.series );
 
 	pixmap_redraw ();
 
@@ -517,7 +856,7 @@ total_redraw ( void )
 	    sp->content = 0;
 	}
 
-	info.series->pixels = gdk_pixmap_new ( vp_info.da->window, vp_info.vx, vp_info.vy, -1 );
+	series_pixmap ( info.series );
 
 	pixmap_redraw ();
 }
@@ -528,14 +867,11 @@ total_redraw ( void )
 void
 full_redraw ( void )
 {
-	int i;
-
 	/* Note that we keep any pixmaps, as they will
-	 * be the correct geometry (the content is not valid).
-	 * the correct size and so forth.
+	 * be the correct geometry and the correct size and so forth.
+	 * The other series keep their content too, redraw_series
+	 * can slide it into place if we come back to them.
 	 */
-	for ( i=0; i<N_SERIES; i++ )
-	    info.series_info[i].content = 0;
 
 	/* redraw on the new center */
 	pixmap_redraw ();
@@ -544,6 +880,200 @@ full_redraw ( void )
 	pixmap_expose ( 0, 0, vp_info.vx, vp_info.vy );
 }
 
+/* Fill in one rectangle of the pixmap that just came into view,
+ * drawing only the part of each maplet that falls inside it.
+ */
+static void
+pixmap_strip ( struct frame *fp, int rx, int ry, int rw, int rh )
+{
+	struct maplet *mp;
+	int x1, x2, y1, y2;
+	int x, y;
+	int mx, my;
+	int cx1, cy1, cx2, cy2;
+
+	if ( rw <= 0 || rh <= 0 )
+	    return;
+
+	gdk_draw_rectangle ( info.series->pixels, vp_info.da->style->white_gc, TRUE, rx, ry, rw, rh );
+
+	/* maplet x covers origx - px*x up to origx - px*x + px */
+	x1 = floor_div ( fp->origx - rx - rw, fp->px ) + 1;
+	x2 = floor_div ( fp->origx + fp->px - rx - 1, fp->px );
+	y1 = floor_div ( fp->origy - ry - rh, fp->py ) + 1;
+	y2 = floor_div ( fp->origy + fp->py - ry - 1, fp->py );
+
+	if ( settings.verbose & V_DRAW )
+	    printf ( "scroll strip %d %d (%d x %d) -- maplets %d %d %d %d\n", rx, ry, rw, rh, x1, x2, y1, y2 );
+
+	for ( y = y1; y <= y2; y++ ) {
+	    for ( x = x1; x <= x2; x++ ) {
+
+		mp = frame_maplet ( fp, x, y );
+		if ( ! mp )
+		    continue;
+
+		mx = fp->origx - mp->xdim * x;
+		my = fp->origy - mp->ydim * y;
+
+		cx1 = mx > rx ? mx : rx;
+		cy1 = my > ry ? my : ry;
+		cx2 = mx + mp->xdim < rx + rw ? mx + mp->xdim : rx + rw;
+		cy2 = my + mp->ydim < ry + rh ? my + mp->ydim : ry + rh;
+		if ( cx2 <= cx1 || cy2 <= cy1 )
+		    continue;
+
+		gdk_draw_pixbuf ( info.series->pixels, NULL, mp->pixbuf,
+			cx1 - mx, cy1 - my, cx1, cy1, cx2 - cx1, cy2 - cy1,
+			GDK_RGB_DITHER_NONE, 0, 0 );
+	    }
+	}
+}
+
+/* Panning by a few pixels used to clear the pixmap and draw every
+ * maplet in the viewport all over again.
+ *
+ * If the pixmap has margins (pixmap_margin) and we are still inside
+ * them, we just show a different part of the pixmap, which costs
+ * nothing at all.  Otherwise we slide what we already have over so
+ * the viewport is back in the middle of the pixmap, and only fill in
+ * the strips that came into view along the edges.
+ *
+ * We never add up pixel deltas from one motion event to the next.
+ * The shift is the difference between where the reference maplet
+ * was drawn and where a full redraw at the new (floating point)
+ * position would put it, so the sub-pixel part just carries over
+ * in the position and we never drift away from what a full redraw
+ * would give us.
+ *
+ * The frame keeps its gen and reference maplet, so maplets still
+ * on their way from the loaders land in the right place.
+ *
+ * This also works for a series we are flipping back to, whose
+ * pixmap may have been drawn some moves ago (see redraw_series).
+ *
+ * Returns 0 if we can't do this, and the caller must do a full redraw.
+ */
+static int
+pixmap_scroll ( void )
+{
+	struct series *sp = info.series;
+	struct frame *fp = &sp->frame;
+	struct maplet *mp;
+	int px, py;
+	int origx, origy;
+	int view_x, view_y;
+	int w, h;
+	int dx, dy;
+	int ox, oy;
+	int dir;
+
+	if ( ! sp->pixels || ! sp->content || info.center_only )
+	    return 0;
+
+	setup_series ();
+	synch_position ();
+
+	/* for a file method, maplet indices belong to the file */
+	if ( sp->cur_method != fp->method )
+	    return 0;
+
+	/* maplets in a new TPQ file may be a different size */
+	px = sp->xdim;
+	py = sp->ydim;
+	mp = load_maplet ( info.maplet_x, info.maplet_y );
+	if ( mp ) {
+	    px = mp->xdim;
+	    py = mp->ydim;
+	}
+	if ( px != fp->px || py != fp->py )
+	    return 0;
+
+	/* Where a full redraw would put the reference maplet
+	 * on the screen, so where the screen is in the pixmap.
+	 */
+	dir = sp->terra ? -1 : 1;
+	origx = vp_info.vxcent - (int) (info.fx * px) + dir * px * (info.maplet_x - fp->ref_x);
+	origy = vp_info.vycent - (int) (info.fy * py) + py * (info.maplet_y - fp->ref_y);
+
+	view_x = fp->origx - origx;
+	view_y = fp->origy - origy;
+
+	w = sp->pix_w;
+	h = sp->pix_h;
+
+	if ( view_x >= 0 && view_x + vp_info.vx <= w &&
+		view_y >= 0 && view_y + vp_info.vy <= h ) {
+	    if ( settings.verbose & V_DRAW )
+		printf ( "scroll within pixmap to %d %d\n", view_x, view_y );
+	    sp->view_x = view_x;
+	    sp->view_y = view_y;
+	    return 1;
+	}
+
+	/* put the viewport back in the middle */
+	dx = sp->margin_x - view_x;
+	dy = sp->margin_y - view_y;
+
+	if ( abs(dx) >= w || abs(dy) >= h )
+	    return 0;
+
+	if ( settings.verbose & V_DRAW )
+	    printf ( "scroll by %d %d\n", dx, dy );
+
+	/* The X server gets overlapping copies right */
+	gdk_draw_drawable ( sp->pixels,
+		vp_info.da->style->fg_gc[GTK_WIDGET_STATE(vp_info.da)],
+		sp->pixels, 0, 0, dx, dy, w, h );
+
+	sp->view_x = sp->margin_x;
+	sp->view_y = sp->margin_y;
+	fp->origx += dx;
+	fp->origy += dy;
+	frame_range ( sp );
+
+	/* The full height strip on the left or right,
+	 * then what is left of the top or bottom.
+	 */
+	if ( dx > 0 )
+	    pixmap_strip ( fp, 0, 0, dx, h );
+	else if ( dx < 0 )
+	    pixmap_strip ( fp, w + dx, 0, -dx, h );
+
+	if ( dy > 0 )
+	    pixmap_strip ( fp, dx > 0 ? dx : 0, 0, w - abs(dx), dy );
+	else if ( dy < 0 )
+	    pixmap_strip ( fp, dx > 0 ? dx : 0, h + dy, w - abs(dx), -dy );
+
+	loader_start ();
+
+	if ( settings.show_maplets )
+	    pixmap_grid ( sp );
+
+	/* loader_prefetch wants indices relative to the center maplet */
+	ox = dir * (fp->ref_x - info.maplet_x);
+	oy = fp->ref_y - info.maplet_y;
+	loader_prefetch ( fp->nx1 + ox, fp->nx2 + ox, fp->ny1 + oy, fp->ny2 + oy );
+
+	return 1;
+}
+
+/* Panning with the mouse, slide the picture over if we can */
+void
+scroll_redraw ( void )
+{
+	/* The benchmark does its own drawing */
+	if ( headless )
+	    return;
+
+	if ( ! pixmap_scroll () ) {
+	    full_redraw ();
+	    return;
+	}
+
+	pixmap_expose ( 0, 0, vp_info.vx, vp_info.vy );
+}
+
 static int config_count = 0;
 
 /* This gets called when the drawing area gets created or resized.
@@ -595,6 +1125,9 @@ snap ( void )
 {
 	GdkPixbuf *pixbuf;
 
+	/* make sure the picture is all there */
+	loader_finish ();
+
 	if ( settings.verbose & V_WINDOW ) {
 	    printf ( "Snapshot" );
 
@@ -608,7 +1141,7 @@ snap ( void )
 	}
 
 	pixbuf = gdk_pixbuf_get_from_drawable(NULL, info.series->pixels, NULL,
-		0, 0, 0, 0, vp_info.vx, vp_info.vy );
+		info.series->view_x, info.series->view_y, 0, 0, vp_info.vx, vp_info.vy );
 
 #ifdef notdef
 	int n_channels;
@@ -687,7 +1220,8 @@ move_xy ( int new_x, int new_y )
 	if ( ! try_position ( dx, -dy ) )
 	    return;
 
-	full_redraw ();
+	/* within the pixmap margins this is instant */
+	scroll_redraw ();
 }
 
 void
@@ -705,7 +1239,7 @@ shift_xy ( double shift_x, double shift_y )
 	if ( ! try_position ( -dx, dy ) )
 	    return;
 
-	full_redraw ();
+	scroll_redraw ();
 }
 
 void
@@ -723,14 +1257,28 @@ move_map ( int dx, int dy )
 /* flip to new series, may be able to avoid redrawing the pixmap
  * Called from the mouse handler, and from routines in archive.c
  * that are called by the keyboard_handler
+ *
+ * We no longer throw away the other pixmaps when we move.
+ * Each one remembers the frame it was drawn for, so if we are
+ * back where we were, this is just a blit to the screen, and
+ * if we have moved a little since, pixmap_scroll slides it over.
+ * If it still has quick previews in it from a drag, it is
+ * worth doing over properly.
  */
 void
 redraw_series ( void )
 {
+	/* The benchmark does its own drawing */
+	if ( headless )
+	    return;
+
 	if ( ! info.series->pixels )
-	    info.series->pixels = gdk_pixmap_new ( vp_info.da->window, vp_info.vx, vp_info.vy, -1 );
+	    series_pixmap ( info.series );
+
+	if ( info.series->frame.previews && ! vp_info.dragging )
+	    info.series->content = 0;
 
-	if ( ! info.series->content )
+	if ( ! pixmap_scroll () )
 	    pixmap_redraw ();
 
 	pixmap_expose ( 0, 0, vp_info.vx, vp_info.vy );
@@ -869,6 +1417,9 @@ debug_dumper ( void )
 
 	printf ( " sheet, S, N: %.4f %.4f\n", tp->s_lat, tp->n_lat );
 	printf ( " sheet, W, E: %.4f %.4f\n", tp->w_long, tp->e_long );
+
+	if ( settings.verbose & V_TPQ )
+	    tpq_dump ();
 }
 
 static void
@@ -1383,6 +1934,26 @@ mouse_handler ( GtkWidget *wp, GdkEventButton *event, gpointer data )
 
 #define GDK_BUTTON_MASK		(GDK_BUTTON1_MASK | GDK_BUTTON2_MASK | GDK_BUTTON3_MASK)
 
+/* While the map is being dragged, maplets we have to decode get
+ * done as quick reduced previews.  Once the mouse has been still
+ * for this long (or let go of), we put the real thing up.
+ */
+#define DRAG_IDLE_MS	250
+
+static guint drag_timer = 0;
+
+static gboolean
+drag_idle ( gpointer data )
+{
+	drag_timer = 0;
+	vp_info.dragging = 0;
+
+	if ( info.series->frame.previews )
+	    full_redraw ();
+
+	return FALSE;
+}
+
 /* The hint business is either poorly documented, poorly explained, or
  * poorly understood.  Or all the above.  The idea is that events get
  * lumped together and we get the first event when the mouse first enters
@@ -1432,8 +2003,25 @@ motion_handler ( GtkWidget *wp, GdkEventMotion *event, gpointer data )
 	    /*
 	    printf ( "dtxy = %d %.3f %.3f\n", dt, dx, dy );
 	    */
-	    if ( settings.m1_action == M1_GRAB && dt < 200 )
+
+	    /* Keep a smoothed drag velocity so the
+	     * prefetcher knows which way we are headed.
+	     */
+	    if ( dt > 0 && dt < 200 ) {
+		vp_info.vel_x = 0.7 * vp_info.vel_x + 0.3 * dx / dt;
+		vp_info.vel_y = 0.7 * vp_info.vel_y + 0.3 * dy / dt;
+	    } else {
+		vp_info.vel_x = 0.0;
+		vp_info.vel_y = 0.0;
+	    }
+
+	    if ( settings.m1_action == M1_GRAB && dt < 200 ) {
+		vp_info.dragging = 1;
+		if ( drag_timer )
+		    g_source_remove ( drag_timer );
+		drag_timer = g_timeout_add ( DRAG_IDLE_MS, drag_idle, NULL );
 		shift_xy ( dx, dy );
+	    }
 	}
 
 	vp_info.mo_x = event->x;
@@ -1619,10 +2207,26 @@ void
 usage ( void )
 {
 	printf ( "Usage: gtopo [-v -f/i <file>]\n" );
+	printf ( "       gtopo --render [--series 24K] [--center long,lat] [--size 640x800] --out map.png\n" );
+	printf ( "       gtopo --export dir|file.mbtiles --bbox w,s,e,n [--zoom z1-z2]\n" );
+	printf ( "       gtopo --serve port\n" );
+	printf ( "       gtopo --bench script.txt [--cold] [--series 24K] [--center long,lat] [--size 640x800]\n" );
 	exit ( 1 );
 }
 
 static int file_opt = 0;
+static int render_opt = 0;
+
+/* However we leave (the GUI closing, --render or --export finishing,
+ * --serve getting a signal, or even error() bailing out), anything
+ * new we learned about TPQ files is worth saving.  Once the archive
+ * snapshot is in use, this is the only place that happens.
+ */
+static void
+exit_save ( void )
+{
+	tpq_cache_save ();
+}
 
 int
 main ( int argc, char **argv )
@@ -1633,6 +2237,16 @@ main ( int argc, char **argv )
 	GtkWidget *eb;
 	char *p;
 	char *file_name;
+	char *render_name = NULL;
+	char *export_name = NULL;
+	char *export_bbox = NULL;
+	char *export_zoom = NULL;
+	int serve_port = 0;
+	char *bench_name = NULL;
+	int bench_cold = 0;
+	char *ll, *q;
+	int series;
+	int i;
 
 	/* Built in places to look for maps, can be overridden
 	 * from the settings file (and usually is).
@@ -1647,9 +2261,36 @@ main ( int argc, char **argv )
 	archive_add ( "/topo" );
 #endif
 
+#if ! GLIB_CHECK_VERSION(2,32,0)
+	/* The loader threads poke the main loop */
+	g_thread_init ( NULL );
+#endif
+
+	/* Rendering, exporting, serving or benchmarking must work without a display,
+	 * and gtk_init just gives up and exits if it cannot
+	 * find one, so we must not call it at all in that case.
+	 */
+	for ( i=1; i<argc; i++ ) {
+	    if ( strcmp ( argv[i], "--render" ) == 0 )
+		render_opt = headless = 1;
+	    if ( strcmp ( argv[i], "--export" ) == 0 )
+		headless = 1;
+	    if ( strcmp ( argv[i], "--serve" ) == 0 )
+		headless = 1;
+	    if ( strcmp ( argv[i], "--bench" ) == 0 )
+		headless = 1;
+	}
+
+#if ! GLIB_CHECK_VERSION(2,36,0)
+	/* gtk_init would do this for us */
+	if ( headless )
+	    g_type_init ();
+#endif
+
 	/* Let gtk strip off any of its arguments first
 	 */
-	gtk_init ( &argc, &argv );
+	if ( ! headless )
+	    gtk_init ( &argc, &argv );
 
 	argc--;
 	argv++;
@@ -1657,16 +2298,23 @@ main ( int argc, char **argv )
 	info.center_only = 0;
 
 	series_init ();
+	maplet_cache_init ();
+	resample_init ();
 
 	gpx_init ();
 
 	settings_init ();
+	atexit ( exit_save );
 
 	p_info.status = GONE;
 
 	places_init ();
 
-	remote_init ();
+	/* Nobody can talk to us while we render a file,
+	 * and a nightly batch of them would fight over the port.
+	 */
+	if ( ! headless )
+	    remote_init ();
 
 	while ( argc-- ) {
 	    p = *argv++;
@@ -1710,6 +2358,87 @@ main ( int argc, char **argv )
 		file_name = *argv++;
 		file_opt = 1;
 	    }
+
+	    /* These override the starting position and series,
+	     * and the window size, from the settings file.
+	     * They are meant for --render, but work for the GUI too.
+	     */
+	    if ( strcmp ( p, "--series" ) == 0 ) {
+		if ( argc < 1 )
+		    usage ();
+		argc--;
+		series = -1;
+		gronk_series ( &series, *argv++ );
+		if ( series < 0 )
+		    usage ();
+		settings.starting_series = series;
+	    }
+	    if ( strcmp ( p, "--center" ) == 0 ) {
+		/* long,lat -- either may be d:m:s */
+		if ( argc < 1 )
+		    usage ();
+		argc--;
+		ll = *argv++;
+		q = strchr ( ll, ',' );
+		if ( ! q )
+		    usage ();
+		*q++ = '\0';
+		settings.starting_long = parse_dms ( ll );
+		settings.starting_lat = parse_dms ( q );
+	    }
+	    if ( strcmp ( p, "--size" ) == 0 ) {
+		if ( argc < 1 )
+		    usage ();
+		argc--;
+		if ( sscanf ( *argv++, "%dx%d", &settings.x_view, &settings.y_view ) != 2 )
+		    usage ();
+		if ( settings.x_view < 1 || settings.y_view < 1 )
+		    usage ();
+	    }
+	    if ( strcmp ( p, "--out" ) == 0 ) {
+		if ( argc < 1 )
+		    usage ();
+		argc--;
+		render_name = *argv++;
+	    }
+
+	    if ( strcmp ( p, "--export" ) == 0 ) {
+		if ( argc < 1 )
+		    usage ();
+		argc--;
+		export_name = *argv++;
+	    }
+	    if ( strcmp ( p, "--bbox" ) == 0 ) {
+		if ( argc < 1 )
+		    usage ();
+		argc--;
+		export_bbox = *argv++;
+	    }
+	    if ( strcmp ( p, "--zoom" ) == 0 ) {
+		if ( argc < 1 )
+		    usage ();
+		argc--;
+		export_zoom = *argv++;
+	    }
+
+	    if ( strcmp ( p, "--serve" ) == 0 ) {
+		if ( argc < 1 )
+		    usage ();
+		argc--;
+		serve_port = atoi ( *argv++ );
+		if ( serve_port < 1 || serve_port > 65535 )
+		    usage ();
+	    }
+
+	    if ( strcmp ( p, "--bench" ) == 0 ) {
+		if ( argc < 1 )
+		    usage ();
+		argc--;
+		bench_name = *argv++;
+	    }
+	    if ( strcmp ( p, "--cold" ) == 0 )
+		bench_cold = 1;
+
 	    if ( strcmp ( p, "-i" ) == 0 ) {
 		/* show file information, friendly and verbose */
 		if ( argc < 1 )
@@ -1737,6 +2466,23 @@ main ( int argc, char **argv )
 		printf ( "Debug mask: %08x\n", settings.verbose );
 	}
 
+	if ( render_opt && ! render_name )
+	    usage ();
+
+	/* These work from the whole archive, not a single file,
+	 * and we skipped gtk_init, so we had better not fall through
+	 * to the GUI after file_init().
+	 */
+	if ( file_opt && (export_name || serve_port) )
+	    usage ();
+
+	/* No background loading when rendering to a file,
+	 * we just sit and wait for every maplet anyway
+	 * (export and the tile server have threads of their own).
+	 */
+	if ( ! headless )
+	    loader_init ();
+
 	if ( file_opt ) {
 	    /* special: show a single specific .tpq file */
 
@@ -1759,6 +2505,12 @@ main ( int argc, char **argv )
 		return 1;
 	    }
 
+	    /* The starting position has nothing to do with it */
+	    if ( export_name )
+		return export_tiles ( export_name, export_bbox, export_zoom );
+	    if ( serve_port )
+		return serve_main ( serve_port );
+
 	    /* Just probe to see if we can display a map at the
 	     * starting position and series requested.
 	     * If not, we exit here and now with a message rather
@@ -1776,6 +2528,11 @@ main ( int argc, char **argv )
 
 	overlay_init ();
 
+	if ( render_opt )
+	    return render_map ( render_name );
+	if ( bench_name )
+	    return bench_run ( bench_name, bench_cold );
+
 	/* --- set up the GTK stuff we need */
 
 	/* ### First - the main window */
@@ -1882,6 +2639,8 @@ main ( int argc, char **argv )
 	vp_info.mo_x = 0;
 	vp_info.mo_y = 0;
 	vp_info.mo_time = -10000;
+	vp_info.vel_x = 0.0;
+	vp_info.vel_y = 0.0;
 
 	gtk_main ();
 
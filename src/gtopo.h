@@ -96,6 +96,34 @@ struct settings {
 	enum m3_type m3_action;
 	int up_key;
 	int down_key;
+
+	/* memory budget for decoded maplets (0 = no limit) */
+	int maplet_cache_mb;
+
+	/* memory budget for compressed maplets (0 = none) */
+	int jpeg_cache_mb;
+
+	/* boolean, keep TPQ headers in ~/.gtopo/index.bin */
+	int index_cache;
+
+	/* boolean, keep the archive scan in ~/.gtopo/archive.snap */
+	int archive_snap;
+
+	/* how many maplets deep to load around the viewport */
+	int prefetch;
+
+	/* background loader threads (-1 = one per cpu) */
+	int loader_threads;
+
+	/* JPEG decode at 1/drag_scale while dragging (1 = full) */
+	int drag_scale;
+
+	/* Render this many maplets past each edge of the viewport
+	 * (0 = pixmap is just the viewport size)
+	 */
+	int pixmap_margin;
+	/* Encoded mosaic tiles the tile server keeps around */
+	int tile_cache_mb;
 };
 
 /* XXX - we need to introduce a tpq structure and link to it
@@ -104,27 +132,64 @@ struct settings {
  * file format changes from state to state.
  */
 
+/* Where the last pixmap_redraw() put things.
+ * Maplets that finish loading in the background after the
+ * redraw is over use this to figure out where they go.
+ * gen is bumped on every redraw, so a maplet that shows up
+ * late for a frame we have since moved away from gets ignored.
+ */
+struct frame {
+	int gen;
+	/* maplet indices below are relative to this one */
+	int ref_x;
+	int ref_y;
+	struct method *method;
+	int origx;
+	int origy;
+	int nx1, nx2;
+	int ny1, ny2;
+	int px;
+	int py;
+	/* how many quick previews we drew */
+	int previews;
+};
+
 struct series {
 	/* What series this is */
 	enum s_type series;
 
 	int tpq_count;		/* number of files seen */
 
-	/* pointer to the maplet cache for the
-	 * current series
+	/* how many maplets from this series
+	 * are in the maplet cache.
 	 */
-	struct maplet *cache;
 	int cache_count;
 
 	/* pixmap for this series */
 	GdkPixmap *pixels;
 
+	/* The pixmap may be bigger than the viewport (see pixmap_margin),
+	 * it is pix_w by pix_h and the viewport shows the part at view_x, view_y.
+	 */
+	int pix_w;
+	int pix_h;
+	int margin_x;
+	int margin_y;
+	int view_x;
+	int view_y;
+
 	/* boolean, true if pixmap content is OK */
 	int content;
 
+	/* how the pixmap content was laid out */
+	struct frame frame;
+
 	struct method *methods;
 	struct method *cur_method;
 
+	/* index over the file methods, see lookup_method() */
+	struct file_grid *file_grid;
+
 	/* pixel size of maplet XXX */
 	int xdim;
 	int ydim;
@@ -216,6 +281,11 @@ struct viewport {
         double mo_x;
         double mo_y;
         int mo_time;
+	/* smoothed drag velocity, pixels per millisecond */
+	double vel_x;
+	double vel_y;
+	/* boolean, the map is being dragged around */
+	int dragging;
         GtkWidget *da;
 };
 
@@ -231,9 +301,8 @@ struct info_info {
 struct method {
 	struct method *next;
 	enum m_type type;
-	struct section *sections;
+	struct section_grid *sections;
 	struct tpq_info *tpq;
-	struct maplet *cache;
 };
 
 /* This is set up by load_maplet() and lookup_quad()
@@ -241,14 +310,38 @@ struct method {
  * variables in the above routines.
  */
 struct maplet {
+	/* hash chain in the maplet cache */
 	struct maplet *next;
 
-	/* Unique indices used to do cache lookups */
+	/* The cache key is the series along with the
+	 * TPQ file and index within it, this is unique
+	 * even when a series has several file methods.
+	 */
+	enum s_type series;
+
+	/* Maplet indices within the series */
 	int world_x;
 	int world_y;
 
-	/* Use for possible cache entry aging */
-	int time;
+	/* CLOCK eviction state, each series has a ring
+	 * of its cached maplets and a hand that sweeps it.
+	 * ref is set on every cache hit and cleared by the hand.
+	 */
+	struct maplet *ring_next;
+	struct maplet *ring_prev;
+	int ref;
+
+	/* bytes of pixel data we are holding */
+	int bytes;
+
+	/* 1 for a proper maplet, 2, 4, or 8 for a quick preview
+	 * that was decoded at that fraction of full size
+	 * (and then blown back up), see jpeg_decode() in tpq_io.c.
+	 * A full decode that comes along later waits in "better"
+	 * until the main thread swaps it in.
+	 */
+	int scale;
+	struct maplet *better;
 
 	/* size of the maplet image in pixels */
 	int xdim;
@@ -264,6 +357,9 @@ struct maplet {
 	int tpq_index;
 
 	struct tpq_info *tpq;
+
+	/* tpq_willneed_maplets() has already asked for the bytes */
+	int hinted;
 };
 
 /* Stuff extracted from a TPQ file header
@@ -272,6 +368,12 @@ struct tpq_info {
 	struct tpq_info *next;
 	char *path;
 
+	/* chain in the tpq_lookup() hash table */
+	struct tpq_info *hash_next;
+
+	/* small integer, unique for each file */
+	int id;
+
 	char *state;
 	char *quad;
 
@@ -292,6 +394,24 @@ struct tpq_info {
 
 	int index_size;
 	struct tpq_index_e *index;
+
+	/* JPEG size of the maplets in this file,
+	 * 0 until tpq_maplet_size() finds out.
+	 */
+	int maplet_xdim;
+	int maplet_ydim;
+
+	/* An open descriptor and the whole file mapped
+	 * into memory.  These are handed out by a small
+	 * LRU pool in tpq_io.c, fd is -1 when not in the pool.
+	 */
+	int fd;
+	unsigned char *map;
+	size_t map_size;
+	int map_failed;
+	int pool_users;
+	struct tpq_info *pool_next;
+	struct tpq_info *pool_prev;
 };
 
 struct tpq_index_e {
@@ -299,6 +419,14 @@ struct tpq_index_e {
 	long	size;
 };
 
+/* What getting maplets has cost us so far (see bench.c) */
+struct load_stats {
+	long loads;	/* maplets decoded */
+	long reads;	/* of those, how many we read from a TPQ file */
+	long bytes;	/* bytes read from TPQ files */
+	double decode;	/* seconds spent decoding */
+};
+
 enum {
         NAME_COLUMN,
 	LONG_COLUMN,
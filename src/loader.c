@@ -0,0 +1,578 @@
+/*
+ *  GTopo
+ *
+ *  Copyright (C) 2007, Thomas J. Trebisky
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Street #330, Boston, MA 02111-1307, USA.
+ */
+
+/* loader.c -- part of gtopo
+ * Tom Trebisky  MMT Observatory, Tucson, Arizona
+ *
+ * Background maplet loading.
+ *
+ * When panning around, every time we cross a maplet edge we used to
+ * stall while a new row or column of maplets got read and decoded.
+ * Here we keep a few threads busy decoding the maplets just outside the
+ * viewport (a ring of them, "prefetch" maplets deep) so that when we
+ * get there they are already in the cache.  The ring is extended in
+ * the direction we are being dragged, and the maplets that way go first.
+ *
+ * The division of labor is important.  Figuring out which TPQ file
+ * and index a maplet comes from (maplet_lookup) uses the archive code,
+ * which is not thread safe, so the main thread does that and queues
+ * a job.  The worker threads just read and decode (maplet_decode),
+ * which touches nothing but the TPQ file pool and the maplet cache,
+ * both of which have their own locks.
+ *
+ * The same threads also do the heavy lifting on a cold redraw.
+ * Rather than decoding every visible maplet one after another
+ * in pixmap_redraw (with the GUI frozen the whole time), it hands
+ * the missing ones to us as "urgent" jobs, which go ahead of any
+ * prefetching.  When one is done, the worker puts it on a done list
+ * and pokes the main loop with an idle callback, and the main thread
+ * draws it into the pixmap.  Only the main thread ever touches GDK.
+ */
+
+#include <gtk/gtk.h>
+#include <glib/gstdio.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include <pthread.h>
+
+#include "gtopo.h"
+#include "protos.h"
+
+extern struct topo_info info;
+extern struct settings settings;
+extern struct viewport vp_info;
+
+#define MAX_LOADERS	16
+
+/* For urgent jobs we remember where the maplet goes
+ * (x, y relative to the center maplet as in pixmap_redraw)
+ * and which frame it is for.
+ */
+struct job {
+	struct job *next;
+	struct maplet *mp;
+	int urgent;
+	int gen;
+	int x;
+	int y;
+};
+
+/* We hang onto the cache key, not the maplet, see maplet_find() */
+struct done {
+	struct done *next;
+	int series;
+	struct tpq_info *tpq;
+	int index;
+	int gen;
+	int x;
+	int y;
+};
+
+static struct job *job_head = NULL;
+static struct job *job_tail = NULL;
+
+static struct job *urgent_head = NULL;
+static struct job *urgent_tail = NULL;
+
+/* Urgent jobs that loader_start() has yet to hand over
+ * (only the main thread touches these).
+ */
+static struct job *visible_head = NULL;
+static struct job *visible_tail = NULL;
+
+/* urgent jobs queued or being worked on */
+static int urgent_count = 0;
+
+static pthread_mutex_t job_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t job_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t urgent_cond = PTHREAD_COND_INITIALIZER;
+
+static struct done *done_head = NULL;
+static struct done *done_tail = NULL;
+static int idle_pending = 0;
+
+static pthread_mutex_t done_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int num_loaders = 0;
+
+/* Runs on the main thread, draw whatever has come in.
+ */
+static void
+loader_drain ( void )
+{
+	struct done *dp, *np;
+	struct maplet *mp;
+	int count = 0;
+
+	pthread_mutex_lock ( &done_lock );
+	dp = done_head;
+	done_head = done_tail = NULL;
+	idle_pending = 0;
+	pthread_mutex_unlock ( &done_lock );
+
+	for ( ; dp; dp = np ) {
+	    np = dp->next;
+	    mp = maplet_find ( dp->series, dp->tpq, dp->index );
+	    if ( mp ) {
+		pixmap_maplet ( mp, dp->gen, dp->x, dp->y );
+		count++;
+	    }
+	    free ( (char *) dp );
+	}
+
+	if ( count )
+	    pixmap_maplet_done ();
+
+	/* The loaders have been busy putting things into the cache */
+	maplet_cache_trim ();
+}
+
+static gboolean
+loader_idle ( gpointer data )
+{
+	loader_drain ();
+	return FALSE;
+}
+
+static void
+loader_done ( struct job *jp, struct done *dp )
+{
+	dp->next = NULL;
+	dp->gen = jp->gen;
+	dp->x = jp->x;
+	dp->y = jp->y;
+
+	pthread_mutex_lock ( &done_lock );
+	if ( done_tail )
+	    done_tail->next = dp;
+	else
+	    done_head = dp;
+	done_tail = dp;
+	if ( ! idle_pending ) {
+	    idle_pending = 1;
+	    g_idle_add ( loader_idle, NULL );
+	}
+	pthread_mutex_unlock ( &done_lock );
+}
+
+static void *
+loader_func ( void *arg )
+{
+	struct job *jp;
+	struct done *dp;
+
+	for ( ;; ) {
+	    pthread_mutex_lock ( &job_lock );
+	    while ( ! urgent_head && ! job_head )
+		pthread_cond_wait ( &job_cond, &job_lock );
+	    if ( urgent_head ) {
+		jp = urgent_head;
+		urgent_head = jp->next;
+		if ( ! urgent_head )
+		    urgent_tail = NULL;
+	    } else {
+		jp = job_head;
+		job_head = jp->next;
+		if ( ! job_head )
+		    job_tail = NULL;
+	    }
+	    pthread_mutex_unlock ( &job_lock );
+
+	    /* Grab the key now, once we hand over the maplet
+	     * it is not ours to look at any more.
+	     */
+	    dp = NULL;
+	    if ( jp->urgent ) {
+		dp = (struct done *) gmalloc ( sizeof(struct done) );
+		dp->series = jp->mp->series;
+		dp->tpq = jp->mp->tpq;
+		dp->index = jp->mp->tpq_index;
+	    }
+
+	    if ( ! maplet_decode ( jp->mp ) ) {
+		free ( (char *) dp );
+		dp = NULL;
+	    }
+
+	    if ( jp->urgent ) {
+		if ( dp )
+		    loader_done ( jp, dp );
+		pthread_mutex_lock ( &job_lock );
+		if ( --urgent_count == 0 )
+		    pthread_cond_broadcast ( &urgent_cond );
+		pthread_mutex_unlock ( &job_lock );
+	    }
+
+	    free ( (char *) jp );
+	}
+
+	return NULL;
+}
+
+/* Start up the loader threads.
+ * loader_threads of 0 means no background loading at all,
+ * less than 0 means one per processor.
+ */
+void
+loader_init ( void )
+{
+	pthread_t thread;
+	int n;
+	int i;
+
+	n = settings.loader_threads;
+	if ( n < 0 )
+	    n = sysconf ( _SC_NPROCESSORS_ONLN );
+	if ( n > MAX_LOADERS )
+	    n = MAX_LOADERS;
+
+	for ( i=0; i<n; i++ ) {
+	    if ( pthread_create ( &thread, NULL, loader_func, NULL ) != 0 )
+		break;
+	    pthread_detach ( thread );
+	    num_loaders++;
+	}
+
+	if ( settings.verbose & V_BASIC )
+	    printf ( "Started %d maplet loader threads\n", num_loaders );
+}
+
+/* Before a batch of jobs goes to the loaders, tell the kernel
+ * about all the file ranges they will be reading, a few hints for
+ * the lot rather than a madvise per maplet (see tpq_io.c).
+ * Returns how many jobs there are.
+ */
+static int
+jobs_hint ( struct job *list )
+{
+	struct maplet **mps;
+	struct job *jp;
+	int n;
+
+	n = 0;
+	for ( jp = list; jp; jp = jp->next )
+	    n++;
+	if ( ! n )
+	    return 0;
+
+	mps = (struct maplet **) gmalloc ( n * sizeof(struct maplet *) );
+	n = 0;
+	for ( jp = list; jp; jp = jp->next )
+	    mps[n++] = jp->mp;
+
+	tpq_willneed_maplets ( mps, n );
+	free ( (char *) mps );
+
+	return n;
+}
+
+/* Toss out any prefetch jobs nobody has started yet.
+ * We are about to queue up a fresh set.
+ * Urgent jobs are left alone, they are on the screen.
+ */
+static void
+loader_flush ( void )
+{
+	struct job *jp, *np;
+
+	pthread_mutex_lock ( &job_lock );
+	for ( jp = job_head; jp; jp = np ) {
+	    np = jp->next;
+	    free ( (char *) jp->mp );
+	    free ( (char *) jp );
+	}
+	job_head = job_tail = NULL;
+	pthread_mutex_unlock ( &job_lock );
+}
+
+/* Make up a job for the maplet at this position,
+ * if there is such a maplet and we don't already have it.
+ * It goes on the end of the list at *tailp, which loader_prefetch
+ * hands to the loaders all at once.
+ */
+static void
+loader_queue ( int maplet_x, int maplet_y, struct job ***tailp )
+{
+	struct maplet probe;
+	struct job *jp;
+
+	if ( maplet_lookup ( maplet_x, maplet_y, &probe ) )
+	    return;
+	if ( ! probe.tpq )
+	    return;
+
+	jp = (struct job *) gmalloc ( sizeof(struct job) );
+	jp->mp = maplet_dup ( &probe );
+	jp->urgent = 0;
+	jp->next = NULL;
+
+	**tailp = jp;
+	*tailp = &jp->next;
+}
+
+/* pixmap_redraw calls this for a visible maplet that is not in
+ * the cache (probe is as set up by maplet_lookup), and it gets
+ * drawn at x, y in frame gen when it is ready.
+ * Returns 0 if we have no loader threads, in which case
+ * the caller had better load it itself.
+ * Nothing actually starts until the caller is done with the
+ * screen and calls loader_start().
+ *
+ * If we are redrawing faster than the loaders keep up (window
+ * resizing, say) the same maplet may already be waiting in the
+ * queue for an older frame, and then we just bring that job up
+ * to date rather than decode the thing twice.
+ */
+int
+loader_visible ( struct maplet *probe, int gen, int x, int y )
+{
+	struct job *jp;
+
+	if ( num_loaders < 1 )
+	    return 0;
+
+	for ( jp = visible_head; jp; jp = jp->next ) {
+	    if ( jp->mp->tpq == probe->tpq && jp->mp->tpq_index == probe->tpq_index &&
+		    jp->mp->series == probe->series ) {
+		jp->mp->scale = probe->scale;
+		jp->gen = gen;
+		jp->x = x;
+		jp->y = y;
+		return 1;
+	    }
+	}
+
+	pthread_mutex_lock ( &job_lock );
+	for ( jp = urgent_head; jp; jp = jp->next ) {
+	    if ( jp->mp->tpq == probe->tpq && jp->mp->tpq_index == probe->tpq_index &&
+		    jp->mp->series == probe->series ) {
+		jp->mp->scale = probe->scale;
+		jp->gen = gen;
+		jp->x = x;
+		jp->y = y;
+		pthread_mutex_unlock ( &job_lock );
+		return 1;
+	    }
+	}
+	pthread_mutex_unlock ( &job_lock );
+
+	jp = (struct job *) gmalloc ( sizeof(struct job) );
+	jp->mp = maplet_dup ( probe );
+	jp->urgent = 1;
+	jp->gen = gen;
+	jp->x = x;
+	jp->y = y;
+	jp->next = NULL;
+
+	if ( visible_tail )
+	    visible_tail->next = jp;
+	else
+	    visible_head = jp;
+	visible_tail = jp;
+
+	return 1;
+}
+
+/* Hand what loader_visible() has collected to the loaders,
+ * after one round of hints for the whole lot.
+ */
+void
+loader_start ( void )
+{
+	int n;
+
+	if ( ! visible_head )
+	    return;
+
+	n = jobs_hint ( visible_head );
+
+	pthread_mutex_lock ( &job_lock );
+	if ( urgent_tail )
+	    urgent_tail->next = visible_head;
+	else
+	    urgent_head = visible_head;
+	urgent_tail = visible_tail;
+	urgent_count += n;
+	pthread_cond_broadcast ( &job_cond );
+	pthread_mutex_unlock ( &job_lock );
+
+	visible_head = visible_tail = NULL;
+}
+
+/* Wait for every visible maplet to get loaded and drawn.
+ * For things like snap() that want the whole picture right now.
+ */
+void
+loader_finish ( void )
+{
+	if ( num_loaders < 1 )
+	    return;
+
+	loader_start ();
+
+	pthread_mutex_lock ( &job_lock );
+	while ( urgent_count > 0 )
+	    pthread_cond_wait ( &urgent_cond, &job_lock );
+	pthread_mutex_unlock ( &job_lock );
+
+	loader_drain ();
+}
+
+struct ring_cell {
+	int x;
+	int y;
+	double score;
+};
+
+static int
+ring_compare ( const void *a, const void *b )
+{
+	const struct ring_cell *ap = a;
+	const struct ring_cell *bp = b;
+
+	if ( ap->score < bp->score )
+	    return -1;
+	if ( ap->score > bp->score )
+	    return 1;
+	return 0;
+}
+
+/* Keep track of what we last asked for, since this gets called
+ * on every redraw, and most redraws while dragging do not bring
+ * any new maplets into view.
+ */
+static int last_series = -1;
+static int last_x1, last_x2, last_y1, last_y2;
+
+/* Given the range of maplets now on the screen (in maplet indices
+ * relative to the center maplet, x to the west and y to the north,
+ * just as in pixmap_redraw), queue up the ring around them.
+ *
+ * The drag velocity from motion_handler is in screen pixels, but
+ * dragging the mouse to the right (+x) brings in maplets from the
+ * west (+x in maplet indices) and dragging down (+y) brings in
+ * maplets from the north (+y), so the signs work out just right.
+ */
+void
+loader_prefetch ( int nx1, int nx2, int ny1, int ny2 )
+{
+	struct ring_cell *cells;
+	struct job *list;
+	struct job **tail;
+	int ncells;
+	int depth;
+	int x1, x2, y1, y2;
+	int x, y;
+	int dx, dy;
+	double vx, vy, speed;
+	int i;
+
+	if ( num_loaders < 1 || settings.prefetch < 1 )
+	    return;
+
+	depth = settings.prefetch;
+
+	/* Work in absolute maplet indices */
+	x1 = info.maplet_x + nx1;
+	x2 = info.maplet_x + nx2;
+	y1 = info.maplet_y + ny1;
+	y2 = info.maplet_y + ny2;
+
+	if ( info.series->series == last_series &&
+		x1 == last_x1 && x2 == last_x2 && y1 == last_y1 && y2 == last_y2 )
+	    return;
+
+	last_series = info.series->series;
+	last_x1 = x1;
+	last_x2 = x2;
+	last_y1 = y1;
+	last_y2 = y2;
+
+	/* Anything still queued is for where we used to be */
+	loader_flush ();
+
+	vx = vp_info.vel_x;
+	vy = vp_info.vel_y;
+	speed = sqrt ( vx*vx + vy*vy );
+	if ( speed > 0.0 ) {
+	    vx /= speed;
+	    vy /= speed;
+	}
+
+	/* We go an extra ring deep in the direction we are headed */
+	ncells = (x2 - x1 + 1 + 4*depth) * (y2 - y1 + 1 + 4*depth);
+	cells = (struct ring_cell *) gmalloc ( ncells * sizeof(struct ring_cell) );
+	ncells = 0;
+
+	for ( y = y1 - 2*depth; y <= y2 + 2*depth; y++ ) {
+	    for ( x = x1 - 2*depth; x <= x2 + 2*depth; x++ ) {
+
+		/* how far outside the visible block, and which way */
+		dx = x < x1 ? x - x1 : ( x > x2 ? x - x2 : 0 );
+		dy = y < y1 ? y - y1 : ( y > y2 ? y - y2 : 0 );
+
+		if ( dx == 0 && dy == 0 )
+		    continue;
+
+		/* Beyond the plain ring, only the way we are moving */
+		if ( abs(dx) > depth || abs(dy) > depth ) {
+		    if ( dx * vx + dy * vy < 0.5 * (abs(dx) + abs(dy)) )
+			continue;
+		}
+
+		/* Closer is better, and ahead of us is better yet */
+		cells[ncells].x = x;
+		cells[ncells].y = y;
+		cells[ncells].score = sqrt ( (double) (dx*dx + dy*dy) ) - 1.5 * (dx * vx + dy * vy);
+		ncells++;
+	    }
+	}
+
+	qsort ( cells, ncells, sizeof(struct ring_cell), ring_compare );
+
+	if ( settings.verbose & V_MAPLET )
+	    printf ( "prefetch %d maplets around %d..%d %d..%d (v = %.2f %.2f)\n",
+		ncells, x1, x2, y1, y2, vx, vy );
+
+	list = NULL;
+	tail = &list;
+	for ( i=0; i<ncells; i++ )
+	    loader_queue ( cells[i].x, cells[i].y, &tail );
+
+	free ( (char *) cells );
+
+	if ( ! jobs_hint ( list ) )
+	    return;
+
+	pthread_mutex_lock ( &job_lock );
+	if ( job_tail )
+	    job_tail->next = list;
+	else
+	    job_head = list;
+	for ( job_tail = list; job_tail->next; job_tail = job_tail->next )
+	    ;
+	pthread_cond_broadcast ( &job_cond );
+	pthread_mutex_unlock ( &job_lock );
+}
+
+/* THE END */
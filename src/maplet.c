@@ -28,24 +28,14 @@
 #include <fcntl.h>
 #include <string.h>
 #include <math.h>
+#include <pthread.h>
 
 #include "gtopo.h"
 #include "protos.h"
 
 extern struct topo_info info;
 extern struct settings settings;
-
-/* I have had the maplet cache get up to 2500 entries without
- * any trouble, but someday may want to monitor the size and
- * recycle entries with an age timestamp.
- * Also, it may be possible to use a more sophisticated data
- * structure than a linear linked list to speed up the search.
- * (use the low bits as a hash index, this puts local blocks
- * into separate hash bins, something like:
- * (maplet_lat & 0xf) << 4 | (maplet_long & 0xf)
- * Also, when an entry is found, move it to the front of
- * the list.
- */
+extern struct viewport vp_info;
 
 static struct maplet *
 maplet_new ( void )
@@ -56,6 +46,9 @@ maplet_new ( void )
 	if ( ! mp )
 	    error ("maplet_new, out of mem\n");
 
+	memset ( (char *) mp, 0, sizeof(struct maplet) );
+	mp->scale = 1;
+
 	return mp;
 }
 
@@ -73,30 +66,732 @@ maplet_free ( struct maplet *mp )
 	free ( (char *) mp );
 }
 
-/* XXX - plain old linear search, maybe someday will do some hashing.
+/* I have had the maplet cache get up to 2500 entries without
+ * any trouble, and a long session of panning around at 24K can
+ * easily get to several thousand, so a linear list won't do.
+ *
+ * The cache is a hash table keyed on the series along with the
+ * TPQ file and the maplet index within that file.  The older scheme
+ * of using world_x and world_y as the key was ambiguous when a series
+ * had several file methods (US, AK, and HI at the STATE and ATLAS levels
+ * all number their maplets from zero).
+ *
+ * The table is split into shards, each with its own lock and its own
+ * bucket array, so that background loaders can use it safely without
+ * everybody piling up on one lock.  The shard comes from the low bits
+ * of the hash, the bucket within the shard from the higher bits.
+ */
+
+#define CACHE_SHARDS		16
+#define CACHE_SHARD_MASK	(CACHE_SHARDS-1)
+#define CACHE_SHARD_BITS	4
+
+#define CACHE_INIT_BUCKETS	64
+
+struct cache_shard {
+	pthread_mutex_t lock;
+	struct maplet **buckets;
+	int nbuckets;
+	int count;
+};
+
+static struct cache_shard cache_shards[CACHE_SHARDS];
+
+void
+maplet_cache_init ( void )
+{
+	struct cache_shard *cp;
+	int i;
+
+	for ( i=0; i<CACHE_SHARDS; i++ ) {
+	    cp = &cache_shards[i];
+	    pthread_mutex_init ( &cp->lock, NULL );
+	    cp->nbuckets = CACHE_INIT_BUCKETS;
+	    cp->buckets = (struct maplet **) gmalloc ( cp->nbuckets * sizeof(struct maplet *) );
+	    memset ( cp->buckets, 0, cp->nbuckets * sizeof(struct maplet *) );
+	    cp->count = 0;
+	}
+}
+
+static unsigned int
+maplet_hash ( int series, int tpq_id, int index )
+{
+	unsigned int h;
+
+	h = series * 0x9e3779b1u;
+	h ^= tpq_id * 0x85ebca6bu;
+	h ^= index * 0xc2b2ae35u;
+
+	/* mix so the low bits (the shard) depend on everything */
+	h ^= h >> 15;
+	h *= 0x2c1b3c6du;
+	h ^= h >> 12;
+
+	return h;
+}
+
+static struct cache_shard *
+maplet_shard ( unsigned int hash )
+{
+	return &cache_shards[hash & CACHE_SHARD_MASK];
+}
+
+static int
+maplet_bucket ( struct cache_shard *cp, unsigned int hash )
+{
+	return (hash >> CACHE_SHARD_BITS) & (cp->nbuckets - 1);
+}
+
+/* Double the bucket array for a shard.
+ * Called with the shard lock held.
+ */
+static void
+maplet_shard_grow ( struct cache_shard *cp )
+{
+	struct maplet **old;
+	int old_n;
+	struct maplet *mp, *np;
+	unsigned int h;
+	int i, b;
+
+	old = cp->buckets;
+	old_n = cp->nbuckets;
+
+	cp->nbuckets = old_n * 2;
+	cp->buckets = (struct maplet **) gmalloc ( cp->nbuckets * sizeof(struct maplet *) );
+	memset ( cp->buckets, 0, cp->nbuckets * sizeof(struct maplet *) );
+
+	for ( i=0; i<old_n; i++ ) {
+	    for ( mp = old[i]; mp; mp = np ) {
+		np = mp->next;
+		h = maplet_hash ( mp->series, mp->tpq->id, mp->tpq_index );
+		b = maplet_bucket ( cp, h );
+		mp->next = cp->buckets[b];
+		cp->buckets[b] = mp;
+	    }
+	}
+
+	free ( (char *) old );
+}
+
+/* Eviction.
+ *
+ * Left alone, the cache just grows, and a long session will pile up
+ * gigabytes of pixbufs.  We keep a running count of the pixel bytes
+ * we hold and when it gets over budget we throw some away.
+ *
+ * Each series gets an equal share of the budget as a floor and is
+ * never asked to give anything back while under that floor.
+ * This keeps a lot of panning around at 24K from wiping out the
+ * STATE and ATLAS maplets, which are expensive to come by.
+ * When we are over budget, the series furthest over its floor
+ * gives up a maplet.
+ *
+ * Within a series we use the CLOCK scheme.  The maplets are on a
+ * ring, a cache hit sets the ref bit, and the hand sweeps around
+ * clearing ref bits until it finds one that is clear.  That one goes.
+ * Newly added maplets go just behind the hand so they get a full
+ * trip around before being considered.
+ *
+ * Only the main (GTK) thread trims the cache.  Nobody else holds
+ * onto a maplet pointer after handing the pixels off to be drawn,
+ * so it is safe to free things here.
+ *
+ * The tile server (serve.c) is different, its threads composite
+ * right out of cached maplets, and any of them may trim.  They
+ * wrap what they do in maplet_hold() and maplet_release(), and the
+ * trim waits for everybody to let go before it frees anything.
+ * Nobody else takes the hold, so for the GUI this costs nothing.
+ */
+
+struct cache_ring {
+	struct maplet *hand;
+	long bytes;
+};
+
+static struct cache_ring cache_rings[N_SERIES];
+static long cache_bytes = 0;
+
+/* Lock ordering: never take ring_lock while holding a shard lock */
+static pthread_mutex_t ring_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Lock ordering: take this before anything else, and never
+ * trim (or do a maplet_load_now) while holding it.
+ */
+static pthread_rwlock_t hold_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+void
+maplet_hold ( void )
+{
+	pthread_rwlock_rdlock ( &hold_lock );
+}
+
+void
+maplet_release ( void )
+{
+	pthread_rwlock_unlock ( &hold_lock );
+}
+
+static void
+ring_add ( struct maplet *mp )
+{
+	struct cache_ring *rp;
+	struct maplet *hand;
+
+	mp->ref = 0;
+	mp->bytes = sizeof(struct maplet) +
+		gdk_pixbuf_get_rowstride ( mp->pixbuf ) * gdk_pixbuf_get_height ( mp->pixbuf );
+
+	pthread_mutex_lock ( &ring_lock );
+
+	rp = &cache_rings[mp->series];
+	hand = rp->hand;
+
+	if ( ! hand ) {
+	    mp->ring_next = mp;
+	    mp->ring_prev = mp;
+	    rp->hand = mp;
+	} else {
+	    mp->ring_next = hand;
+	    mp->ring_prev = hand->ring_prev;
+	    hand->ring_prev->ring_next = mp;
+	    hand->ring_prev = mp;
+	}
+
+	rp->bytes += mp->bytes;
+	cache_bytes += mp->bytes;
+	info.series_info[mp->series].cache_count++;
+
+	pthread_mutex_unlock ( &ring_lock );
+}
+
+/* Sweep the hand until we find a maplet that has not
+ * been used since the last trip around, and take it off the ring.
+ * Called with ring_lock held.
  */
 static struct maplet *
-maplet_cache_lookup ( struct maplet *head, int maplet_x, int maplet_y )
+ring_victim ( struct cache_ring *rp )
+{
+	struct maplet *mp;
+
+	mp = rp->hand;
+	while ( mp->ref ) {
+	    mp->ref = 0;
+	    mp = mp->ring_next;
+	}
+
+	if ( mp->ring_next == mp ) {
+	    rp->hand = NULL;
+	} else {
+	    mp->ring_prev->ring_next = mp->ring_next;
+	    mp->ring_next->ring_prev = mp->ring_prev;
+	    rp->hand = mp->ring_next;
+	}
+
+	rp->bytes -= mp->bytes;
+	cache_bytes -= mp->bytes;
+	info.series_info[mp->series].cache_count--;
+
+	return mp;
+}
+
+static void
+maplet_cache_remove ( struct maplet *victim )
+{
+	struct cache_shard *cp;
+	struct maplet **pp;
+	unsigned int h;
+
+	h = maplet_hash ( victim->series, victim->tpq->id, victim->tpq_index );
+	cp = maplet_shard ( h );
+
+	pthread_mutex_lock ( &cp->lock );
+	for ( pp = &cp->buckets[maplet_bucket(cp,h)]; *pp; pp = &(*pp)->next ) {
+	    if ( *pp == victim ) {
+		*pp = victim->next;
+		cp->count--;
+		break;
+	    }
+	}
+	pthread_mutex_unlock ( &cp->lock );
+}
+
+/* Bring the cache back under budget.
+ * We pull the victims off the rings first, then drop them from
+ * the hash table with the ring lock released.
+ * If wait is zero and somebody holds maplets, we don't wait for
+ * them, we just give up and let a later call do it.
+ */
+static void
+cache_trim ( long budget, int wait )
+{
+	struct maplet *victims;
+	struct maplet *mp;
+	long floor;
+	long over;
+	long worst_over;
+	int worst;
+	int count;
+	int i;
+
+	floor = budget / N_SERIES;
+
+	/* A quick look first, so we only wait on the hold when we must */
+	if ( cache_bytes <= budget )
+	    return;
+
+	victims = NULL;
+	count = 0;
+
+	if ( wait )
+	    pthread_rwlock_wrlock ( &hold_lock );
+	else if ( pthread_rwlock_trywrlock ( &hold_lock ) != 0 )
+	    return;
+
+	pthread_mutex_lock ( &ring_lock );
+	while ( cache_bytes > budget ) {
+	    worst = -1;
+	    worst_over = 0;
+	    for ( i=0; i<N_SERIES; i++ ) {
+		over = cache_rings[i].bytes - floor;
+		if ( over > worst_over ) {
+		    worst_over = over;
+		    worst = i;
+		}
+	    }
+
+	    /* can't happen, the floors add up to the budget */
+	    if ( worst < 0 )
+		break;
+
+	    mp = ring_victim ( &cache_rings[worst] );
+	    mp->ring_next = victims;
+	    victims = mp;
+	    count++;
+	}
+	pthread_mutex_unlock ( &ring_lock );
+
+	if ( count && (settings.verbose & V_MAPLET) )
+	    printf ( "maplet cache trim: %d maplets, %ld bytes remain\n", count, cache_bytes );
+
+	while ( victims ) {
+	    mp = victims;
+	    victims = mp->ring_next;
+	    maplet_cache_remove ( mp );
+	    if ( mp->better ) {
+		pixbuf_put ( mp->better->pixbuf );
+		maplet_free ( mp->better );
+	    }
+	    pixbuf_put ( mp->pixbuf );
+	    maplet_free ( mp );
+	}
+
+	pthread_rwlock_unlock ( &hold_lock );
+}
+
+void
+maplet_cache_trim ( void )
+{
+	if ( settings.maplet_cache_mb <= 0 )
+	    return;
+
+	cache_trim ( settings.maplet_cache_mb * 1024L * 1024L, 1 );
+}
+
+/* The tile server threads call this between requests.
+ * Waiting for the write lock there would be a bad idea, the
+ * rwlock favors readers, so with other threads always holding
+ * maplets we could wait forever, and in any event everybody
+ * would end up lined up behind us.  So we only trim when the
+ * cache is over budget and nobody is holding anything just now,
+ * and with a busy server that happens often enough.
+ */
+void
+maplet_cache_try_trim ( void )
+{
+	if ( settings.maplet_cache_mb <= 0 )
+	    return;
+
+	cache_trim ( settings.maplet_cache_mb * 1024L * 1024L, 0 );
+}
+
+/* A full decode of a maplet we had a quick preview of has come in.
+ * Swap its pixels into the cached maplet.  This is only safe
+ * on the main thread, which is the only one drawing maplets,
+ * so the loaders leave it in mp->better for us to find.
+ * Call with the shard lock held.
+ */
+static void
+maplet_promote ( struct maplet *mp )
+{
+	struct maplet *bp;
+	GdkPixbuf *tmp;
+
+	bp = mp->better;
+	mp->better = NULL;
+
+	tmp = mp->pixbuf;
+	mp->pixbuf = bp->pixbuf;
+	mp->scale = bp->scale;
+	mp->xdim = bp->xdim;
+	mp->ydim = bp->ydim;
+
+	pixbuf_put ( tmp );
+	maplet_free ( bp );
+}
+
+/* Called from maplet_lookup() and maplet_load_now(), so on the
+ * main thread, or a serve thread holding archive_lock().
+ */
+static struct maplet *
+maplet_cache_lookup ( int series, struct tpq_info *tp, int index )
+{
+	struct cache_shard *cp;
+	struct maplet *mp;
+	unsigned int h;
+
+	h = maplet_hash ( series, tp->id, index );
+	cp = maplet_shard ( h );
+
+	pthread_mutex_lock ( &cp->lock );
+	for ( mp = cp->buckets[maplet_bucket(cp,h)]; mp; mp = mp->next ) {
+	    if ( mp->tpq_index == index && mp->tpq == tp && mp->series == series ) {
+		mp->ref = 1;
+		if ( mp->better )
+		    maplet_promote ( mp );
+		break;
+	    }
+	}
+	pthread_mutex_unlock ( &cp->lock );
+
+	return mp;
+}
+
+/* Put a freshly loaded maplet into the cache.
+ * If somebody else beat us to it (a background loader for example),
+ * we toss ours and hand back the one already there.
+ * Unless what is there is a quick preview and ours is better,
+ * in which case we leave ours for maplet_promote().
+ */
+static struct maplet *
+maplet_cache_insert ( struct maplet *new )
+{
+	struct cache_shard *cp;
+	struct maplet *mp;
+	struct maplet *old;
+	unsigned int h;
+	int b;
+
+	h = maplet_hash ( new->series, new->tpq->id, new->tpq_index );
+	cp = maplet_shard ( h );
+
+	pthread_mutex_lock ( &cp->lock );
+
+	b = maplet_bucket ( cp, h );
+	for ( mp = cp->buckets[b]; mp; mp = mp->next ) {
+	    if ( mp->tpq_index == new->tpq_index && mp->tpq == new->tpq && mp->series == new->series ) {
+		if ( new->scale < mp->scale &&
+			( ! mp->better || new->scale < mp->better->scale ) ) {
+		    old = mp->better;
+		    mp->better = new;
+		    new = old;
+		}
+		pthread_mutex_unlock ( &cp->lock );
+		if ( new ) {
+		    pixbuf_put ( new->pixbuf );
+		    maplet_free ( new );
+		}
+		return mp;
+	    }
+	}
+
+	new->next = cp->buckets[b];
+	cp->buckets[b] = new;
+
+	if ( ++cp->count > 2 * cp->nbuckets )
+	    maplet_shard_grow ( cp );
+
+	pthread_mutex_unlock ( &cp->lock );
+
+	ring_add ( new );
+
+	return new;
+}
+
+/* The second tier, compressed JPEG bytes.
+ *
+ * A decoded 24K maplet is about 330K of pixels, but the JPEG it
+ * came from is only 20 to 40K.  So we keep the bytes that
+ * load_tpq_maplet() reads in a cache of their own, with a budget
+ * of its own (jpeg_cache_mb), and when a maplet that got pushed out
+ * of the pixel cache is wanted again we can decode it without going
+ * back to the disk.  On a laptop with a slow disk this is a big deal.
+ *
+ * This is keyed on just the TPQ file and index, the same bytes serve
+ * any series that happens to use that file.  Plain LRU is fine here.
+ *
+ * The loader threads decode straight out of these buffers, so each
+ * entry has a count of users, and an entry that gets evicted while
+ * somebody is still using it is freed by the last one to let go.
+ */
+
+struct jpeg_entry {
+	struct jpeg_entry *next;	/* hash chain */
+	struct jpeg_entry *lru_next;
+	struct jpeg_entry *lru_prev;
+	struct tpq_info *tpq;
+	int index;
+	int users;
+	int cached;			/* still in the table */
+	long size;
+	unsigned char data[1];
+};
+
+#define JPEG_INIT_BUCKETS	1024
+
+static struct jpeg_entry **jpeg_buckets = NULL;
+static int jpeg_nbuckets = 0;
+static int jpeg_count = 0;
+static long jpeg_bytes = 0;
+
+/* most recently used at the head */
+static struct jpeg_entry *jpeg_lru_head = NULL;
+static struct jpeg_entry *jpeg_lru_tail = NULL;
+
+static long jpeg_hits = 0;
+static long jpeg_misses = 0;
+
+static pthread_mutex_t jpeg_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int
+jpeg_bucket ( struct tpq_info *tp, int index )
+{
+	return maplet_hash ( 0, tp->id, index ) & (jpeg_nbuckets - 1);
+}
+
+static void
+jpeg_lru_unlink ( struct jpeg_entry *ep )
 {
-	struct maplet *cp;
+	if ( ep->lru_prev )
+	    ep->lru_prev->lru_next = ep->lru_next;
+	else
+	    jpeg_lru_head = ep->lru_next;
+	if ( ep->lru_next )
+	    ep->lru_next->lru_prev = ep->lru_prev;
+	else
+	    jpeg_lru_tail = ep->lru_prev;
+}
+
+static void
+jpeg_lru_push ( struct jpeg_entry *ep )
+{
+	ep->lru_prev = NULL;
+	ep->lru_next = jpeg_lru_head;
+	if ( jpeg_lru_head )
+	    jpeg_lru_head->lru_prev = ep;
+	else
+	    jpeg_lru_tail = ep;
+	jpeg_lru_head = ep;
+}
+
+static void
+jpeg_grow ( void )
+{
+	struct jpeg_entry **old;
+	struct jpeg_entry *ep, *np;
+	int oldn;
+	int i, b;
+
+	old = jpeg_buckets;
+	oldn = jpeg_nbuckets;
+
+	jpeg_nbuckets = oldn ? oldn * 2 : JPEG_INIT_BUCKETS;
+	jpeg_buckets = (struct jpeg_entry **) gmalloc ( jpeg_nbuckets * sizeof(struct jpeg_entry *) );
+	memset ( jpeg_buckets, 0, jpeg_nbuckets * sizeof(struct jpeg_entry *) );
+
+	for ( i=0; i<oldn; i++ ) {
+	    for ( ep = old[i]; ep; ep = np ) {
+		np = ep->next;
+		b = jpeg_bucket ( ep->tpq, ep->index );
+		ep->next = jpeg_buckets[b];
+		jpeg_buckets[b] = ep;
+	    }
+	}
+
+	if ( old )
+	    free ( (char *) old );
+}
+
+/* Take the least recently used entry out of the table.
+ * Called with jpeg_lock held.
+ */
+static void
+jpeg_evict ( void )
+{
+	struct jpeg_entry *ep;
+	struct jpeg_entry **pp;
+
+	ep = jpeg_lru_tail;
+	jpeg_lru_unlink ( ep );
+
+	for ( pp = &jpeg_buckets[jpeg_bucket(ep->tpq,ep->index)]; *pp; pp = &(*pp)->next ) {
+	    if ( *pp == ep ) {
+		*pp = ep->next;
+		break;
+	    }
+	}
+
+	jpeg_count--;
+	jpeg_bytes -= ep->size;
+	ep->cached = 0;
+
+	if ( ep->users == 0 )
+	    free ( (char *) ep );
+}
+
+/* Look for the bytes for this maplet.
+ * If we have them, the caller gets a pointer to the data and
+ * must call jpeg_cache_release() with the handle when done.
+ */
+void *
+jpeg_cache_get ( struct tpq_info *tp, int index, unsigned char **data, long *size )
+{
+	struct jpeg_entry *ep;
+
+	if ( settings.jpeg_cache_mb <= 0 )
+	    return NULL;
+
+	pthread_mutex_lock ( &jpeg_lock );
+
+	ep = NULL;
+	if ( jpeg_nbuckets ) {
+	    for ( ep = jpeg_buckets[jpeg_bucket(tp,index)]; ep; ep = ep->next )
+		if ( ep->index == index && ep->tpq == tp )
+		    break;
+	}
+
+	if ( ep ) {
+	    ep->users++;
+	    jpeg_lru_unlink ( ep );
+	    jpeg_lru_push ( ep );
+	    jpeg_hits++;
+	    *data = ep->data;
+	    *size = ep->size;
+	} else
+	    jpeg_misses++;
+
+	pthread_mutex_unlock ( &jpeg_lock );
+
+	return (void *) ep;
+}
+
+void
+jpeg_cache_release ( void *handle )
+{
+	struct jpeg_entry *ep = (struct jpeg_entry *) handle;
+
+	pthread_mutex_lock ( &jpeg_lock );
+	if ( --ep->users == 0 && ! ep->cached )
+	    free ( (char *) ep );
+	pthread_mutex_unlock ( &jpeg_lock );
+}
+
+/* Keep a copy of the bytes for this maplet.
+ */
+void
+jpeg_cache_put ( struct tpq_info *tp, int index, unsigned char *data, long size )
+{
+	struct jpeg_entry *ep;
+	struct jpeg_entry *xp;
+	long budget;
+	int b;
+
+	if ( settings.jpeg_cache_mb <= 0 )
+	    return;
+
+	budget = settings.jpeg_cache_mb * 1024L * 1024L;
+	if ( size > budget / 16 )
+	    return;
+
+	/* do the copy before we take the lock */
+	ep = (struct jpeg_entry *) gmalloc ( sizeof(struct jpeg_entry) + size );
+	ep->tpq = tp;
+	ep->index = index;
+	ep->users = 0;
+	ep->cached = 1;
+	ep->size = size;
+	memcpy ( ep->data, data, size );
+
+	pthread_mutex_lock ( &jpeg_lock );
+
+	if ( ! jpeg_nbuckets )
+	    jpeg_grow ();
 
-	for ( cp = head; cp; cp = cp->next ) {
-	    if ( cp->world_y == maplet_y &&
-	    	cp->world_x == maplet_x ) {
-		    return cp;
+	/* Another loader may have just done the same maplet */
+	b = jpeg_bucket ( tp, index );
+	for ( xp = jpeg_buckets[b]; xp; xp = xp->next ) {
+	    if ( xp->index == index && xp->tpq == tp ) {
+		pthread_mutex_unlock ( &jpeg_lock );
+		free ( (char *) ep );
+		return;
 	    }
 	}
-	return ( struct maplet *) NULL;
+
+	while ( jpeg_lru_tail && jpeg_bytes + size > budget )
+	    jpeg_evict ();
+
+	if ( ++jpeg_count > 2 * jpeg_nbuckets )
+	    jpeg_grow ();
+
+	b = jpeg_bucket ( tp, index );
+	ep->next = jpeg_buckets[b];
+	jpeg_buckets[b] = ep;
+	jpeg_lru_push ( ep );
+	jpeg_bytes += size;
+
+	pthread_mutex_unlock ( &jpeg_lock );
+}
+
+void
+jpeg_cache_stats ( void )
+{
+	printf ( "JPEG cache: %d maplets, %ld bytes, %ld hits, %ld misses\n",
+	    jpeg_count, jpeg_bytes, jpeg_hits, jpeg_misses );
+}
+
+/* Throw away everything we have, pixels and JPEG bytes both.
+ * The benchmark (bench.c) uses this to start out cold.
+ */
+void
+maplet_cache_flush ( void )
+{
+	cache_trim ( 0, 1 );
+
+	pthread_mutex_lock ( &jpeg_lock );
+	while ( jpeg_lru_tail )
+	    jpeg_evict ();
+	pthread_mutex_unlock ( &jpeg_lock );
 }
 
 static void
 maplet_cache_dump ( void )
 {
-	struct maplet *cp;
+	struct cache_shard *cp;
+	struct maplet *mp;
+	int i, b;
 
-	for ( cp = info.series->cache; cp; cp = cp->next ) {
-	    printf ( "series %d, x, y = %d %d %s\n",
-		info.series->series, cp->world_x, cp->world_y, cp->tpq_path );
+	for ( i=0; i<CACHE_SHARDS; i++ ) {
+	    cp = &cache_shards[i];
+	    pthread_mutex_lock ( &cp->lock );
+	    for ( b=0; b<cp->nbuckets; b++ ) {
+		for ( mp = cp->buckets[b]; mp; mp = mp->next ) {
+		    if ( mp->series != info.series->series )
+			continue;
+		    printf ( "series %d, x, y = %d %d %s (%d)\n",
+			mp->series, mp->world_x, mp->world_y, mp->tpq_path, mp->tpq_index );
+		}
+	    }
+	    pthread_mutex_unlock ( &cp->lock );
 	}
 }
 
@@ -115,41 +810,50 @@ maplet_cache_dump ( void )
  * Bilinear interpolation looks flawless by the way ...
  */
 static int
-load_maplet_scale ( struct maplet *mp )
+maplet_norm_xdim ( struct tpq_info *tp, int xdim, int ydim )
 {
-	GdkPixbuf *tmp;
 	double pixel_width;
 	int pixel_norm;
-	struct tpq_info *tp;
-
-	if ( ! load_tpq_maplet ( mp ) )
-	    return 0;
-
-	/* get the maplet size */
-	mp->xdim = gdk_pixbuf_get_width ( mp->pixbuf );
-	mp->ydim = gdk_pixbuf_get_height ( mp->pixbuf );
-
-	tp = mp->tpq;
 
 	/* The usual situation here with a 7.5 minute quad is that the
 	 * maplets are 256 tall by 512 wide, before fussing with cos(lat)
 	 */
-	pixel_width = mp->ydim * tp->maplet_long_deg / tp->maplet_lat_deg;
+	pixel_width = ydim * tp->maplet_long_deg / tp->maplet_lat_deg;
 	pixel_width *= cos ( tp->mid_lat * DEGTORAD );
 	pixel_norm = pixel_width;
 
 	if ( settings.verbose & V_SCALE )
-	    printf ( "maplet scale: %d %d --> %d %d\n", mp->xdim, mp->ydim, pixel_norm, mp->ydim );
+	    printf ( "maplet scale: %d %d --> %d %d\n", xdim, ydim, pixel_norm, ydim );
 
-	if ( mp->xdim < pixel_norm - 8 || mp->xdim > pixel_norm + 8 ) {
+	if ( xdim < pixel_norm - 8 || xdim > pixel_norm + 8 ) {
 	    if ( settings.verbose & V_SCALE )
 		printf ( "SCALING\n" );
-	    tmp = mp->pixbuf;
-	    mp->pixbuf = gdk_pixbuf_scale_simple ( tmp, pixel_norm, mp->ydim, GDK_INTERP_BILINEAR );
-	    /* Deprecated 4-2013
-	    gdk_pixbuf_unref ( tmp );
-	    */
-	    g_object_unref ( tmp );
+	    return pixel_norm;
+	}
+
+	return xdim;
+}
+
+/* Load a maplet, and stretch it to the size above */
+static int
+load_maplet_scale ( struct maplet *mp )
+{
+	int xdim;
+
+	/* This gets us the maplet size (xdim, ydim) too */
+	if ( ! load_tpq_maplet ( mp ) )
+	    return 0;
+
+	xdim = maplet_norm_xdim ( mp->tpq, mp->xdim, mp->ydim );
+
+	/* A quick preview gets blown back up to full size here too.
+	 * We used to do this with gdk_pixbuf_scale_simple, but all
+	 * we ever need is a horizontal stretch (and for previews,
+	 * more rows) and resample.c does that a lot faster.
+	 */
+	if ( gdk_pixbuf_get_width ( mp->pixbuf ) != xdim ||
+		gdk_pixbuf_get_height ( mp->pixbuf ) != mp->ydim ) {
+	    mp->pixbuf = resample_maplet ( mp->pixbuf, xdim, mp->ydim, mp->scale > 1 );
 	    mp->xdim = gdk_pixbuf_get_width ( mp->pixbuf );
 	    mp->ydim = gdk_pixbuf_get_height ( mp->pixbuf );
 	}
@@ -157,70 +861,148 @@ load_maplet_scale ( struct maplet *mp )
 	return 1;
 }
 
+/* Figure out where a maplet lives in the current series.
+ * This will set tpq, tpq_path, and tpq_index in the probe structure,
+ * which together with the series is the cache key.
+ * If it is already in the cache, we hand that back, otherwise
+ * we return NULL and the probe is ready for maplet_decode().
+ * If there is no such maplet at all, probe->tpq will be NULL.
+ *
+ * This uses lookup_series() and tpq_lookup(), neither of which
+ * are thread safe, so only the main thread calls this, or else
+ * (the tile server) it is called with archive_lock() held.
+ */
 struct maplet *
-load_maplet ( int maplet_x, int maplet_y )
+maplet_lookup ( int maplet_x, int maplet_y, struct maplet *probe )
 {
     	struct series *sp;
     	struct maplet *mp;
-	int rv;
+	struct tpq_info *tp;
 
 	sp = info.series;
 
-	if ( settings.verbose & V_MAPLET )
-	    printf ( "Load maplet for position %d %d\n", maplet_x, maplet_y );
+	memset ( probe, 0, sizeof(struct maplet) );
+	probe->series = sp->series;
+	probe->scale = 1;
 
-	mp = maplet_cache_lookup ( info.series->cache, maplet_x, maplet_y );
+	/* This is what lookup_series uses */
+	probe->world_x = maplet_x;
+	probe->world_y = maplet_y;
+
+	/* Try to find it in the archive */
+	if ( ! lookup_series ( probe ) )
+	    return NULL;
+
+	tp = tpq_lookup ( probe->tpq_path );
+	if ( ! tp )
+	    return NULL;
+
+	probe->tpq = tp;
+	probe->tpq_path = tp->path;
+
+	mp = maplet_cache_lookup ( sp->series, tp, probe->tpq_index );
 	if ( mp ) {
 	    if ( settings.verbose & V_MAPLET )
 		printf ( "maplet cache hit: %d %d\n", maplet_x, maplet_y );
 	    return mp;
-	} else {
-	    if ( settings.verbose & V_MAPLET ) {
-		printf ( "maplet cache lookup fails for: %d %d\n", maplet_x, maplet_y );
-		maplet_cache_dump ();
-	    }
 	}
 
-	/* Set up a new entry.
-	 */
-	mp = maplet_new ();
-
-	/* This is what lookup_series uses */
-	mp->world_x = maplet_x;
-	mp->world_y = maplet_y;
-
-	if ( settings.verbose & V_MAPLET )
-	    printf ( "Read maplet(cache=%d) = %d %d\n", sp->cache_count,
-		    maplet_x, maplet_y );
+	if ( settings.verbose & V_MAPLET ) {
+	    printf ( "maplet cache lookup fails for: %d %d\n", maplet_x, maplet_y );
+	    maplet_cache_dump ();
+	}
 
-#ifdef TERRA
-	if ( sp->terra ) {
-	    rv = load_terra_maplet ( mp );
-	} else {
-#endif
+	return NULL;
+}
 
-	/* Try to find it in the archive
-	 * This will set tpq_path as well as
-	 * tpq_index in the maplet structure.
-	 */
-	if ( ! lookup_series ( mp ) ) {
+/* Read and decode a maplet set up by maplet_lookup() and put it in the cache.
+ * The argument must be something we can keep (not the probe on the stack),
+ * and we either keep it or free it.
+ * This is what the background loaders call, so it is careful to touch
+ * nothing but the maplet, its TPQ file, and the (locked) cache.
+ */
+struct maplet *
+maplet_decode ( struct maplet *mp )
+{
+	if ( ! load_maplet_scale ( mp ) ) {
 	    maplet_free ( mp );
 	    return NULL;
 	}
-	rv = load_maplet_scale ( mp );
 
-	if ( ! rv ) {
-	    maplet_free ( mp );
-	    return NULL;
-	}
+	return maplet_cache_insert ( mp );
+}
+
+/* Find a maplet in the cache by its key, without going near
+ * the archive.  The background loaders hand us back the key of
+ * what they decoded, since by the time we get to draw it the
+ * maplet itself could have been trimmed out of the cache.
+ */
+struct maplet *
+maplet_find ( int series, struct tpq_info *tp, int index )
+{
+	return maplet_cache_lookup ( series, tp, index );
+}
 
-	mp->next = sp->cache;
-	sp->cache = mp;
-	mp->time = sp->cache_count++;
+/* Make a copy of a probe that maplet_decode() can keep */
+struct maplet *
+maplet_dup ( struct maplet *probe )
+{
+    	struct maplet *mp;
 
+	mp = maplet_new ();
+	*mp = *probe;
 	return mp;
 }
 
+/* Read and decode a maplet right here and now, on the main thread.
+ * If we had a preview of it, the lookup at the end swaps in the
+ * real thing.
+ */
+struct maplet *
+maplet_load_now ( struct maplet *probe )
+{
+	struct maplet *mp;
+
+	maplet_cache_trim ();
+
+	mp = maplet_decode ( maplet_dup ( probe ) );
+	if ( ! mp )
+	    return NULL;
+
+	return maplet_cache_lookup ( mp->series, mp->tpq, mp->tpq_index );
+}
+
+struct maplet *
+load_maplet ( int maplet_x, int maplet_y )
+{
+    	struct maplet *mp;
+	struct maplet probe;
+
+	if ( settings.verbose & V_MAPLET )
+	    printf ( "Load maplet for position %d %d\n", maplet_x, maplet_y );
+
+	mp = maplet_lookup ( maplet_x, maplet_y, &probe );
+	if ( mp )
+	    return mp;
+	if ( ! probe.tpq )
+	    return NULL;
+
+	if ( settings.verbose & V_MAPLET )
+	    printf ( "Read maplet(cache=%d) = %d %d\n", info.series->cache_count,
+		    maplet_x, maplet_y );
+
+	/* The callers (try_position, frame_setup, pixmap_scroll) want
+	 * the center maplet, mostly for its size, and they get here
+	 * every time a drag takes the center into a new maplet.
+	 * Just like frame_maplet, a quick preview will do while dragging,
+	 * the real thing gets drawn once the drag is over.
+	 */
+	if ( vp_info.dragging )
+	    probe.scale = settings.drag_scale;
+
+	return maplet_load_now ( &probe );
+}
+
 /* This is an iterator to crank through all the maplets in a file
  * and feed them one by one to some handler function.
  * NO LONGER USED, method_file() in archive.c does this now!
@@ -319,40 +1101,21 @@ load_maplet ( int maplet_x, int maplet_y )
 #endif
 
 /* This is used when we want to "sniff at" a TPQ file prior to actually loading and
- * displaying maplets from it.  The best thing to do is to load a maplet near
- * the center of the map, at least when we are in file view mode.
+ * displaying maplets from it, to find the size maplets from it get drawn at.
+ * We used to load (and cache) a maplet near the center of the map to find out,
+ * but a look at its JPEG header tells us all we need.
  */
-struct maplet *
-load_maplet_any ( char *path, struct series *sp )
+int
+maplet_pixel_size ( struct tpq_info *tp, int *xdim, int *ydim )
 {
-    	struct maplet *mp;
+	int w, h;
 
-	mp = maplet_new ();
-
-	mp->tpq_path = strhide ( path );
-	mp->tpq_index = -1;
-
-	if ( ! load_maplet_scale ( mp ) ) {
-	    maplet_free ( mp );
-	    return NULL;
-	}
-
-	/* If we are given the series,
-	 * put this on the cache for that series.
-	 * world_x and world_y are set in tpq_io.c
-	 * but only correctly for a FILE method use,
-	 * which at this time is the only way this is called
-	 * when it is asked to do caching.
-	 */
-	if ( sp ) {
-	    mp->next = sp->cur_method->cache;
-	    sp->cur_method->cache = mp;
-	    mp->time = sp->cache_count++;
-	} else {
-	    maplet_free ( mp );
-	}
+	if ( ! tpq_maplet_size ( tp, &w, &h ) )
+	    return 0;
 
-	return mp;
+	*xdim = maplet_norm_xdim ( tp, w, h );
+	*ydim = h;
+	return 1;
 }
 
 /* THE END */
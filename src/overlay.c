@@ -309,23 +309,20 @@ draw_waypoints ( cairo_t *cr )
 	}
 }
 
+/* Draw everything that goes on top of the map, in viewport
+ * coordinates, on whatever cairo context we are handed.
+ * Usually that is the window (overlay_redraw), but the
+ * headless renderer (render.c) hands us an image surface.
+ */
 void
-overlay_redraw ( void )
+overlay_draw ( cairo_t *cr )
 {
-	cairo_t *cr;
-
 	int vxdim, vydim;
 	int x1, y1;
 	double long1, long2;
 	double lat1, lat2;
 	int visible;
 
-	cr = gdk_cairo_create (vp_info.da->window);
-	// printf ( "Overlay redraw, DA =  %08x\n", vp_info.da );
-	// void *zz;
-	// zz = vp_info.da->window;
-	// printf ( "Overlay redraw, DA.window =  %08x\n", zz );
-
 	/* get the viewport size.
 	 * This gets updated elsewhere as it should and is
 	 *  always correct.
@@ -411,6 +408,22 @@ overlay_redraw ( void )
 	// gdk_draw_rectangle ( info.series->pixels, vp_info.da->style->red_gc, TRUE, x1, y1, xw, yw );
 }
 
+void
+overlay_redraw ( void )
+{
+	cairo_t *cr;
+
+	cr = gdk_cairo_create (vp_info.da->window);
+	// printf ( "Overlay redraw, DA =  %08x\n", vp_info.da );
+	// void *zz;
+	// zz = vp_info.da->window;
+	// printf ( "Overlay redraw, DA.window =  %08x\n", zz );
+
+	overlay_draw ( cr );
+
+	cairo_destroy ( cr );
+}
+
 /* just doing a overlay_redraw adds a new marker and keeps the old as well.
  * we have to do a full redraw to clear the slate.
  */
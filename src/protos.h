@@ -28,20 +28,69 @@ void synch_position ( void );
 void set_position ( double, double );
 void redraw_series ( void );
 void full_redraw ( void );
+void scroll_redraw ( void );
 void new_redraw ( void );
+void pixmap_maplet ( struct maplet *, int, int, int );
+void pixmap_maplet_done ( void );
+struct frame *frame_setup ( int *, int *, int *, int * );
+void move_map ( int, int );
+void shift_xy ( double, double );
 
 /* from tpq_io.c */
 int load_tpq_maplet ( struct maplet * );
 struct tpq_info *tpq_lookup ( char * );
+int tpq_maplet_size ( struct tpq_info *, int *, int * );
+int tpq_send_maplet ( struct tpq_info *, int, int );
+void tpq_willneed_maplets ( struct maplet **, int );
+void tpq_dump ( void );
+void tpq_pool_flush ( void );
+void tpq_load_stats ( struct load_stats * );
+
+/* from tpq_cache.c */
+struct stat;
+int tpq_cache_fetch ( struct tpq_info *, struct stat * );
+void tpq_cache_store ( struct tpq_info *, struct stat * );
+void tpq_cache_size ( struct tpq_info * );
+void tpq_cache_save ( void );
 
 /* from maplet.c */
+void maplet_cache_init ( void );
+void maplet_cache_trim ( void );
+void maplet_cache_try_trim ( void );
+void maplet_cache_flush ( void );
+void maplet_hold ( void );
+void maplet_release ( void );
+struct maplet *maplet_lookup ( int, int, struct maplet * );
+struct maplet *maplet_decode ( struct maplet * );
+struct maplet *maplet_find ( int, struct tpq_info *, int );
+void *jpeg_cache_get ( struct tpq_info *, int, unsigned char **, long * );
+void jpeg_cache_release ( void * );
+void jpeg_cache_put ( struct tpq_info *, int, unsigned char *, long );
+void jpeg_cache_stats ( void );
+struct maplet *maplet_dup ( struct maplet * );
+struct maplet *maplet_load_now ( struct maplet * );
 struct maplet *load_maplet ( int, int );
-struct maplet *load_maplet_any ( char *, struct series * );
+int maplet_pixel_size ( struct tpq_info *, int *, int * );
 void state_maplet ( struct method *, mfptr );
 void file_maplets ( struct method *, mfptr );
 
+/* from resample.c */
+void resample_init ( void );
+GdkPixbuf *pixbuf_get ( int, int );
+void pixbuf_put ( GdkPixbuf * );
+GdkPixbuf *resample_maplet ( GdkPixbuf *, int, int, int );
+
+/* from loader.c */
+void loader_init ( void );
+void loader_prefetch ( int, int, int, int );
+int loader_visible ( struct maplet *, int, int, int );
+void loader_start ( void );
+void loader_finish ( void );
+
 /* from archive.c */
 int setup_series ( void );
+void archive_lock ( void );
+void archive_unlock ( void );
 void up_series ( void );
 void down_series ( void );
 void initial_series ( enum s_type s );
@@ -81,9 +130,11 @@ double dms2deg ( int, int, double );
 char * strhide ( char * );
 char * strnhide ( char *, int );
 char * str_lower ( char * );
+unsigned int str_hash ( char * );
 int strcmp_l ( char *, char * );
 int is_directory ( char *path );
 int is_file ( char * );
+int is_big_endian ( void );
 char * find_home ( void );
 double parse_dms ( char * );
 int split_q ( char *, char **, int );
@@ -108,6 +159,7 @@ void xml_test ( void );
 
 /* from overlay.c */
 void overlay_init ( void );
+void overlay_draw ( cairo_t * );
 void overlay_redraw ( void );
 void remote_redraw ( void );
 
@@ -120,4 +172,19 @@ void gpx_tracks_add ( char * );
 void remote_init ( void );
 void remote_check ( void );
 
+/* from render.c */
+void render_setup ( void );
+void render_frame ( cairo_t * );
+int render_map ( char * );
+
+/* from export.c */
+int export_tiles ( char *, char *, char * );
+int tile_make ( int, int, int, unsigned char **, long * );
+
+/* from serve.c */
+int serve_main ( int );
+
+/* from bench.c */
+int bench_run ( char *, int );
+
 /* THE END */
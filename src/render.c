@@ -0,0 +1,238 @@
+/*
+ *  GTopo
+ *
+ *  Copyright (C) 2007, Thomas J. Trebisky
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Street #330, Boston, MA 02111-1307, USA.
+ */
+
+/* render.c -- part of gtopo
+ * Tom Trebisky  MMT Observatory, Tucson, Arizona
+ *
+ * Headless rendering, i.e.
+ *  gtopo --render --series 24K --center -110.846,31.700 --size 640x800 --out map.png
+ *
+ * This gives a PNG file with what the GUI would show in a window of
+ * that size, centered there, without needing an X display at all.
+ * People batch render hundreds of these, and scripting the GUI to
+ * do that (and the "s" key snapshot) is no fun.
+ *
+ * The GUI draws into a GdkPixmap, which lives in the X server and
+ * does not exist until the window gets configured.  Here we use a
+ * cairo image surface instead, which is just memory.  The layout of
+ * the maplets comes from frame_setup() in gtopo.c, the same code the
+ * GUI uses, so the two cannot drift apart.  What is different is that
+ * we have no loader threads and no idle callbacks, we just read and
+ * decode whatever we need right here and then we are done.
+ * The overlays (tracks, waypoints) and the center marker get drawn
+ * on top, just as they do on the screen.
+ */
+
+#include <gtk/gtk.h>
+#include <glib/gstdio.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "gtopo.h"
+#include "protos.h"
+
+extern struct topo_info info;
+extern struct settings settings;
+extern struct viewport vp_info;
+
+/* Get a maplet, whatever it takes.
+ * This is frame_maplet() without the loader threads,
+ * and we won't settle for a preview.
+ */
+static struct maplet *
+render_maplet ( struct frame *fp, int x, int y )
+{
+	struct maplet *mp;
+	struct maplet probe;
+
+	if ( info.series->terra )
+	    mp = maplet_lookup ( fp->ref_x - x, fp->ref_y + y, &probe );
+	else
+	    mp = maplet_lookup ( fp->ref_x + x, fp->ref_y + y, &probe );
+
+	if ( ( ! mp || mp->scale > 1 ) && probe.tpq )
+	    mp = maplet_load_now ( &probe );
+
+	return mp;
+}
+
+/* Same as pixmap_grid() in gtopo.c.
+ * The half pixel puts a one pixel wide cairo line
+ * right on the pixels gdk_draw_line would use.
+ */
+static void
+render_grid ( cairo_t *cr, struct frame *fp )
+{
+	int x, y;
+	int xx, yy;
+
+	cairo_set_source_rgb ( cr, 0, 0, 0 );
+	cairo_set_line_width ( cr, 1.0 );
+
+	for ( x = fp->nx1+1; x <= fp->nx2; x++ ) {
+	    xx = fp->origx - fp->px * x;
+	    cairo_move_to ( cr, xx + 0.5, 0 );
+	    cairo_line_to ( cr, xx + 0.5, vp_info.vy );
+	}
+	for ( y = fp->ny1+1; y <= fp->ny2; y++ ) {
+	    yy = fp->origy - fp->py * y;
+	    cairo_move_to ( cr, 0, yy + 0.5 );
+	    cairo_line_to ( cr, vp_info.vx, yy + 0.5 );
+	}
+	cairo_stroke ( cr );
+}
+
+static void
+render_line ( cairo_t *cr, int x1, int y1, int x2, int y2 )
+{
+	cairo_move_to ( cr, x1 + 0.5, y1 + 0.5 );
+	cairo_line_to ( cr, x2 + 0.5, y2 + 0.5 );
+	cairo_stroke ( cr );
+}
+
+/* The center marker, as cursor_show() draws it
+ * right after an expose (a white cross with a black dot).
+ */
+static void
+render_marker ( cairo_t *cr )
+{
+	int size;
+
+	if ( ! settings.center_marker )
+	    return;
+
+	size = settings.marker_size;
+
+	cairo_set_line_width ( cr, 1.0 );
+
+	cairo_set_source_rgb ( cr, 1, 1, 1 );
+	render_line ( cr, vp_info.vxcent, vp_info.vycent-size, vp_info.vxcent, vp_info.vycent+size );
+	render_line ( cr, vp_info.vxcent-size, vp_info.vycent, vp_info.vxcent+size, vp_info.vycent );
+
+	cairo_set_source_rgb ( cr, 0, 0, 0 );
+	render_line ( cr, vp_info.vxcent, vp_info.vycent-1, vp_info.vxcent, vp_info.vycent+1 );
+	render_line ( cr, vp_info.vxcent-1, vp_info.vycent, vp_info.vxcent+1, vp_info.vycent );
+}
+
+/* Set up the viewport from settings.x_view and settings.y_view.
+ * Our buffer stands in for a pixmap with no margins, whatever
+ * series we end up in.
+ */
+void
+render_setup ( void )
+{
+	struct series *sp;
+	int i;
+
+	vp_info.vx = settings.x_view;
+	vp_info.vy = settings.y_view;
+	vp_info.vxcent = vp_info.vx / 2;
+	vp_info.vycent = vp_info.vy / 2;
+	vp_info.dragging = 0;
+
+	for ( i=0; i<N_SERIES; i++ ) {
+	    sp = &info.series_info[i];
+	    sp->margin_x = sp->margin_y = 0;
+	    sp->view_x = sp->view_y = 0;
+	    sp->pix_w = vp_info.vx;
+	    sp->pix_h = vp_info.vy;
+	}
+}
+
+/* Draw the maps for the current series and position,
+ * this is pixmap_redraw() for a cairo surface.
+ */
+void
+render_frame ( cairo_t *cr )
+{
+	struct frame *fp;
+	struct maplet *mp;
+	int nx1, nx2, ny1, ny2;
+	int x, y;
+	int mx, my;
+
+	cairo_set_source_rgb ( cr, 1, 1, 1 );
+	cairo_paint ( cr );
+
+	fp = frame_setup ( &nx1, &nx2, &ny1, &ny2 );
+
+	for ( y = ny1; y <= ny2; y++ ) {
+	    for ( x = nx1; x <= nx2; x++ ) {
+		mp = render_maplet ( fp, x, y );
+		if ( ! mp ) {
+		    if ( settings.verbose & V_DRAW2 )
+			printf ( "render, no maplet at %d %d\n", x, y );
+		    continue;
+		}
+
+		mx = fp->origx - mp->xdim * x;
+		my = fp->origy - mp->ydim * y;
+
+		gdk_cairo_set_source_pixbuf ( cr, mp->pixbuf, mx, my );
+		cairo_rectangle ( cr, mx, my, mp->xdim, mp->ydim );
+		cairo_fill ( cr );
+	    }
+	}
+
+	if ( settings.show_maplets )
+	    render_grid ( cr, fp );
+}
+
+/* Render the current series and position (as set up by first_series)
+ * into a viewport of settings.x_view by settings.y_view and write it
+ * to a PNG file.  Returns a status for exit().
+ */
+int
+render_map ( char *path )
+{
+	cairo_surface_t *surface;
+	cairo_t *cr;
+	cairo_status_t status;
+
+	render_setup ();
+
+	surface = cairo_image_surface_create ( CAIRO_FORMAT_RGB24, vp_info.vx, vp_info.vy );
+	cr = cairo_create ( surface );
+
+	render_frame ( cr );
+
+	overlay_draw ( cr );
+	render_marker ( cr );
+
+	cairo_destroy ( cr );
+
+	status = cairo_surface_write_to_png ( surface, path );
+	cairo_surface_destroy ( surface );
+
+	if ( status != CAIRO_STATUS_SUCCESS ) {
+	    printf ( "Cannot write %s: %s\n", path, cairo_status_to_string ( status ) );
+	    return 1;
+	}
+
+	if ( settings.verbose & V_BASIC )
+	    printf ( "Rendered %d by %d at %.4f, %.4f (%s) to %s\n",
+		vp_info.vx, vp_info.vy, info.long_deg, info.lat_deg,
+		wonk_series ( info.series->series ), path );
+
+	return 0;
+}
+
+/* THE END */
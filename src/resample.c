@@ -0,0 +1,518 @@
+/*
+ *  GTopo
+ *
+ *  Copyright (C) 2007, Thomas J. Trebisky
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Street #330, Boston, MA 02111-1307, USA.
+ */
+
+/* resample.c -- part of gtopo
+ * Tom Trebisky  MMT Observatory, Tucson, Arizona
+ *
+ * Stretching maplets to get square pixels.
+ *
+ * Many TPQ files have maplets that are (say) 330 pixels wide when
+ * they ought to be 435 to give square pixels on the ground, and we
+ * used to fix that with gdk_pixbuf_scale_simple().  That is a general
+ * purpose 2D filter, and allocates a fresh pixbuf every time,
+ * for what is only ever a horizontal stretch.
+ *
+ * Here we do just the horizontal part, with a table of filter taps
+ * for each (source width, output width) pair.  Every maplet in a TPQ
+ * file has the same mid_lat and so the same widths, so the whole sheet
+ * (and typically the whole series) shares one table.  The taps are
+ * a tent filter, which is plain bilinear interpolation when stretching
+ * and averages over the pixels we skip when shrinking.
+ *
+ * The inner loop has SSE2 and AVX2 versions, picked at startup.
+ * Vertically we only ever replicate rows, which is what a quick
+ * preview from jpeg_decode needs to get back to full size.
+ *
+ * We also keep a pool of pixbufs here, so that decoding and stretching
+ * maplets does not keep going back to malloc for 300K at a time.
+ */
+
+#include <gtk/gtk.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+
+#if defined(__SSE2__)
+#define RESAMPLE_X86
+#include <immintrin.h>
+#endif
+
+#include "gtopo.h"
+#include "protos.h"
+
+extern struct settings settings;
+
+/* weights are fixed point, they add up to this */
+#define TAP_SHIFT	14
+#define TAP_ONE		(1<<TAP_SHIFT)
+
+/* One table of taps.
+ * For output pixel x we look at source pixels start[x] through
+ * start[x] + ntaps - 1, with weights weight[x*ntaps] and on.
+ * ntaps is always even, the SIMD code takes them in pairs.
+ */
+struct taps {
+	struct taps *next;
+	int src_w;
+	int dst_w;
+	int ntaps;
+	int *start;
+	short *weight;
+	/* output pixels before this one are safe for the
+	 * SIMD code, which reads a byte past each pixel
+	 */
+	int simd_end;
+};
+
+static struct taps *taps_head = NULL;
+static pthread_mutex_t taps_lock = PTHREAD_MUTEX_INITIALIZER;
+
+typedef void (*rowfptr) ( guchar *, guchar *, struct taps * );
+
+static void
+taps_build ( struct taps *tp )
+{
+	double ratio;
+	double support;
+	double center;
+	double w[64];
+	double sum;
+	int itotal, big;
+	int start;
+	int x, k;
+	int n;
+
+	ratio = (double) tp->src_w / (double) tp->dst_w;
+	support = ratio > 1.0 ? ratio : 1.0;
+
+	n = (int) ceil ( 2.0 * support );
+	if ( n & 1 )
+	    n++;
+	if ( n > 64 )
+	    n = 64;
+	tp->ntaps = n;
+
+	tp->start = (int *) gmalloc ( tp->dst_w * sizeof(int) );
+	tp->weight = (short *) gmalloc ( tp->dst_w * n * sizeof(short) );
+	tp->simd_end = 0;
+
+	for ( x = 0; x < tp->dst_w; x++ ) {
+	    center = (x + 0.5) * ratio - 0.5;
+	    if ( center < 0.0 )
+		center = 0.0;
+	    if ( center > tp->src_w - 1 )
+		center = tp->src_w - 1;
+
+	    start = (int) floor ( center - support ) + 1;
+	    if ( start > tp->src_w - n )
+		start = tp->src_w - n;
+	    if ( start < 0 )
+		start = 0;
+
+	    sum = 0.0;
+	    for ( k = 0; k < n; k++ ) {
+		w[k] = 1.0 - fabs ( start + k - center ) / support;
+		if ( w[k] < 0.0 || start + k >= tp->src_w )
+		    w[k] = 0.0;
+		sum += w[k];
+	    }
+
+	    /* make the fixed point weights add up exactly */
+	    itotal = 0;
+	    big = 0;
+	    for ( k = 0; k < n; k++ ) {
+		tp->weight[x*n+k] = (short) floor ( TAP_ONE * w[k] / sum + 0.5 );
+		itotal += tp->weight[x*n+k];
+		if ( w[k] > w[big] )
+		    big = k;
+	    }
+	    tp->weight[x*n+big] += TAP_ONE - itotal;
+
+	    tp->start[x] = start;
+	    if ( start + n < tp->src_w && x + 1 < tp->dst_w )
+		tp->simd_end = x + 1;
+	}
+}
+
+/* Find (or make) the taps for this pair of widths */
+static struct taps *
+taps_lookup ( int src_w, int dst_w )
+{
+	struct taps *tp;
+
+	pthread_mutex_lock ( &taps_lock );
+	for ( tp = taps_head; tp; tp = tp->next )
+	    if ( tp->src_w == src_w && tp->dst_w == dst_w )
+		break;
+
+	if ( ! tp ) {
+	    tp = (struct taps *) gmalloc ( sizeof(struct taps) );
+	    tp->src_w = src_w;
+	    tp->dst_w = dst_w;
+	    taps_build ( tp );
+	    tp->next = taps_head;
+	    taps_head = tp;
+
+	    if ( settings.verbose & V_SCALE )
+		printf ( "resample taps %d --> %d, %d taps\n", src_w, dst_w, tp->ntaps );
+	}
+	pthread_mutex_unlock ( &taps_lock );
+
+	return tp;
+}
+
+/* One output pixel, the plain C way */
+static inline void
+pixel_c ( guchar *src, guchar *dst, struct taps *tp, int x )
+{
+	guchar *sp;
+	short *wp;
+	int r, g, b;
+	int k;
+
+	sp = src + 3 * tp->start[x];
+	wp = &tp->weight[x * tp->ntaps];
+	r = g = b = TAP_ONE / 2;
+
+	for ( k = 0; k < tp->ntaps; k++ ) {
+	    r += wp[k] * sp[0];
+	    g += wp[k] * sp[1];
+	    b += wp[k] * sp[2];
+	    sp += 3;
+	}
+
+	r >>= TAP_SHIFT;
+	g >>= TAP_SHIFT;
+	b >>= TAP_SHIFT;
+
+	/* a tent filter never overshoots, but just in case */
+	dst[0] = r < 0 ? 0 : ( r > 255 ? 255 : r );
+	dst[1] = g < 0 ? 0 : ( g > 255 ? 255 : g );
+	dst[2] = b < 0 ? 0 : ( b > 255 ? 255 : b );
+}
+
+static void
+row_c ( guchar *src, guchar *dst, struct taps *tp )
+{
+	int x;
+
+	for ( x = 0; x < tp->dst_w; x++ )
+	    pixel_c ( src, dst + 3*x, tp, x );
+}
+
+#ifdef RESAMPLE_X86
+
+/* Two source pixels, interleaved and widened to
+ *  r0 r1 g0 g1 b0 b1 x0 x1
+ * ready to go into pmaddwd with a pair of weights.
+ * This reads 4 bytes at each pixel (one more than we need).
+ */
+static inline __m128i
+pixel_pair ( guchar *sp )
+{
+	__m128i a, b;
+	int ia, ib;
+
+	memcpy ( &ia, sp, 4 );
+	memcpy ( &ib, sp + 3, 4 );
+	a = _mm_cvtsi32_si128 ( ia );
+	b = _mm_cvtsi32_si128 ( ib );
+	return _mm_unpacklo_epi8 ( _mm_unpacklo_epi8 ( a, b ), _mm_setzero_si128 () );
+}
+
+static inline int
+weight_pair ( short *wp )
+{
+	return (wp[1] << 16) | (wp[0] & 0xffff);
+}
+
+/* Store r, g, b out of a 32 bit lane per channel.
+ * We write 4 bytes, the extra one gets overwritten by the next pixel.
+ */
+static inline void
+pixel_store ( guchar *dst, __m128i acc )
+{
+	int v;
+
+	acc = _mm_srai_epi32 ( acc, TAP_SHIFT );
+	acc = _mm_packs_epi32 ( acc, acc );
+	acc = _mm_packus_epi16 ( acc, acc );
+	v = _mm_cvtsi128_si32 ( acc );
+	memcpy ( dst, &v, 4 );
+}
+
+static void
+row_sse2 ( guchar *src, guchar *dst, struct taps *tp )
+{
+	__m128i acc;
+	__m128i round;
+	guchar *sp;
+	short *wp;
+	int x, k;
+
+	round = _mm_set1_epi32 ( TAP_ONE / 2 );
+
+	for ( x = 0; x < tp->simd_end; x++ ) {
+	    sp = src + 3 * tp->start[x];
+	    wp = &tp->weight[x * tp->ntaps];
+	    acc = round;
+	    for ( k = 0; k < tp->ntaps; k += 2 ) {
+		acc = _mm_add_epi32 ( acc,
+		    _mm_madd_epi16 ( pixel_pair ( sp ), _mm_set1_epi32 ( weight_pair ( wp ) ) ) );
+		sp += 6;
+		wp += 2;
+	    }
+	    pixel_store ( dst + 3*x, acc );
+	}
+
+	for ( ; x < tp->dst_w; x++ )
+	    pixel_c ( src, dst + 3*x, tp, x );
+}
+
+/* Same thing, two output pixels at a time, one in each half */
+static void __attribute__ ((target ("avx2")))
+row_avx2 ( guchar *src, guchar *dst, struct taps *tp )
+{
+	__m256i acc;
+	__m256i round;
+	__m256i pix, wgt;
+	guchar *sp0, *sp1;
+	short *wp0, *wp1;
+	int x, k;
+
+	round = _mm256_set1_epi32 ( TAP_ONE / 2 );
+
+	for ( x = 0; x + 1 < tp->simd_end; x += 2 ) {
+	    sp0 = src + 3 * tp->start[x];
+	    sp1 = src + 3 * tp->start[x+1];
+	    wp0 = &tp->weight[x * tp->ntaps];
+	    wp1 = wp0 + tp->ntaps;
+	    acc = round;
+	    for ( k = 0; k < tp->ntaps; k += 2 ) {
+		pix = _mm256_inserti128_si256 ( _mm256_castsi128_si256 ( pixel_pair ( sp0 ) ),
+			pixel_pair ( sp1 ), 1 );
+		wgt = _mm256_inserti128_si256 ( _mm256_castsi128_si256 ( _mm_set1_epi32 ( weight_pair ( wp0 ) ) ),
+			_mm_set1_epi32 ( weight_pair ( wp1 ) ), 1 );
+		acc = _mm256_add_epi32 ( acc, _mm256_madd_epi16 ( pix, wgt ) );
+		sp0 += 6;
+		sp1 += 6;
+		wp0 += 2;
+		wp1 += 2;
+	    }
+	    pixel_store ( dst + 3*x, _mm256_castsi256_si128 ( acc ) );
+	    pixel_store ( dst + 3*x + 3, _mm256_extracti128_si256 ( acc, 1 ) );
+	}
+
+	for ( ; x < tp->dst_w; x++ )
+	    pixel_c ( src, dst + 3*x, tp, x );
+}
+#endif
+
+#ifdef RESAMPLE_X86
+static rowfptr resample_row = row_sse2;
+#else
+static rowfptr resample_row = row_c;
+#endif
+
+/* Pick the fastest row function this processor can run.
+ */
+void
+resample_init ( void )
+{
+	char *name = "C";
+
+#ifdef RESAMPLE_X86
+	name = "SSE2";
+	__builtin_cpu_init ();
+	if ( __builtin_cpu_supports ( "avx2" ) ) {
+	    resample_row = row_avx2;
+	    name = "AVX2";
+	}
+#endif
+
+	if ( settings.verbose & V_SCALE )
+	    printf ( "Resampling maplets with %s code\n", name );
+}
+
+/* The pixbuf pool.
+ * Maplets in the cache come and go, but they are almost all
+ * the same size, so when one gets thrown out we hang onto its
+ * pixbuf and hand it out for the next one.
+ * Switch to a series with a different maplet size though, and
+ * what we have is no use, so the pool is kept oldest first and
+ * the oldest go when it gets too full (by count or by bytes).
+ * We only pool pixbufs that came from pixbuf_get, and those
+ * only ever belong to one maplet.
+ */
+#define POOL_MAX	64
+#define POOL_BYTES	(8 * 1024 * 1024)
+
+#define POOL_TAG	"gtopo-pool"
+
+static GdkPixbuf *pool[POOL_MAX];
+static int pool_count = 0;
+static long pool_bytes = 0;
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static long
+pixbuf_bytes ( GdkPixbuf *pb )
+{
+	return (long) gdk_pixbuf_get_rowstride ( pb ) * gdk_pixbuf_get_height ( pb );
+}
+
+/* Take entry i out of the pool, keeping the order.
+ * Call with pool_lock held.
+ */
+static GdkPixbuf *
+pool_take ( int i )
+{
+	GdkPixbuf *pb;
+
+	pb = pool[i];
+	pool_count--;
+	memmove ( &pool[i], &pool[i+1], (pool_count - i) * sizeof(GdkPixbuf *) );
+	pool_bytes -= pixbuf_bytes ( pb );
+
+	return pb;
+}
+
+/* Get an RGB pixbuf, the contents are whatever was left in it */
+GdkPixbuf *
+pixbuf_get ( int w, int h )
+{
+	GdkPixbuf *pb;
+	int i;
+
+	pthread_mutex_lock ( &pool_lock );
+	for ( i = pool_count - 1; i >= 0; i-- ) {
+	    pb = pool[i];
+	    if ( gdk_pixbuf_get_width ( pb ) == w && gdk_pixbuf_get_height ( pb ) == h ) {
+		pb = pool_take ( i );
+		pthread_mutex_unlock ( &pool_lock );
+		return pb;
+	    }
+	}
+	pthread_mutex_unlock ( &pool_lock );
+
+	pb = gdk_pixbuf_new ( GDK_COLORSPACE_RGB, FALSE, 8, w, h );
+	if ( pb )
+	    g_object_set_data ( G_OBJECT(pb), POOL_TAG, pool );
+	return pb;
+}
+
+/* Done with a pixbuf, use this rather than g_object_unref.
+ * Anything that did not come from pixbuf_get just gets unref'd.
+ */
+void
+pixbuf_put ( GdkPixbuf *pb )
+{
+	GdkPixbuf *old[POOL_MAX];
+	long size;
+	int n_old;
+	int i;
+
+	if ( ! pb )
+	    return;
+
+	if ( g_object_get_data ( G_OBJECT(pb), POOL_TAG ) != pool ) {
+	    g_object_unref ( pb );
+	    return;
+	}
+
+	size = pixbuf_bytes ( pb );
+	if ( size > POOL_BYTES ) {
+	    g_object_unref ( pb );
+	    return;
+	}
+
+	/* make room, oldest first */
+	n_old = 0;
+	pthread_mutex_lock ( &pool_lock );
+	while ( pool_count >= POOL_MAX || pool_bytes + size > POOL_BYTES )
+	    old[n_old++] = pool_take ( 0 );
+	pool[pool_count++] = pb;
+	pool_bytes += size;
+	pthread_mutex_unlock ( &pool_lock );
+
+	for ( i=0; i<n_old; i++ )
+	    g_object_unref ( old[i] );
+}
+
+/* Stretch a maplet to dst_w by dst_h.
+ * The width can go either way, the height only ever grows
+ * (by whole rows, for previews).  We hand back a pixbuf from
+ * the pool, and the source goes back to the pool.
+ * Anything with an alpha channel goes the old way.
+ */
+GdkPixbuf *
+resample_maplet ( GdkPixbuf *src, int dst_w, int dst_h, int fast )
+{
+	GdkPixbuf *dst;
+	struct taps *tp;
+	guchar *sp, *dp;
+	int src_w, src_h;
+	int sstride, dstride;
+	int y, sy, last_sy;
+
+	src_w = gdk_pixbuf_get_width ( src );
+	src_h = gdk_pixbuf_get_height ( src );
+
+	if ( gdk_pixbuf_get_n_channels ( src ) != 3 || gdk_pixbuf_get_has_alpha ( src ) ||
+		src_w < 2 || dst_h < src_h ) {
+	    dst = gdk_pixbuf_scale_simple ( src, dst_w, dst_h,
+		fast ? GDK_INTERP_NEAREST : GDK_INTERP_BILINEAR );
+	    g_object_unref ( src );
+	    return dst;
+	}
+
+	/* A preview may only need more rows */
+	tp = NULL;
+	if ( src_w != dst_w )
+	    tp = taps_lookup ( src_w, dst_w );
+
+	dst = pixbuf_get ( dst_w, dst_h );
+	if ( ! dst )
+	    return src;
+
+	sp = gdk_pixbuf_get_pixels ( src );
+	dp = gdk_pixbuf_get_pixels ( dst );
+	sstride = gdk_pixbuf_get_rowstride ( src );
+	dstride = gdk_pixbuf_get_rowstride ( dst );
+
+	last_sy = -1;
+	for ( y = 0; y < dst_h; y++ ) {
+	    sy = y * src_h / dst_h;
+	    if ( sy == last_sy )
+		memcpy ( dp + y * dstride, dp + (y-1) * dstride, 3 * dst_w );
+	    else if ( ! tp )
+		memcpy ( dp + y * dstride, sp + sy * sstride, 3 * dst_w );
+	    else
+		(*resample_row) ( sp + sy * sstride, dp + y * dstride, tp );
+	    last_sy = sy;
+	}
+
+	pixbuf_put ( src );
+
+	return dst;
+}
+
+/* THE END */
@@ -0,0 +1,785 @@
+/*
+ *  GTopo
+ *
+ *  Copyright (C) 2007, Thomas J. Trebisky
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Street #330, Boston, MA 02111-1307, USA.
+ */
+
+/* serve.c -- part of gtopo
+ * Tom Trebisky  MMT Observatory, Tucson, Arizona
+ *
+ * A little HTTP tile server, i.e.
+ *  gtopo --serve 8080
+ *
+ * so that a bunch of browsers (or tablets) on the LAN can share
+ * one machine with the map archive on it.  We hand out two things:
+ *
+ *  /{series}/{world_x}/{world_y}.jpg
+ *	A maplet, exactly as it is in the TPQ file.  The series is
+ *	a name like 24k or 100k, world_x and world_y are the maplet
+ *	indices maplet_lookup() uses (x counts to the west).
+ *	The bytes go straight from the file to the socket.
+ *	Only series laid out in sections work here, world_x and
+ *	world_y mean nothing for single file series (STATE, ATLAS,
+ *	or anything added with -f), so those get a 404.
+ *
+ *  /{z}/{x}/{y}.png
+ *	A 256 pixel web mercator tile, the same as --export makes,
+ *	so a Leaflet or OpenLayers page can use us as a tile layer.
+ *	These take some work, so we keep the PNG in a cache
+ *	(tile_cache_mb) in case somebody else wants it.
+ *
+ * This is the same idea as the listener in remote.c, but that one
+ * handles one connection at a time.  Here the main thread just
+ * accepts connections and queues them, and a pool of threads
+ * (loader_threads of them, or one per core) does the work.
+ * Connections are kept alive (browsers like that) until they are
+ * idle for a few seconds.  A browser opens half a dozen of them and
+ * mostly lets them sit, so an idle connection does not get to tie
+ * up a thread.  Once a thread has answered everything a client sent,
+ * it hands the connection back to the main thread, which polls all
+ * the idle ones along with the listening socket and queues one up
+ * again only when there is a request to read.
+ *
+ * Lookups in the archive are not thread safe, so those take turns
+ * with archive_lock().  Decoding and compositing go on in parallel,
+ * with maplet_hold() keeping the maplets we are using in the cache.
+ */
+
+#include <gtk/gtk.h>
+#include <glib/gstdio.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "gtopo.h"
+#include "protos.h"
+
+extern struct topo_info info;
+extern struct settings settings;
+
+#define MAX_SERVERS	64
+#define CONN_QUEUE	256
+#define REQ_SIZE	4096
+#define IDLE_SECS	5
+#define MAX_IDLE	1024
+
+/* ---------------------------------------------------- */
+
+/* The cache of mosaic tiles.
+ * This is much like the JPEG cache in maplet.c, plain LRU, and an entry
+ * that gets evicted while somebody is still sending it is freed by the
+ * last one to let go.
+ */
+struct tile_entry {
+	struct tile_entry *next;	/* hash chain */
+	struct tile_entry *lru_next;
+	struct tile_entry *lru_prev;
+	int z;
+	int x;
+	int y;
+	unsigned char *png;
+	long size;
+	int users;
+	int dead;
+};
+
+static struct tile_entry **tile_hash;
+static int tile_buckets;
+static struct tile_entry *tile_lru_head = NULL;	/* most recently used */
+static struct tile_entry *tile_lru_tail = NULL;
+static long tile_bytes = 0;
+
+static pthread_mutex_t tile_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void
+tile_cache_init ( void )
+{
+	int n;
+
+	/* roughly one bucket per 64K of budget */
+	n = 64;
+	while ( n < settings.tile_cache_mb * 16 )
+	    n *= 2;
+
+	tile_buckets = n;
+	tile_hash = (struct tile_entry **) gmalloc ( n * sizeof(struct tile_entry *) );
+	memset ( tile_hash, 0, n * sizeof(struct tile_entry *) );
+}
+
+static int
+tile_bucket ( int z, int x, int y )
+{
+	unsigned int h;
+
+	h = z * 0x9e3779b1u;
+	h ^= x * 0x85ebca6bu;
+	h ^= y * 0xc2b2ae35u;
+	h ^= h >> 15;
+
+	return h & (tile_buckets - 1);
+}
+
+static void
+tile_lru_unlink ( struct tile_entry *ep )
+{
+	if ( ep->lru_prev )
+	    ep->lru_prev->lru_next = ep->lru_next;
+	else
+	    tile_lru_head = ep->lru_next;
+
+	if ( ep->lru_next )
+	    ep->lru_next->lru_prev = ep->lru_prev;
+	else
+	    tile_lru_tail = ep->lru_prev;
+}
+
+static void
+tile_lru_push ( struct tile_entry *ep )
+{
+	ep->lru_prev = NULL;
+	ep->lru_next = tile_lru_head;
+	if ( tile_lru_head )
+	    tile_lru_head->lru_prev = ep;
+	tile_lru_head = ep;
+	if ( ! tile_lru_tail )
+	    tile_lru_tail = ep;
+}
+
+static void
+tile_entry_free ( struct tile_entry *ep )
+{
+	free ( (char *) ep->png );
+	free ( (char *) ep );
+}
+
+/* Called with the lock held */
+static void
+tile_evict ( void )
+{
+	struct tile_entry *ep;
+	struct tile_entry **pp;
+	long budget;
+
+	budget = settings.tile_cache_mb * 1024L * 1024L;
+
+	while ( tile_bytes > budget && tile_lru_tail ) {
+	    ep = tile_lru_tail;
+	    tile_lru_unlink ( ep );
+
+	    for ( pp = &tile_hash[tile_bucket(ep->z,ep->x,ep->y)]; *pp; pp = &(*pp)->next ) {
+		if ( *pp == ep ) {
+		    *pp = ep->next;
+		    break;
+		}
+	    }
+	    tile_bytes -= ep->size;
+
+	    if ( ep->users )
+		ep->dead = 1;
+	    else
+		tile_entry_free ( ep );
+	}
+}
+
+/* Every successful get (or put) must be matched with a release */
+static struct tile_entry *
+tile_cache_get ( int z, int x, int y )
+{
+	struct tile_entry *ep;
+
+	pthread_mutex_lock ( &tile_lock );
+	for ( ep = tile_hash[tile_bucket(z,x,y)]; ep; ep = ep->next ) {
+	    if ( ep->z == z && ep->x == x && ep->y == y ) {
+		tile_lru_unlink ( ep );
+		tile_lru_push ( ep );
+		ep->users++;
+		break;
+	    }
+	}
+	pthread_mutex_unlock ( &tile_lock );
+
+	return ep;
+}
+
+/* We keep the png.  If somebody else made this same
+ * tile while we were at it, we toss ours and use theirs.
+ */
+static struct tile_entry *
+tile_cache_put ( int z, int x, int y, unsigned char *png, long size )
+{
+	struct tile_entry *ep;
+	int b;
+
+	b = tile_bucket ( z, x, y );
+
+	pthread_mutex_lock ( &tile_lock );
+	for ( ep = tile_hash[b]; ep; ep = ep->next ) {
+	    if ( ep->z == z && ep->x == x && ep->y == y ) {
+		ep->users++;
+		pthread_mutex_unlock ( &tile_lock );
+		free ( (char *) png );
+		return ep;
+	    }
+	}
+
+	ep = (struct tile_entry *) gmalloc ( sizeof(struct tile_entry) );
+	ep->z = z;
+	ep->x = x;
+	ep->y = y;
+	ep->png = png;
+	ep->size = size;
+	ep->users = 1;
+	ep->dead = 0;
+
+	ep->next = tile_hash[b];
+	tile_hash[b] = ep;
+	tile_lru_push ( ep );
+	tile_bytes += size;
+
+	tile_evict ();
+	pthread_mutex_unlock ( &tile_lock );
+
+	return ep;
+}
+
+static void
+tile_cache_release ( struct tile_entry *ep )
+{
+	int gone;
+
+	pthread_mutex_lock ( &tile_lock );
+	ep->users--;
+	gone = ep->dead && ! ep->users;
+	pthread_mutex_unlock ( &tile_lock );
+
+	if ( gone )
+	    tile_entry_free ( ep );
+}
+
+/* ---------------------------------------------------- */
+
+/* HTTP replies */
+
+static int
+send_all ( int fd, char *buf, long n )
+{
+	long nw;
+
+	while ( n > 0 ) {
+	    nw = send ( fd, buf, n, MSG_NOSIGNAL );
+	    if ( nw <= 0 )
+		return 0;
+	    buf += nw;
+	    n -= nw;
+	}
+	return 1;
+}
+
+static int
+send_header ( int fd, int code, char *reason, char *type, long size, int keep )
+{
+	char buf[512];
+	int n;
+
+	n = snprintf ( buf, sizeof(buf),
+	    "HTTP/1.1 %d %s\r\n"
+	    "Server: gtopo\r\n"
+	    "Content-Type: %s\r\n"
+	    "Content-Length: %ld\r\n"
+	    "Access-Control-Allow-Origin: *\r\n"
+	    "%s"
+	    "Connection: %s\r\n"
+	    "\r\n",
+	    code, reason, type, size,
+	    code == 200 ? "Cache-Control: max-age=86400\r\n" : "",
+	    keep ? "keep-alive" : "close" );
+
+	return send_all ( fd, buf, n );
+}
+
+static int
+send_text ( int fd, int code, char *reason, char *text, int keep )
+{
+	if ( ! send_header ( fd, code, reason, "text/plain", strlen(text), keep ) )
+	    return 0;
+	return send_all ( fd, text, strlen(text) );
+}
+
+static char index_text[] =
+    "gtopo tile server\n"
+    "\n"
+    "/{z}/{x}/{y}.png\n"
+    "    256 pixel web mercator tiles\n"
+    "/{series}/{world_x}/{world_y}.jpg\n"
+    "    maplets straight from the archive (series is 24k, 100k, ...)\n";
+
+/* ---------------------------------------------------- */
+
+/* Does this series have any single file methods?
+ * For those lookup_series() goes by whatever file setup_series()
+ * last picked for some other position, so the answer we would
+ * get for world_x and world_y depends on who asked before us.
+ */
+static int
+has_files ( struct series *sp )
+{
+	struct method *xp;
+
+	if ( sp->series == S_STATE || sp->series == S_ATLAS )
+	    return 1;
+
+	for ( xp = sp->methods; xp; xp = xp->next )
+	    if ( xp->type == M_FILE )
+		return 1;
+
+	return 0;
+}
+
+/* A maplet, straight out of the TPQ file */
+static int
+serve_maplet ( int fd, char *name, int world_x, int world_y, int keep )
+{
+	struct maplet probe;
+	struct tpq_info *tp;
+	int series;
+
+	series = -1;
+	gronk_series ( &series, name );
+	if ( series < 0 || info.series_info[series].terra )
+	    return send_text ( fd, 404, "Not Found", "No such series\n", keep );
+
+	if ( has_files ( &info.series_info[series] ) )
+	    return send_text ( fd, 404, "Not Found", "No maplet grid for that series\n", keep );
+
+	archive_lock ();
+	info.series = &info.series_info[series];
+	(void) maplet_lookup ( world_x, world_y, &probe );
+	archive_unlock ();
+
+	tp = probe.tpq;
+	if ( ! tp || probe.tpq_index < 0 || probe.tpq_index >= tp->index_size )
+	    return send_text ( fd, 404, "Not Found", "No maplet there\n", keep );
+
+	if ( ! send_header ( fd, 200, "OK", "image/jpeg", tp->index[probe.tpq_index].size, keep ) )
+	    return 0;
+
+	return tpq_send_maplet ( tp, probe.tpq_index, fd );
+}
+
+/* A mosaic tile, from the cache if we can */
+static int
+serve_tile ( int fd, int z, int x, int y, int keep )
+{
+	struct tile_entry *ep;
+	unsigned char *png;
+	long size;
+	int rv;
+
+	ep = tile_cache_get ( z, x, y );
+	if ( ! ep ) {
+	    if ( ! tile_make ( z, x, y, &png, &size ) )
+		return send_text ( fd, 404, "Not Found", "No maps there\n", keep );
+	    ep = tile_cache_put ( z, x, y, png, size );
+	}
+
+	rv = send_header ( fd, 200, "OK", "image/png", ep->size, keep );
+	if ( rv )
+	    rv = send_all ( fd, (char *) ep->png, ep->size );
+
+	tile_cache_release ( ep );
+	return rv;
+}
+
+/* Does a header have this value (just the first word of it) */
+static int
+header_is ( char *req, char *name, char *value )
+{
+	char *p;
+	int n = strlen ( name );
+
+	for ( p = strstr ( req, "\r\n" ); p; p = strstr ( p, "\r\n" ) ) {
+	    p += 2;
+	    if ( strncasecmp ( p, name, n ) != 0 || p[n] != ':' )
+		continue;
+	    p += n + 1;
+	    while ( *p == ' ' || *p == '\t' )
+		p++;
+	    return strncasecmp ( p, value, strlen(value) ) == 0;
+	}
+
+	return 0;
+}
+
+/* Handle one request (just the header, we don't take bodies).
+ * Returns 1 if the connection should stay open.
+ */
+static int
+serve_request ( int fd, char *req )
+{
+	char method[8];
+	char path[256];
+	char version[16];
+	char name[16];
+	char *p;
+	int keep;
+	int z, x, y;
+	int n;
+
+	if ( sscanf ( req, "%7s %255s %15s", method, path, version ) != 3 ) {
+	    send_text ( fd, 400, "Bad Request", "Bad request\n", 0 );
+	    return 0;
+	}
+
+	if ( strcmp ( version, "HTTP/1.1" ) == 0 )
+	    keep = ! header_is ( req, "Connection", "close" );
+	else
+	    keep = header_is ( req, "Connection", "keep-alive" );
+
+	if ( settings.verbose & V_BASIC )
+	    printf ( "serve: %s %s\n", method, path );
+
+	if ( strcmp ( method, "GET" ) != 0 )
+	    return send_text ( fd, 405, "Method Not Allowed", "Only GET here\n", keep ) && keep;
+
+	/* we have no use for a query */
+	if ( p = strchr ( path, '?' ) )
+	    *p = '\0';
+
+	if ( strcmp ( path, "/" ) == 0 )
+	    return send_text ( fd, 200, "OK", index_text, keep ) && keep;
+
+	n = 0;
+	if ( sscanf ( path, "/%d/%d/%d.png%n", &z, &x, &y, &n ) == 3 && n == strlen(path) )
+	    return serve_tile ( fd, z, x, y, keep ) && keep;
+
+	n = 0;
+	if ( sscanf ( path, "/%15[^/]/%d/%d.jpg%n", name, &x, &y, &n ) == 3 && n == strlen(path) )
+	    return serve_maplet ( fd, name, x, y, keep ) && keep;
+
+	return send_text ( fd, 404, "Not Found", "Not found\n", keep ) && keep;
+}
+
+/* Handle requests on a connection until we have answered
+ * everything the client has sent us.
+ * Returns 1 if the connection should go back to the main thread
+ * to wait for more, 0 if it should be closed.
+ */
+static int
+serve_conn ( int fd )
+{
+	char req[REQ_SIZE];
+	struct timeval tv;
+	char *end;
+	int have;
+	int hlen;
+	int keep;
+	int n;
+
+	tv.tv_sec = IDLE_SECS;
+	tv.tv_usec = 0;
+	setsockopt ( fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv) );
+
+	have = 0;
+	req[0] = '\0';
+
+	for ( ;; ) {
+	    /* get a whole header, there may be more than one already */
+	    while ( ! (end = strstr ( req, "\r\n\r\n" )) ) {
+		if ( have >= REQ_SIZE - 1 ) {
+		    send_text ( fd, 431, "Request Header Fields Too Large", "Too big\n", 0 );
+		    return 0;
+		}
+		n = read ( fd, req + have, REQ_SIZE - 1 - have );
+		if ( n <= 0 )
+		    return 0;
+		have += n;
+		req[have] = '\0';
+	    }
+
+	    hlen = end - req + 4;
+	    end[2] = '\0';
+
+	    keep = serve_request ( fd, req );
+
+	    memmove ( req, req + hlen, have - hlen + 1 );
+	    have -= hlen;
+
+	    /* We are holding no maplets now, so this is a good time,
+	     * but only if nobody else is holding any either.
+	     */
+	    maplet_cache_try_trim ();
+
+	    if ( ! keep )
+		return 0;
+
+	    /* Nothing more yet, go wait with the other idle ones.
+	     * (With part of a request on hand, we keep reading.)
+	     */
+	    if ( have == 0 )
+		return 1;
+	}
+}
+
+/* ---------------------------------------------------- */
+
+/* Connections the main thread has accepted,
+ * waiting for a server thread.
+ */
+static int conn_queue[CONN_QUEUE];
+static int conn_head = 0;
+static int conn_count = 0;
+
+static pthread_mutex_t conn_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t conn_ready = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t conn_room = PTHREAD_COND_INITIALIZER;
+
+static void
+conn_put ( int fd )
+{
+	pthread_mutex_lock ( &conn_lock );
+	while ( conn_count >= CONN_QUEUE )
+	    pthread_cond_wait ( &conn_room, &conn_lock );
+	conn_queue[(conn_head + conn_count) % CONN_QUEUE] = fd;
+	conn_count++;
+	pthread_cond_signal ( &conn_ready );
+	pthread_mutex_unlock ( &conn_lock );
+}
+
+static int
+conn_get ( void )
+{
+	int fd;
+
+	pthread_mutex_lock ( &conn_lock );
+	while ( conn_count == 0 )
+	    pthread_cond_wait ( &conn_ready, &conn_lock );
+	fd = conn_queue[conn_head];
+	conn_head = (conn_head + 1) % CONN_QUEUE;
+	conn_count--;
+	pthread_cond_signal ( &conn_room );
+	pthread_mutex_unlock ( &conn_lock );
+
+	return fd;
+}
+
+/* Idle connections go back to the main thread through this pipe */
+static int park_pipe[2];
+
+static void *
+serve_func ( void *arg )
+{
+	int fd;
+
+	for ( ;; ) {
+	    fd = conn_get ();
+	    if ( ! serve_conn ( fd ) ||
+		    write ( park_pipe[1], &fd, sizeof(int) ) != sizeof(int) )
+		close ( fd );
+	}
+
+	return NULL;
+}
+
+/* Connections waiting for a request (main thread only) */
+static int idle_fd[MAX_IDLE];
+static time_t idle_since[MAX_IDLE];
+static int idle_count = 0;
+
+static void
+idle_add ( int fd )
+{
+	/* Too many, the one that has waited longest has to go */
+	if ( idle_count >= MAX_IDLE ) {
+	    close ( idle_fd[0] );
+	    idle_count--;
+	    memmove ( &idle_fd[0], &idle_fd[1], idle_count * sizeof(int) );
+	    memmove ( &idle_since[0], &idle_since[1], idle_count * sizeof(time_t) );
+	}
+
+	idle_fd[idle_count] = fd;
+	idle_since[idle_count] = time ( NULL );
+	idle_count++;
+}
+
+/* Set when we get SIGINT or SIGTERM */
+static volatile sig_atomic_t serve_stop = 0;
+
+static void
+stop_handler ( int sig )
+{
+	serve_stop = 1;
+}
+
+/* Serve tiles on a port until somebody stops us.
+ * Returns a status for exit().
+ */
+int
+serve_main ( int port )
+{
+	struct sockaddr_in server;
+	struct sockaddr_in client;
+	struct pollfd *pfd;
+	socklen_t namelen;
+	pthread_t thread;
+	time_t now;
+	int on = 1;
+	int s, ss;
+	int fds[64];
+	int n, i, j;
+
+	struct sigaction sa;
+
+	/* a client hanging up on us is no reason to die */
+	signal ( SIGPIPE, SIG_IGN );
+
+	/* but ^C or a kill is, and we want to get out through
+	 * exit() so the TPQ index cache gets saved.  No SA_RESTART,
+	 * so accept() comes back to us with EINTR.
+	 */
+	memset ( &sa, 0, sizeof(sa) );
+	sa.sa_handler = stop_handler;
+	sigemptyset ( &sa.sa_mask );
+	sigaction ( SIGINT, &sa, NULL );
+	sigaction ( SIGTERM, &sa, NULL );
+
+	if ( (s = socket ( AF_INET, SOCK_STREAM, 0 )) < 0 ) {
+	    printf ( "Cannot make a socket\n" );
+	    return 1;
+	}
+	setsockopt ( s, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on) );
+
+	memset ( &server, 0, sizeof(server) );
+	server.sin_family = AF_INET;
+	server.sin_port = htons ( port );
+	server.sin_addr.s_addr = INADDR_ANY;
+
+	if ( bind ( s, (struct sockaddr *) &server, sizeof(server) ) < 0 ) {
+	    printf ( "Cannot bind to port %d: %s\n", port, strerror ( errno ) );
+	    return 1;
+	}
+
+	if ( listen ( s, 64 ) != 0 ) {
+	    printf ( "Cannot listen on port %d\n", port );
+	    return 1;
+	}
+
+	if ( pipe ( park_pipe ) < 0 ) {
+	    printf ( "Cannot make a pipe\n" );
+	    return 1;
+	}
+
+	tile_cache_init ();
+
+	n = settings.loader_threads;
+	if ( n < 1 )
+	    n = sysconf ( _SC_NPROCESSORS_ONLN );
+	if ( n > MAX_SERVERS )
+	    n = MAX_SERVERS;
+
+	for ( i=0; i<n; i++ ) {
+	    if ( pthread_create ( &thread, NULL, serve_func, NULL ) != 0 )
+		break;
+	    pthread_detach ( thread );
+	}
+
+	if ( i == 0 ) {
+	    printf ( "Cannot start any server threads\n" );
+	    return 1;
+	}
+
+	printf ( "Serving tiles on port %d with %d threads\n", port, i );
+
+	/* The listening socket, the pipe, and every idle connection */
+	pfd = (struct pollfd *) gmalloc ( (MAX_IDLE + 2) * sizeof(struct pollfd) );
+
+	while ( ! serve_stop ) {
+	    pfd[0].fd = s;
+	    pfd[0].events = POLLIN;
+	    pfd[1].fd = park_pipe[0];
+	    pfd[1].events = POLLIN;
+	    for ( i=0; i<idle_count; i++ ) {
+		pfd[i+2].fd = idle_fd[i];
+		pfd[i+2].events = POLLIN;
+	    }
+
+	    n = poll ( pfd, idle_count + 2, 1000 );
+	    if ( n < 0 ) {
+		if ( errno == EINTR )
+		    continue;
+		printf ( "poll fails: %s\n", strerror ( errno ) );
+		return 1;
+	    }
+
+	    /* Anybody with something to say gets a thread,
+	     * anybody quiet too long gets dropped.
+	     */
+	    now = time ( NULL );
+	    j = 0;
+	    for ( i=0; i<idle_count; i++ ) {
+		if ( pfd[i+2].revents )
+		    conn_put ( idle_fd[i] );
+		else if ( now - idle_since[i] >= IDLE_SECS )
+		    close ( idle_fd[i] );
+		else {
+		    idle_fd[j] = idle_fd[i];
+		    idle_since[j] = idle_since[i];
+		    j++;
+		}
+	    }
+	    idle_count = j;
+
+	    /* Back from the server threads */
+	    if ( pfd[1].revents ) {
+		n = read ( park_pipe[0], fds, sizeof(fds) );
+		for ( i=0; i < n / (int) sizeof(int); i++ )
+		    idle_add ( fds[i] );
+	    }
+
+	    /* New ones wait like everybody else, until they
+	     * actually send us something.
+	     */
+	    if ( pfd[0].revents ) {
+		namelen = sizeof(client);
+		ss = accept ( s, (struct sockaddr *) &client, &namelen );
+		if ( ss >= 0 )
+		    idle_add ( ss );
+		else if ( errno != EINTR && errno != ECONNABORTED ) {
+		    printf ( "accept fails: %s\n", strerror ( errno ) );
+		    return 1;
+		}
+	    }
+	}
+
+	/* Keep the server threads out of the archive (and so out of
+	 * tpq_new) while exit() saves the index cache.
+	 */
+	printf ( "Tile server stopping\n" );
+	archive_lock ();
+	return 0;
+}
+
+/* THE END */
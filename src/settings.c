@@ -102,6 +102,26 @@ settings_default ( void )
 	/* Keyboard key to zoom in/out (go up/down series) */
 	settings.up_key = KV_PAGE_UP;
 	settings.down_key = KV_PAGE_DOWN;
+
+	/* A 24K maplet is about 300K of pixels */
+	settings.maplet_cache_mb = 512;
+
+	/* but the JPEG for it is only 20 to 40K */
+	settings.jpeg_cache_mb = 128;
+
+	settings.index_cache = 1;
+	settings.archive_snap = 1;
+
+	settings.prefetch = 1;
+	settings.loader_threads = -1;
+
+	settings.drag_scale = 2;
+
+	/* off screen margin around the viewport, in maplets */
+	settings.pixmap_margin = 0;
+
+	/* for --serve, a mosaic tile is 50 to 150K of PNG */
+	settings.tile_cache_mb = 64;
 }
 
 struct wtable {
@@ -162,6 +182,22 @@ gronk_key ( int *rv, char *val )
 	*rv = *val;
 }
 
+/* libjpeg can only scale a maplet down by 1, 2, 4, or 8,
+ * anything else would quietly turn into one of those.
+ */
+static void
+gronk_scale ( int *rv, char *val )
+{
+	int scale = atol ( val );
+
+	if ( scale != 1 && scale != 2 && scale != 4 && scale != 8 ) {
+	    printf ( "Ignoring drag_scale %s, it must be 1, 2, 4, or 8\n", val );
+	    return;
+	}
+
+	*rv = scale;
+}
+
 static void
 set_one ( char *name )
 {
@@ -230,6 +266,24 @@ set_two ( char *name, char *val )
 	    gronk_key ( (int *) &settings.up_key, val );
 	else if ( strcmp ( name, "down_key" ) == 0 )
 	    gronk_key ( (int *) &settings.down_key, val );
+	else if ( strcmp ( name, "maplet_cache_mb" ) == 0 )
+	    settings.maplet_cache_mb = atol ( val );
+	else if ( strcmp ( name, "jpeg_cache_mb" ) == 0 )
+	    settings.jpeg_cache_mb = atol ( val );
+	else if ( strcmp ( name, "index_cache" ) == 0 )
+	    gronk_word ( (int *) &settings.index_cache, val, onoff_words );
+	else if ( strcmp ( name, "archive_snap" ) == 0 )
+	    gronk_word ( (int *) &settings.archive_snap, val, onoff_words );
+	else if ( strcmp ( name, "prefetch" ) == 0 )
+	    settings.prefetch = atol ( val );
+	else if ( strcmp ( name, "loader_threads" ) == 0 )
+	    settings.loader_threads = atol ( val );
+	else if ( strcmp ( name, "drag_scale" ) == 0 )
+	    gronk_scale ( &settings.drag_scale, val );
+	else if ( strcmp ( name, "pixmap_margin" ) == 0 )
+	    settings.pixmap_margin = atol ( val );
+	else if ( strcmp ( name, "tile_cache_mb" ) == 0 )
+	    settings.tile_cache_mb = atol ( val );
 	else if ( strcmp ( name, "add_archive" ) == 0 )
 	    archive_add ( val );
 	else if ( strcmp ( name, "gpx" ) == 0 )
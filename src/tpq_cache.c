@@ -0,0 +1,588 @@
+/*
+ *  GTopo
+ *
+ *  Copyright (C) 2007, Thomas J. Trebisky
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Street #330, Boston, MA 02111-1307, USA.
+ */
+
+/* tpq_cache.c -- part of gtopo
+ * Tom Trebisky  MMT Observatory, Tucson, Arizona
+ *
+ * A persistent cache of TPQ file headers and maplet offset tables.
+ *
+ * With several states on disk, startup spends most of its time
+ * in tpq_new() opening every TPQ file we come across, reading the
+ * header a byte at a time, and then walking the offset table (checking
+ * each entry for a JPEG tag as it goes).  US1_MAP2.TPQ alone has
+ * over 6000 entries in that table.  None of this ever changes, so we
+ * save what we learn in ~/.gtopo/index.bin and use it next time.
+ * We also keep the maplet pixel size there, once tpq_maplet_size()
+ * has peeked at a JPEG header to find it.
+ *
+ * An entry is only believed if the path, size and modification time
+ * of the file all match what we saw when we made the entry.
+ *
+ * The file is written in native byte order, it is a private cache
+ * for this machine and not something to pass around.  If the magic
+ * or version do not match, we just ignore it and build a new one.
+ */
+
+#include <gtk/gtk.h>
+#include <glib/gstdio.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "gtopo.h"
+#include "protos.h"
+
+extern struct settings settings;
+
+#define TPQ_CACHE_MAGIC		0x47545051	/* "GTPQ" */
+#define TPQ_CACHE_VERSION	2
+
+#define TPQ_CACHE_NAME		"index.bin"
+
+/* The table doubles as it fills, just like the one in tpq_lookup(),
+ * since a few states worth of 24K quads is tens of thousands of files.
+ */
+#define TPQ_CACHE_HASH_INIT	1024
+
+struct tpq_crec {
+	struct tpq_crec *next;
+	char *path;
+	int64_t size;
+	int64_t mtime;
+
+	char *state;
+	char *quad;
+
+	double w_long;
+	double e_long;
+	double s_lat;
+	double n_lat;
+
+	int long_count;
+	int lat_count;
+	int series;
+
+	int index_size;
+	struct tpq_index_e *index;
+
+	/* 0 if we never looked */
+	int maplet_xdim;
+	int maplet_ydim;
+
+	/* fetched or stored this session */
+	int used;
+};
+
+static struct tpq_crec **tpq_cache_hash = NULL;
+static int tpq_cache_hash_size = 0;
+static int tpq_cache_count = 0;
+
+static int tpq_cache_loaded = 0;
+static int tpq_cache_dirty = 0;
+
+/* buf should be PATH_MAX bytes */
+static char *
+tpq_cache_path ( char *buf )
+{
+	char *home;
+
+	home = find_home ();
+	if ( ! home )
+	    return NULL;
+
+	if ( snprintf ( buf, PATH_MAX, "%s/.gtopo/%s", home, TPQ_CACHE_NAME ) >= PATH_MAX )
+	    return NULL;
+
+	/* The directory first */
+	sprintf ( buf, "%s/.gtopo", home );
+	if ( ! is_directory ( buf ) )
+	    mkdir ( buf, 0755 );
+
+	strcat ( buf, "/" TPQ_CACHE_NAME );
+	return buf;
+}
+
+static void
+tpq_cache_grow ( void )
+{
+	struct tpq_crec **old;
+	struct tpq_crec *cp;
+	int old_size;
+	int b;
+	int i;
+
+	old = tpq_cache_hash;
+	old_size = tpq_cache_hash_size;
+
+	tpq_cache_hash_size = old_size ? old_size * 2 : TPQ_CACHE_HASH_INIT;
+	tpq_cache_hash = (struct tpq_crec **) gmalloc ( tpq_cache_hash_size * sizeof(struct tpq_crec *) );
+	memset ( tpq_cache_hash, 0, tpq_cache_hash_size * sizeof(struct tpq_crec *) );
+
+	for ( i=0; i<old_size; i++ ) {
+	    while ( (cp = old[i]) ) {
+		old[i] = cp->next;
+		b = str_hash ( cp->path ) & (tpq_cache_hash_size - 1);
+		cp->next = tpq_cache_hash[b];
+		tpq_cache_hash[b] = cp;
+	    }
+	}
+
+	if ( old )
+	    free ( (char *) old );
+}
+
+static struct tpq_crec *
+tpq_cache_find ( char *path )
+{
+	struct tpq_crec *cp;
+
+	if ( ! tpq_cache_hash )
+	    return NULL;
+
+	for ( cp = tpq_cache_hash[str_hash(path) & (tpq_cache_hash_size - 1)]; cp; cp = cp->next )
+	    if ( strcmp ( cp->path, path ) == 0 )
+		return cp;
+	return NULL;
+}
+
+static void
+tpq_cache_add ( struct tpq_crec *cp )
+{
+	int h;
+
+	if ( ! tpq_cache_hash || ++tpq_cache_count > 2 * tpq_cache_hash_size )
+	    tpq_cache_grow ();
+
+	h = str_hash ( cp->path ) & (tpq_cache_hash_size - 1);
+	cp->next = tpq_cache_hash[h];
+	tpq_cache_hash[h] = cp;
+}
+
+/* Only for records we read from the file, where
+ * we own everything, nothing is shared with a tpq_info yet.
+ */
+static void
+crec_free ( struct tpq_crec *cp )
+{
+	if ( cp->path )
+	    free ( cp->path );
+	if ( cp->state )
+	    free ( cp->state );
+	if ( cp->quad )
+	    free ( cp->quad );
+	if ( cp->index )
+	    free ( (char *) cp->index );
+	free ( (char *) cp );
+}
+
+/* Little helpers for reading and writing the cache file.
+ * Any short read just makes us give up on the whole file.
+ */
+static int
+rd ( FILE *fp, void *buf, int n )
+{
+	return fread ( buf, 1, n, fp ) == n;
+}
+
+static char *
+rd_string ( FILE *fp )
+{
+	int n;
+	char *rv;
+
+	if ( ! rd ( fp, &n, sizeof(int) ) || n < 0 || n > 1024 )
+	    return NULL;
+
+	rv = gmalloc ( n + 1 );
+	if ( ! rd ( fp, rv, n ) ) {
+	    free ( rv );
+	    return NULL;
+	}
+	rv[n] = '\0';
+	return rv;
+}
+
+static void
+wr_string ( FILE *fp, char *s )
+{
+	int n = strlen ( s );
+
+	fwrite ( &n, sizeof(int), 1, fp );
+	fwrite ( s, 1, n, fp );
+}
+
+static struct tpq_crec *
+rd_record ( FILE *fp )
+{
+	struct tpq_crec *cp;
+	int64_t off;
+	int i;
+
+	cp = (struct tpq_crec *) gmalloc ( sizeof(struct tpq_crec) );
+	memset ( cp, 0, sizeof(struct tpq_crec) );
+
+	if ( ! (cp->path = rd_string ( fp )) )
+	    goto bad;
+	if ( ! (cp->state = rd_string ( fp )) )
+	    goto bad;
+	if ( ! (cp->quad = rd_string ( fp )) )
+	    goto bad;
+
+	if ( ! rd ( fp, &cp->size, sizeof(int64_t) ) )
+	    goto bad;
+	if ( ! rd ( fp, &cp->mtime, sizeof(int64_t) ) )
+	    goto bad;
+
+	if ( ! rd ( fp, &cp->w_long, sizeof(double) ) )
+	    goto bad;
+	if ( ! rd ( fp, &cp->e_long, sizeof(double) ) )
+	    goto bad;
+	if ( ! rd ( fp, &cp->s_lat, sizeof(double) ) )
+	    goto bad;
+	if ( ! rd ( fp, &cp->n_lat, sizeof(double) ) )
+	    goto bad;
+
+	if ( ! rd ( fp, &cp->long_count, sizeof(int) ) )
+	    goto bad;
+	if ( ! rd ( fp, &cp->lat_count, sizeof(int) ) )
+	    goto bad;
+	if ( ! rd ( fp, &cp->series, sizeof(int) ) )
+	    goto bad;
+	if ( ! rd ( fp, &cp->index_size, sizeof(int) ) )
+	    goto bad;
+	if ( ! rd ( fp, &cp->maplet_xdim, sizeof(int) ) )
+	    goto bad;
+	if ( ! rd ( fp, &cp->maplet_ydim, sizeof(int) ) )
+	    goto bad;
+
+	if ( cp->index_size < 1 || cp->index_size > cp->size / 2 )
+	    goto bad;
+	if ( cp->series < 0 || cp->series >= N_SERIES )
+	    goto bad;
+
+	cp->index = (struct tpq_index_e *) gmalloc ( cp->index_size * sizeof(struct tpq_index_e) );
+
+	/* These offsets go straight to pread, sendfile and the mapping,
+	 * so every maplet had better be inside the file.
+	 */
+	for ( i=0; i<cp->index_size; i++ ) {
+	    if ( ! rd ( fp, &off, sizeof(int64_t) ) )
+		goto bad;
+	    cp->index[i].offset = off;
+	    if ( ! rd ( fp, &cp->index[i].size, sizeof(long) ) )
+		goto bad;
+	    if ( off < 0 || cp->index[i].size <= 0 ||
+		    off + cp->index[i].size > cp->size )
+		goto bad;
+	}
+
+	return cp;
+
+bad:
+	crec_free ( cp );
+	return NULL;
+}
+
+static void
+wr_record ( FILE *fp, struct tpq_crec *cp )
+{
+	int64_t off;
+	int i;
+
+	wr_string ( fp, cp->path );
+	wr_string ( fp, cp->state );
+	wr_string ( fp, cp->quad );
+
+	fwrite ( &cp->size, sizeof(int64_t), 1, fp );
+	fwrite ( &cp->mtime, sizeof(int64_t), 1, fp );
+
+	fwrite ( &cp->w_long, sizeof(double), 1, fp );
+	fwrite ( &cp->e_long, sizeof(double), 1, fp );
+	fwrite ( &cp->s_lat, sizeof(double), 1, fp );
+	fwrite ( &cp->n_lat, sizeof(double), 1, fp );
+
+	fwrite ( &cp->long_count, sizeof(int), 1, fp );
+	fwrite ( &cp->lat_count, sizeof(int), 1, fp );
+	fwrite ( &cp->series, sizeof(int), 1, fp );
+	fwrite ( &cp->index_size, sizeof(int), 1, fp );
+	fwrite ( &cp->maplet_xdim, sizeof(int), 1, fp );
+	fwrite ( &cp->maplet_ydim, sizeof(int), 1, fp );
+
+	for ( i=0; i<cp->index_size; i++ ) {
+	    off = cp->index[i].offset;
+	    fwrite ( &off, sizeof(int64_t), 1, fp );
+	    fwrite ( &cp->index[i].size, sizeof(long), 1, fp );
+	}
+}
+
+static void
+tpq_cache_load ( void )
+{
+	char path[PATH_MAX];
+	FILE *fp;
+	int magic, version, count;
+	struct tpq_crec *cp;
+	int i;
+
+	tpq_cache_loaded = 1;
+
+	if ( ! tpq_cache_path ( path ) )
+	    return;
+
+	fp = fopen ( path, "r" );
+	if ( ! fp )
+	    return;
+
+	if ( ! rd ( fp, &magic, sizeof(int) ) || magic != TPQ_CACHE_MAGIC ||
+	     ! rd ( fp, &version, sizeof(int) ) || version != TPQ_CACHE_VERSION ||
+	     ! rd ( fp, &count, sizeof(int) ) ) {
+	    if ( settings.verbose & V_TPQ )
+		printf ( "Ignoring stale TPQ index cache %s\n", path );
+	    fclose ( fp );
+	    return;
+	}
+
+	/* A bad record (truncated file, say) just ends the load,
+	 * whatever we got before that is still fine.
+	 */
+	for ( i=0; i<count; i++ ) {
+	    cp = rd_record ( fp );
+	    if ( ! cp )
+		break;
+	    tpq_cache_add ( cp );
+	}
+
+	fclose ( fp );
+
+	if ( settings.verbose & V_TPQ )
+	    printf ( "Loaded %d of %d entries from TPQ index cache %s\n", i, count, path );
+}
+
+/* See if we already know about this file.
+ * If so, fill in the tpq_info structure and return 1.
+ */
+int
+tpq_cache_fetch ( struct tpq_info *tp, struct stat *st )
+{
+	struct tpq_crec *cp;
+
+	if ( ! settings.index_cache )
+	    return 0;
+
+	if ( ! tpq_cache_loaded )
+	    tpq_cache_load ();
+
+	cp = tpq_cache_find ( tp->path );
+	if ( ! cp )
+	    return 0;
+
+	if ( cp->size != st->st_size || cp->mtime != st->st_mtime ) {
+	    if ( settings.verbose & V_TPQ )
+		printf ( "TPQ index cache entry is stale: %s\n", tp->path );
+	    return 0;
+	}
+
+	cp->used = 1;
+
+	tp->state = cp->state;
+	tp->quad = cp->quad;
+
+	tp->w_long = cp->w_long;
+	tp->e_long = cp->e_long;
+	tp->s_lat = cp->s_lat;
+	tp->n_lat = cp->n_lat;
+
+	tp->long_count = cp->long_count;
+	tp->lat_count = cp->lat_count;
+	tp->series = cp->series;
+
+	/* These get computed just as read_tpq_header() does */
+	tp->maplet_long_deg = (tp->e_long - tp->w_long) / tp->long_count;
+	tp->maplet_lat_deg = (tp->n_lat - tp->s_lat) / tp->lat_count;
+	tp->mid_lat = (tp->n_lat + tp->s_lat) / 2.0;
+
+	/* The cache entry lives forever, so we can share this */
+	tp->index_size = cp->index_size;
+	tp->index = cp->index;
+
+	tp->maplet_xdim = cp->maplet_xdim;
+	tp->maplet_ydim = cp->maplet_ydim;
+
+	return 1;
+}
+
+/* Remember a file we just had to read the hard way.
+ */
+void
+tpq_cache_store ( struct tpq_info *tp, struct stat *st )
+{
+	struct tpq_crec *cp;
+
+	if ( ! settings.index_cache )
+	    return;
+
+	if ( ! tpq_cache_loaded )
+	    tpq_cache_load ();
+
+	/* An old entry for this path is stale, just update it.
+	 * We leak the old index array, but this is rare.
+	 */
+	cp = tpq_cache_find ( tp->path );
+	if ( ! cp ) {
+	    cp = (struct tpq_crec *) gmalloc ( sizeof(struct tpq_crec) );
+	    cp->path = tp->path;
+	    tpq_cache_add ( cp );
+	}
+
+	cp->used = 1;
+	cp->size = st->st_size;
+	cp->mtime = st->st_mtime;
+
+	cp->state = tp->state;
+	cp->quad = tp->quad;
+
+	cp->w_long = tp->w_long;
+	cp->e_long = tp->e_long;
+	cp->s_lat = tp->s_lat;
+	cp->n_lat = tp->n_lat;
+
+	cp->long_count = tp->long_count;
+	cp->lat_count = tp->lat_count;
+	cp->series = tp->series;
+
+	cp->index_size = tp->index_size;
+	cp->index = tp->index;
+
+	cp->maplet_xdim = tp->maplet_xdim;
+	cp->maplet_ydim = tp->maplet_ydim;
+
+	tpq_cache_dirty = 1;
+}
+
+/* tpq_maplet_size() just learned the maplet size for a file,
+ * which tpq_new() already stored (or fetched).
+ */
+void
+tpq_cache_size ( struct tpq_info *tp )
+{
+	struct tpq_crec *cp;
+
+	if ( ! settings.index_cache || ! tpq_cache_loaded )
+	    return;
+
+	cp = tpq_cache_find ( tp->path );
+	if ( ! cp )
+	    return;
+
+	if ( cp->maplet_xdim == tp->maplet_xdim && cp->maplet_ydim == tp->maplet_ydim )
+	    return;
+
+	cp->maplet_xdim = tp->maplet_xdim;
+	cp->maplet_ydim = tp->maplet_ydim;
+	tpq_cache_dirty = 1;
+}
+
+/* Is this entry worth writing out again?
+ * Anything we used this session surely is.  For the rest (files
+ * in parts of the archive we never looked at) we check that the
+ * file is still there and unchanged, otherwise the cache would hang
+ * on to entries for deleted or replaced files forever.
+ */
+static int
+crec_keep ( struct tpq_crec *cp )
+{
+	struct stat st;
+
+	if ( cp->used )
+	    return 1;
+
+	if ( stat ( cp->path, &st ) < 0 )
+	    return 0;
+
+	return cp->size == st.st_size && cp->mtime == st.st_mtime;
+}
+
+/* Write the cache back out if we learned anything new.
+ * We write to a temporary and rename it, so a crash (or two
+ * copies of gtopo running) never leaves a half written file.
+ */
+void
+tpq_cache_save ( void )
+{
+	char path[PATH_MAX];
+	char tmp_path[PATH_MAX+16];
+	FILE *fp;
+	struct tpq_crec *cp;
+	int magic, version, count;
+	int i;
+
+	if ( ! tpq_cache_dirty )
+	    return;
+
+	if ( ! tpq_cache_path ( path ) )
+	    return;
+
+	snprintf ( tmp_path, sizeof(tmp_path), "%s.%d", path, getpid() );
+	fp = fopen ( tmp_path, "w" );
+	if ( ! fp )
+	    return;
+
+	/* sort out what we keep first, since the count goes before them */
+	count = 0;
+	for ( i=0; i<tpq_cache_hash_size; i++ )
+	    for ( cp = tpq_cache_hash[i]; cp; cp = cp->next ) {
+		cp->used = crec_keep ( cp );
+		if ( cp->used )
+		    count++;
+	    }
+
+	magic = TPQ_CACHE_MAGIC;
+	version = TPQ_CACHE_VERSION;
+	fwrite ( &magic, sizeof(int), 1, fp );
+	fwrite ( &version, sizeof(int), 1, fp );
+	fwrite ( &count, sizeof(int), 1, fp );
+
+	for ( i=0; i<tpq_cache_hash_size; i++ )
+	    for ( cp = tpq_cache_hash[i]; cp; cp = cp->next )
+		if ( cp->used )
+		    wr_record ( fp, cp );
+
+	if ( fclose ( fp ) != 0 ) {
+	    remove ( tmp_path );
+	    return;
+	}
+
+	if ( rename ( tmp_path, path ) < 0 ) {
+	    remove ( tmp_path );
+	    return;
+	}
+
+	tpq_cache_dirty = 0;
+
+	if ( settings.verbose & V_TPQ )
+	    printf ( "Saved %d entries to TPQ index cache %s\n", count, path );
+}
+
+/* THE END */
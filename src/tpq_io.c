@@ -24,6 +24,17 @@
 #include <stdlib.h>
 #include <fcntl.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/mman.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+#include <pthread.h>
+#include <setjmp.h>
+#include <jpeglib.h>
 
 #include "gtopo.h"
 #include "protos.h"
@@ -164,25 +175,74 @@ build_index_OLD ( struct tpq_info *tp, int fd, long *info )
 
 #define JPEG_SOI_TAG	0xd8ff
 
+/* Decode the little endian offset table.
+ * On a little endian machine this is just a copy.
+ */
 static void
-build_index ( struct tpq_info *tp, int fd )
+decode_offsets ( unsigned int *offsets, unsigned char *raw, int count )
 {
 	int i;
-	unsigned short tag;
+
+	if ( ! is_big_endian () ) {
+	    memcpy ( offsets, raw, count * sizeof(unsigned int) );
+	    return;
+	}
+
+	for ( i=0; i<count; i++ )
+	    offsets[i] = raw[4*i] | raw[4*i+1] << 8 | raw[4*i+2] << 16 | (unsigned int) raw[4*i+3] << 24;
+}
+
+/* Fetch the (little endian) 2 byte tag at the start of a maplet.
+ * We get this from the mapping when we have one, no I/O at all
+ * if the pages are cached.  The pool marks the mapping MADV_RANDOM,
+ * which turns off readahead, so build_index() switches the range
+ * to MADV_SEQUENTIAL while it looks at all of these.
+ */
+static int
+maplet_tag ( struct tpq_info *tp, off_t off )
+{
+	unsigned char tag[2];
+
+	if ( tp->map ) {
+	    if ( off < 0 || off + 2 > tp->map_size )
+		return -1;
+	    return tp->map[off] | tp->map[off+1] << 8;
+	}
+
+	if ( pread ( tp->fd, tag, 2, off ) != 2 )
+	    return -1;
+	return tag[0] | tag[1] << 8;
+}
+
+/* Build the index from the offset table that follows the header.
+ * This used to read each table entry and then seek to check the
+ * maplet it points at, one small read at a time, which for the
+ * 6133 entries in US1_MAP2.TPQ was a lot of I/O.  Now we read
+ * the whole table in one go and check the tags via the mapping,
+ * with readahead on so that a cold file takes a few big reads.
+ * Expects the file to be in the pool (tp->fd valid).
+ */
+static void
+build_index ( struct tpq_info *tp )
+{
+	int i;
+	int tag;
 	int num_index;
 	int num_jpeg;
-	struct tpq_index_e *proto_index;
+	unsigned char first[4];
+	unsigned char *raw;
+	unsigned int *offsets;
 	struct tpq_index_e *index;
-	long offset;
-	void *fbp;
-
-	fbp = filebuf_init ( fd, (off_t) TPQ_HEADER_SIZE );
+	unsigned int offset;
+	off_t lo, hi;
+	long page;
 
 	/* Read the offset to the first maplet, and
 	 * use it to compute the size of the offset table.
 	 */
-	offset = filebuf_i4 ( fbp );
-	filebuf_skip ( fbp, -4 );
+	if ( pread ( tp->fd, first, 4, (off_t) TPQ_HEADER_SIZE ) != 4 )
+	    error ( "Build index cannot read %s\n", tp->path );
+	decode_offsets ( &offset, first, 1 );
 
 	/* We won't need ALL of these, since some of the
 	 * pointers point to the non-JPEG stuff at the
@@ -190,30 +250,52 @@ build_index ( struct tpq_info *tp, int fd )
 	 * least one index past the JPEG stuff to be
 	 * able to calculate the last maplet size.
 	 */
-	num_index = (offset - TPQ_HEADER_SIZE)/4;
+	num_index = ((long) offset - TPQ_HEADER_SIZE)/4;
+	if ( num_index < 2 || (tp->map && offset > tp->map_size) )
+	    error ( "Build index: bogus offset table in %s\n", tp->path );
+
+	raw = (unsigned char *) gmalloc ( num_index * 4 );
+	offsets = (unsigned int *) gmalloc ( num_index * sizeof(unsigned int) );
+
+	if ( pread ( tp->fd, raw, num_index * 4, (off_t) TPQ_HEADER_SIZE ) != num_index * 4 )
+	    error ( "Build index: short read on %s\n", tp->path );
 
-	proto_index = (struct tpq_index_e *) gmalloc ( num_index * sizeof(struct tpq_index_e) );
-	if ( ! proto_index )
-	    error ("Build index: too many thingies %d!\n", num_index );
+	decode_offsets ( offsets, raw, num_index );
+	free ( (char *) raw );
 
-	/* Read the offset table, verify as we go that we
-	 * point to a JPEG SOI tag, and terminate when
-	 * that is no longer true.
+	/* The maplets are in order in the file, so with readahead
+	 * turned on for the span of them, checking every tag below
+	 * costs a handful of big reads on a cold file, rather than
+	 * a page fault (and a 4K read) per maplet.
+	 */
+	if ( tp->map ) {
+	    page = sysconf ( _SC_PAGESIZE );
+	    lo = TPQ_HEADER_SIZE;
+	    hi = tp->map_size;
+	    if ( offsets[num_index-1] + 2 < hi )
+		hi = offsets[num_index-1] + 2;
+	    lo &= ~(page - 1);
+	    if ( hi <= lo )
+		hi = tp->map_size;
+	    (void) madvise ( tp->map + lo, hi - lo, MADV_SEQUENTIAL );
+	}
+
+	/* Verify that the entries point to a JPEG SOI tag,
+	 * and terminate when that is no longer true.
 	 */
 	num_jpeg = 0;
+	tag = JPEG_SOI_TAG;
 	for ( i=0; i<num_index; i++ ) {
-	    proto_index[i].offset = filebuf_i4 ( fbp );
-
-	    tag = filebuf_i2_off ( fd, proto_index[i].offset );
-	    /*
-	    printf ( "Build index: offset %d = %d %x\n", i+1, proto_index[i].offset, tag );
-	    */
+	    tag = maplet_tag ( tp, offsets[i] );
 	    if ( tag != JPEG_SOI_TAG )
 		break;
-
 	    num_jpeg++;
 	}
 
+	/* Back to the way the pool wants it */
+	if ( tp->map )
+	    (void) madvise ( tp->map + lo, hi - lo, MADV_RANDOM );
+
 	/* If this ever happens, I don't know how we figure the size of the last
 	 * maplet.  Well actually, I do!  We can use the size of the file itself,
 	 * which we can get from a stat call.  However, there doesn't seem to
@@ -224,21 +306,19 @@ build_index ( struct tpq_info *tp, int fd )
 	    error ( "Build index fails for %s\n", tp->path );
 
 	/* Compute maplet sizes:
-	 * Since the above search will have loaded one offset beyond
+	 * Since the above search will have stopped one offset beyond
 	 * the last JPEG maplet, the "look ahead" here will work.
 	 */
-	for ( i=0; i<num_jpeg; i++ )
-	    proto_index[i].size = proto_index[i+1].offset - proto_index[i].offset;
-
-	/* Now copy to a smaller index buffer, and free the big one
-	 * we have been working in
-	 */
         index = (struct tpq_index_e *) gmalloc ( num_jpeg * sizeof(struct tpq_index_e) );
         if ( ! index )
 	    error ("Build index: too many maplets %d!\n", num_jpeg );
 
-	memcpy ( index, proto_index, num_jpeg * sizeof(struct tpq_index_e) );
-	free ( (char *) proto_index );
+	for ( i=0; i<num_jpeg; i++ ) {
+	    index[i].offset = offsets[i];
+	    index[i].size = offsets[i+1] - offsets[i];
+	}
+
+	free ( (char *) offsets );
 
 	tp->index = index;
 	tp->index_size = num_jpeg;
@@ -281,6 +361,7 @@ read_tpq_header ( struct tpq_info *tp, int fd )
 	tp->lat_count = filebuf_i4 ( fbp );
 
 	filebuf_skip ( fbp, 12 );
+	filebuf_free ( fbp );
 
 #ifdef notdef
 	filebuf_skip ( fbp, 88 );
@@ -362,31 +443,307 @@ read_tpq_header ( struct tpq_info *tp, int fd )
 	return 1;
 }
 
+/* A pool of open TPQ files.
+ *
+ * Opening a file for every maplet is slow on NFS, where every
+ * open and close is a round trip to the server.  So we keep
+ * the most recently used files open, and mapped into memory,
+ * in an LRU list.  Once a file is in the pool, getting a maplet
+ * from it costs no system calls at all if the pages are in the
+ * page cache, and the JPEG bytes go straight from the mapping
+ * to the decoder.  (The readahead hints go out once per batch of
+ * maplets, see tpq_willneed_maplets(), only a maplet loaded all
+ * on its own gets a madvise of its own.)
+ *
+ * The pool is bounded, since a session that wanders across a few
+ * states would otherwise have thousands of files open.  A file that
+ * somebody is reading from (pool_users) is never closed, so this
+ * is safe with several loader threads.
+ */
+#define TPQ_POOL_SIZE	64
+
+static struct tpq_info *pool_head = NULL;	/* most recently used */
+static struct tpq_info *pool_tail = NULL;
+static int pool_count = 0;
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void
+pool_unlink ( struct tpq_info *tp )
+{
+	if ( tp->pool_prev )
+	    tp->pool_prev->pool_next = tp->pool_next;
+	else
+	    pool_head = tp->pool_next;
+
+	if ( tp->pool_next )
+	    tp->pool_next->pool_prev = tp->pool_prev;
+	else
+	    pool_tail = tp->pool_prev;
+
+	tp->pool_next = tp->pool_prev = NULL;
+}
+
+static void
+pool_push ( struct tpq_info *tp )
+{
+	tp->pool_prev = NULL;
+	tp->pool_next = pool_head;
+	if ( pool_head )
+	    pool_head->pool_prev = tp;
+	pool_head = tp;
+	if ( ! pool_tail )
+	    pool_tail = tp;
+}
+
+/* Close the least recently used files until we are back
+ * within bounds.  Called with the pool lock held.
+ */
+static void
+pool_trim ( int limit )
+{
+	struct tpq_info *tp, *prev;
+
+	for ( tp = pool_tail; tp && pool_count > limit; tp = prev ) {
+	    prev = tp->pool_prev;
+	    if ( tp->pool_users )
+		continue;
+
+	    if ( settings.verbose & V_TPQ )
+		printf ( "TPQ pool closing %s\n", tp->path );
+
+	    pool_unlink ( tp );
+	    if ( tp->map )
+		munmap ( tp->map, tp->map_size );
+	    tp->map = NULL;
+	    close ( tp->fd );
+	    tp->fd = -1;
+	    pool_count--;
+	}
+}
+
+/* Add a file that is already open to the pool.
+ * tpq_new() uses this so the first maplet we pull
+ * does not need to open it again.
+ */
+static void
+tpq_pool_adopt ( struct tpq_info *tp, int fd )
+{
+	pthread_mutex_lock ( &pool_lock );
+	tp->fd = fd;
+	pool_push ( tp );
+	pool_count++;
+	pool_trim ( TPQ_POOL_SIZE );
+	pthread_mutex_unlock ( &pool_lock );
+}
+
+/* Take a file out of the pool for good and close it,
+ * for tpq_new() when it has to give up on a file.
+ */
+static void
+tpq_pool_drop ( struct tpq_info *tp )
+{
+	pthread_mutex_lock ( &pool_lock );
+	if ( tp->fd >= 0 ) {
+	    pool_unlink ( tp );
+	    if ( tp->map )
+		munmap ( tp->map, tp->map_size );
+	    tp->map = NULL;
+	    close ( tp->fd );
+	    tp->fd = -1;
+	    pool_count--;
+	}
+	pthread_mutex_unlock ( &pool_lock );
+}
+
+/* Get a file ready for reading, opening and mapping it if need be.
+ * Every successful call must be matched with tpq_pool_put().
+ */
+static int
+tpq_pool_get ( struct tpq_info *tp )
+{
+	struct stat st;
+	void *map;
+
+	pthread_mutex_lock ( &pool_lock );
+
+	if ( tp->fd < 0 ) {
+	    tp->fd = open ( tp->path, O_RDONLY );
+	    if ( tp->fd < 0 ) {
+		pthread_mutex_unlock ( &pool_lock );
+		return 0;
+	    }
+	    pool_push ( tp );
+	    pool_count++;
+	} else {
+	    pool_unlink ( tp );
+	    pool_push ( tp );
+	}
+
+	/* Access is all over the place, so we tell the kernel not
+	 * to bother with readahead beyond what we ask for.
+	 * If we cannot map it, we will use pread.
+	 */
+	if ( ! tp->map && ! tp->map_failed ) {
+	    map = MAP_FAILED;
+	    if ( fstat ( tp->fd, &st ) == 0 && st.st_size > 0 )
+		map = mmap ( NULL, st.st_size, PROT_READ, MAP_SHARED, tp->fd, 0 );
+
+	    if ( map == MAP_FAILED ) {
+		if ( settings.verbose & V_TPQ )
+		    printf ( "Cannot mmap %s, will use pread\n", tp->path );
+		tp->map_failed = 1;
+	    } else {
+		(void) madvise ( map, st.st_size, MADV_RANDOM );
+		tp->map = (unsigned char *) map;
+		tp->map_size = st.st_size;
+	    }
+	}
+
+	tp->pool_users++;
+	pool_trim ( TPQ_POOL_SIZE );
+
+	pthread_mutex_unlock ( &pool_lock );
+	return 1;
+}
+
+static void
+tpq_pool_put ( struct tpq_info *tp )
+{
+	pthread_mutex_lock ( &pool_lock );
+	tp->pool_users--;
+	pthread_mutex_unlock ( &pool_lock );
+}
+
+/* Send the JPEG bytes of a maplet straight from the TPQ file to a
+ * socket, for the tile server.  On linux sendfile() means the bytes
+ * never even come up to user space.  The tile server writes the HTTP
+ * header first, so it gets the size from the index itself.
+ * Returns 1 if it all went.
+ */
+int
+tpq_send_maplet ( struct tpq_info *tp, int index, int sock )
+{
+	off_t off;
+	long size;
+	long n;
+	int rv;
+#ifndef __linux__
+	unsigned char *buf;
+#endif
+
+	if ( index < 0 || index >= tp->index_size )
+	    return 0;
+
+	off = tp->index[index].offset;
+	size = tp->index[index].size;
+
+	if ( ! tpq_pool_get ( tp ) )
+	    return 0;
+
+	rv = 1;
+#ifdef __linux__
+	while ( size > 0 ) {
+	    n = sendfile ( sock, tp->fd, &off, size );
+	    if ( n <= 0 ) {
+		rv = 0;
+		break;
+	    }
+	    size -= n;
+	}
+#else
+	if ( tp->map && off + size <= tp->map_size )
+	    buf = tp->map + off;
+	else {
+	    buf = (unsigned char *) gmalloc ( size );
+	    if ( pread ( tp->fd, buf, size, off ) != size )
+		rv = 0;
+	}
+	for ( n = 0; rv && n < size; ) {
+	    int nw = write ( sock, buf + n, size - n );
+	    if ( nw <= 0 )
+		rv = 0;
+	    else
+		n += nw;
+	}
+	if ( buf != tp->map + off )
+	    free ( (char *) buf );
+#endif
+
+	tpq_pool_put ( tp );
+	return rv;
+}
+
+/* Every TPQ file we have opened, in the order we opened them.
+ */
 static struct tpq_info *tpq_head = NULL;
+static struct tpq_info *tpq_tail = NULL;
+static int tpq_next_id = 0;
+
+/* We used to walk the above list with strcmp on every maplet we
+ * went looking for, and with a few states worth of 24K quads that
+ * list gets to be tens of thousands long.  So we also hash on the path.
+ * Lookups happen on the main thread, or under archive_lock().
+ */
+#define TPQ_HASH_INIT	1024
+
+static struct tpq_info **tpq_hash = NULL;
+static int tpq_hash_size = 0;
+static int tpq_count = 0;
 
 static struct tpq_info *
 tpq_new ( char *path )
 {
         struct tpq_info *tp;
+	struct stat st;
 	int fd;
 
 	if ( settings.verbose & V_TPQ )
 	    printf ( "tpq_new: %s\n", path );
 
+	if ( stat ( path, &st ) < 0 )
+	    return NULL;
+
         tp = (struct tpq_info *) gmalloc ( sizeof(struct tpq_info) );
         if ( ! tp )
             error ("tpq_new, out of mem\n");
+	memset ( tp, 0, sizeof(struct tpq_info) );
+	tp->fd = -1;
 
 	tp->path = strhide(path);
+	tp->id = tpq_next_id++;
+
+	/* Maybe we saw this file last time we ran */
+	if ( tpq_cache_fetch ( tp, &st ) )
+	    return tp;
 
 	fd = open ( path, O_RDONLY );
-	if ( fd < 0 )
+	if ( fd < 0 ) {
+	    free ( tp->path );
+	    free ( (char *) tp );
 	    return NULL;
+	}
 
-	if ( ! read_tpq_header ( tp, fd ) )
+	if ( ! read_tpq_header ( tp, fd ) ) {
+	    close ( fd );
+	    free ( tp->path );
+	    free ( (char *) tp );
 	    return NULL;
+	}
 
-	build_index ( tp, fd );
+	/* Keep it open, we will likely want maplets from it soon,
+	 * and the pool will map it for build_index()
+	 */
+	tpq_pool_adopt ( tp, fd );
+
+	if ( ! tpq_pool_get ( tp ) ) {
+	    tpq_pool_drop ( tp );
+	    free ( tp->path );
+	    free ( (char *) tp );
+	    return NULL;
+	}
+	build_index ( tp );
+	tpq_pool_put ( tp );
 
 #ifdef notdef
 	{
@@ -398,30 +755,110 @@ tpq_new ( char *path )
 	}
 #endif
 
-	close ( fd );
+	tpq_cache_store ( tp, &st );
 
         return tp;
 }
 
+static void
+tpq_hash_grow ( void )
+{
+	struct tpq_info *tp;
+	int b;
+
+	if ( tpq_hash )
+	    free ( (char *) tpq_hash );
+
+	tpq_hash_size = tpq_hash_size ? tpq_hash_size * 2 : TPQ_HASH_INIT;
+	tpq_hash = (struct tpq_info **) gmalloc ( tpq_hash_size * sizeof(struct tpq_info *) );
+	memset ( tpq_hash, 0, tpq_hash_size * sizeof(struct tpq_info *) );
+
+	for ( tp = tpq_head; tp; tp = tp->next ) {
+	    b = str_hash ( tp->path ) & (tpq_hash_size - 1);
+	    tp->hash_next = tpq_hash[b];
+	    tpq_hash[b] = tp;
+	}
+}
+
 struct tpq_info *
 tpq_lookup ( char *path )
 {
 	struct tpq_info *tp;
+	unsigned int h;
 
-	for ( tp = tpq_head; tp; tp = tp->next )
+	if ( ! tpq_hash )
+	    tpq_hash_grow ();
+
+	h = str_hash ( path );
+
+	for ( tp = tpq_hash[h & (tpq_hash_size - 1)]; tp; tp = tp->hash_next )
 	    if ( strcmp(tp->path,path) == 0 )
 	    	return tp;
 
 	tp = tpq_new ( path );
+	if ( ! tp )
+	    return NULL;
 
-	if ( tp ) {
-	    tp->next = tpq_head;
+	tp->next = NULL;
+	if ( tpq_tail )
+	    tpq_tail->next = tp;
+	else
 	    tpq_head = tp;
+	tpq_tail = tp;
+
+	if ( ++tpq_count > 2 * tpq_hash_size ) {
+	    /* this puts the new one in too */
+	    tpq_hash_grow ();
+	} else {
+	    tp->hash_next = tpq_hash[h & (tpq_hash_size - 1)];
+	    tpq_hash[h & (tpq_hash_size - 1)] = tp;
 	}
 
 	return tp;
 }
 
+/* List all the TPQ files we have opened, oldest first */
+void
+tpq_dump ( void )
+{
+	struct tpq_info *tp;
+
+	for ( tp = tpq_head; tp; tp = tp->next )
+	    printf ( "TPQ %d: %s (%s, %s) %d maplets%s\n", tp->id, tp->path,
+		tp->quad, tp->state, tp->index_size, tp->fd < 0 ? "" : " open" );
+}
+
+/* Close every file in the pool, and ask the kernel to forget what
+ * it has cached from any TPQ file we know about, so the next maplet
+ * we want really comes off the disk.  The benchmark (bench.c) uses
+ * this to start out cold.  The kernel is free to ignore us (pages
+ * somebody else has mapped stay put), so to be really sure, do
+ *   echo 3 > /proc/sys/vm/drop_caches
+ * as root instead.
+ */
+void
+tpq_pool_flush ( void )
+{
+	struct tpq_info *tp;
+	int fd;
+
+	pthread_mutex_lock ( &pool_lock );
+	pool_trim ( 0 );
+	pthread_mutex_unlock ( &pool_lock );
+
+#ifdef POSIX_FADV_DONTNEED
+	for ( tp = tpq_head; tp; tp = tp->next ) {
+	    if ( tp->fd >= 0 )
+		continue;
+	    fd = open ( tp->path, O_RDONLY );
+	    if ( fd < 0 )
+		continue;
+	    (void) posix_fadvise ( fd, 0, 0, POSIX_FADV_DONTNEED );
+	    close ( fd );
+	}
+#endif
+}
+
 #ifndef LOADER
 static char tmpdir[64];
 static char tmpname[128];
@@ -498,82 +935,498 @@ temp_init ( void )
 }
 #endif
 
+/* Ask the kernel to bring in the pages for a range of the file
+ * in a single go, rather than faulting them in one by one
+ * as the decoder works its way through (the mapping is MADV_RANDOM,
+ * so there is no readahead to help).
+ * Expects the file to be in the pool.
+ */
+static void
+tpq_willneed ( struct tpq_info *tp, off_t off, long size )
+{
+	long page = sysconf ( _SC_PAGESIZE );
+	off_t start;
+
+	if ( ! tp->map ) {
+	    (void) posix_fadvise ( tp->fd, off, size, POSIX_FADV_WILLNEED );
+	    return;
+	}
+
+	if ( off + size > tp->map_size )
+	    size = tp->map_size - off;
+	if ( size <= 0 )
+	    return;
+
+	start = off & ~(page - 1);
+	(void) madvise ( tp->map + start, size + (off - start), MADV_WILLNEED );
+}
+
+/* Maplets closer than this in the file get one hint between them,
+ * the bytes in the gap are cheaper than another seek.
+ */
+#define WILLNEED_GAP	(64 * 1024)
+
+static int
+willneed_compare ( const void *a, const void *b )
+{
+	const struct maplet *ap = *(const struct maplet **) a;
+	const struct maplet *bp = *(const struct maplet **) b;
+
+	if ( ap->tpq->id != bp->tpq->id )
+	    return ap->tpq->id < bp->tpq->id ? -1 : 1;
+	if ( ap->tpq_index != bp->tpq_index )
+	    return ap->tpq_index < bp->tpq_index ? -1 : 1;
+	return 0;
+}
+
+/* A batch of maplets is about to be decoded (everything that just
+ * came into view, say), so hint the ranges of the files they are in,
+ * a few hints per file rather than a madvise for every maplet.
+ * Every maplet we cover gets marked, so load_tpq_maplet() knows it
+ * need not bother.  Maplets come in file order, so sorting by index
+ * is sorting by offset.
+ */
+void
+tpq_willneed_maplets ( struct maplet **list, int count )
+{
+	struct maplet **sorted;
+	struct tpq_info *tp;
+	struct tpq_index_e *ep;
+	off_t lo, hi;
+	int n;
+	int i, j;
+
+	sorted = (struct maplet **) gmalloc ( count * sizeof(struct maplet *) + 1 );
+
+	n = 0;
+	for ( i=0; i<count; i++ ) {
+	    tp = list[i]->tpq;
+	    if ( tp && list[i]->tpq_index >= 0 && list[i]->tpq_index < tp->index_size )
+		sorted[n++] = list[i];
+	}
+
+	qsort ( sorted, n, sizeof(struct maplet *), willneed_compare );
+
+	for ( i=0; i<n; i=j ) {
+	    tp = sorted[i]->tpq;
+	    for ( j=i+1; j<n && sorted[j]->tpq == tp; j++ )
+		;
+
+	    if ( ! tpq_pool_get ( tp ) )
+		continue;
+
+	    ep = &tp->index[sorted[i]->tpq_index];
+	    lo = ep->offset;
+	    hi = lo + ep->size;
+	    sorted[i]->hinted = 1;
+
+	    while ( ++i < j ) {
+		ep = &tp->index[sorted[i]->tpq_index];
+		if ( ep->offset > hi + WILLNEED_GAP ) {
+		    tpq_willneed ( tp, lo, hi - lo );
+		    lo = ep->offset;
+		}
+		if ( ep->offset + ep->size > hi )
+		    hi = ep->offset + ep->size;
+		sorted[i]->hinted = 1;
+	    }
+	    tpq_willneed ( tp, lo, hi - lo );
+
+	    tpq_pool_put ( tp );
+	}
+
+	free ( (char *) sorted );
+}
+
 #define BUFSIZE	1024
 
-/* Pull a maplet out of a TPQ file.
- * expects mp->tpq_index and mp->tpq_path
+/* libjpeg wants to exit() on errors, which is no good here,
+ * so we jump back out of jpeg_decode() instead.
+ */
+struct jpeg_oops {
+	struct jpeg_error_mgr pub;
+	jmp_buf jmp;
+};
+
+static void
+jpeg_oops_exit ( j_common_ptr cinfo )
+{
+	struct jpeg_oops *op = (struct jpeg_oops *) cinfo->err;
+
+	longjmp ( op->jmp, 1 );
+}
+
+static void
+jpeg_oops_message ( j_common_ptr cinfo )
+{
+	char msg[JMSG_LENGTH_MAX];
+
+	if ( settings.verbose & V_MAPLET ) {
+	    (*cinfo->err->format_message) ( cinfo, msg );
+	    printf ( "libjpeg: %s\n", msg );
+	}
+}
+
+/* Decode a maplet with libjpeg, rather than going through a
+ * GdkPixbufLoader, which lets us ask for a reduced size image.
+ * With a scale of 2, 4, or 8 libjpeg does the reduction in the
+ * DCT domain, so it has that much less work to do, and we also
+ * turn on the fast (slightly less accurate) IDCT and skip the
+ * fancy chroma upsampling.  This is what we use for quick
+ * previews while the map is being dragged around.
+ *
+ * Sets xdim and ydim in the maplet to the FULL size of the image,
+ * whatever size the pixbuf we hand back is.
+ */
+static GdkPixbuf *
+jpeg_decode ( struct maplet *mp, unsigned char *data, long size )
+{
+	struct jpeg_decompress_struct cinfo;
+	struct jpeg_oops oops;
+	GdkPixbuf * volatile pixbuf = NULL;
+	guchar *pixels;
+	int stride;
+	JSAMPROW row;
+
+	cinfo.err = jpeg_std_error ( &oops.pub );
+	oops.pub.error_exit = jpeg_oops_exit;
+	oops.pub.output_message = jpeg_oops_message;
+
+	if ( setjmp ( oops.jmp ) ) {
+	    jpeg_destroy_decompress ( &cinfo );
+	    pixbuf_put ( pixbuf );
+	    return NULL;
+	}
+
+	jpeg_create_decompress ( &cinfo );
+	jpeg_mem_src ( &cinfo, data, size );
+	(void) jpeg_read_header ( &cinfo, TRUE );
+
+	mp->xdim = cinfo.image_width;
+	mp->ydim = cinfo.image_height;
+
+	cinfo.out_color_space = JCS_RGB;
+	if ( mp->scale > 1 ) {
+	    cinfo.scale_num = 1;
+	    cinfo.scale_denom = mp->scale;
+	    cinfo.dct_method = JDCT_IFAST;
+	    cinfo.do_fancy_upsampling = FALSE;
+	    cinfo.do_block_smoothing = FALSE;
+	}
+
+	(void) jpeg_start_decompress ( &cinfo );
+
+	pixbuf = pixbuf_get ( cinfo.output_width, cinfo.output_height );
+	if ( ! pixbuf )
+	    longjmp ( oops.jmp, 1 );
+
+	pixels = gdk_pixbuf_get_pixels ( pixbuf );
+	stride = gdk_pixbuf_get_rowstride ( pixbuf );
+
+	while ( cinfo.output_scanline < cinfo.output_height ) {
+	    row = pixels + cinfo.output_scanline * stride;
+	    (void) jpeg_read_scanlines ( &cinfo, &row, 1 );
+	}
+
+	(void) jpeg_finish_decompress ( &cinfo );
+	jpeg_destroy_decompress ( &cinfo );
+
+	return pixbuf;
+}
+
+/* The old way, which is still good for anything
+ * libjpeg balks at (CMYK for instance).
+ */
+static GdkPixbuf *
+loader_decode ( struct maplet *mp, unsigned char *data, long size )
+{
+	GdkPixbufLoader *loader;
+	GdkPixbuf *pixbuf;
+
+	/* Rumor has it that a loader cannot be reused, so
+	 * we must allocate a new loader each time.
+	 */
+	loader = gdk_pixbuf_loader_new_with_type ( "jpeg", NULL );
+	gdk_pixbuf_loader_write ( loader, data, size, NULL );
+
+	/* The following two calls work in either order */
+	gdk_pixbuf_loader_close ( loader, NULL );
+	pixbuf = gdk_pixbuf_loader_get_pixbuf ( loader );
+
+	/* be a good citizen and avoid a memory leak,
+	 */
+	if ( pixbuf ) {
+	    g_object_ref ( pixbuf );
+	    mp->xdim = gdk_pixbuf_get_width ( pixbuf );
+	    mp->ydim = gdk_pixbuf_get_height ( pixbuf );
+	}
+	g_object_unref ( loader );
+
+	return pixbuf;
+}
+
+/* Find the image size in a JPEG frame header (the SOF marker)
+ * without decoding anything.  The SOF comes right after the tables,
+ * a few hundred bytes in, so we hardly ever need the whole thing.
+ * Returns 0 if we run out of data (or get to the scan) first.
+ */
+static int
+jpeg_sof_size ( unsigned char *data, long size, int *w, int *h )
+{
+	long i;
+	int marker;
+	int len;
+
+	if ( size < 4 || data[0] != 0xff || data[1] != 0xd8 )
+	    return 0;
+
+	i = 2;
+	while ( i + 4 <= size ) {
+	    if ( data[i] != 0xff )
+		return 0;
+	    marker = data[i+1];
+
+	    /* fill bytes */
+	    if ( marker == 0xff ) {
+		i++;
+		continue;
+	    }
+
+	    /* markers that stand alone, no length */
+	    if ( marker == 0x01 || (marker >= 0xd0 && marker <= 0xd7) ) {
+		i += 2;
+		continue;
+	    }
+
+	    /* start of scan, too late */
+	    if ( marker == 0xda || marker == 0xd9 )
+		return 0;
+
+	    len = (data[i+2] << 8) | data[i+3];
+	    if ( len < 2 )
+		return 0;
+
+	    /* SOF0 through SOF15, except DHT, JPG and DAC */
+	    if ( marker >= 0xc0 && marker <= 0xcf &&
+		    marker != 0xc4 && marker != 0xc8 && marker != 0xcc ) {
+		if ( i + 9 > size )
+		    return 0;
+		*h = (data[i+5] << 8) | data[i+6];
+		*w = (data[i+7] << 8) | data[i+8];
+		return *w > 0 && *h > 0;
+	    }
+
+	    i += 2 + len;
+	}
+
+	return 0;
+}
+
+/* How many bytes of a maplet we read to find the SOF */
+#define SOF_PROBE	1024
+
+/* The size of the maplets in a TPQ file, as they come out of the JPEG.
+ * setup_series() wants this on every redraw of the STATE and ATLAS series
+ * just to set the pixel scale, and we used to decode a whole maplet to
+ * find out.  Now we just look at the JPEG header of the one in the middle
+ * of the file, and remember the answer (index.bin does too).
  */
 int
-load_tpq_maplet ( struct maplet *mp )
+tpq_maplet_size ( struct tpq_info *tp, int *xdim, int *ydim )
 {
-	char buf[BUFSIZE];
-	int fd, ofd;
+	unsigned char *buf;
+	int index;
 	int size;
+	int n;
 	off_t off;
-	int nw;
-	int nlong;
-	struct tpq_info *tp;
-	int x_index, y_index;
-	GdkPixbufLoader *loader;
+	int w, h;
+	int ok;
 
-	tp = tpq_lookup ( mp->tpq_path );
-	if ( ! tp )
+	if ( tp->maplet_xdim > 0 ) {
+	    *xdim = tp->maplet_xdim;
+	    *ydim = tp->maplet_ydim;
+	    return 1;
+	}
+
+	index = (tp->lat_count / 2) * tp->long_count + tp->long_count / 2;
+	if ( index < 0 || index >= tp->index_size )
 	    return 0;
 
-	mp->tpq = tp;
+	off = tp->index[index].offset;
+	size = tp->index[index].size;
 
-	/* XXX - Some hackery for when we are just sniffing at file
-	 * contents, so that we read a maplet near the geometric
-	 * center of the file.
-	 */
-	if ( mp->tpq_index < 0 ) {
-	    x_index = tp->long_count / 2;
-	    y_index = tp->lat_count / 2;
+	if ( ! tpq_pool_get ( tp ) )
+	    return 0;
+
+	ok = 0;
+	if ( tp->map && off + size <= tp->map_size ) {
+	    ok = jpeg_sof_size ( tp->map + off, size, &w, &h );
+	} else {
+	    /* the header is almost always in the first bit */
+	    n = size < SOF_PROBE ? size : SOF_PROBE;
+	    buf = (unsigned char *) gmalloc ( size );
+	    if ( pread ( tp->fd, buf, n, off ) == n ) {
+		ok = jpeg_sof_size ( buf, n, &w, &h );
+		if ( ! ok && n < size && pread ( tp->fd, buf, size, off ) == size )
+		    ok = jpeg_sof_size ( buf, size, &w, &h );
+	    }
+	    free ( (char *) buf );
+	}
+
+	tpq_pool_put ( tp );
+
+	if ( ! ok ) {
+	    if ( settings.verbose & V_TPQ )
+		printf ( "No JPEG frame header in %s (%d)\n", tp->path, index );
+	    return 0;
+	}
+
+	if ( settings.verbose & V_TPQ )
+	    printf ( "Maplet size for %s is %d by %d\n", tp->path, w, h );
+
+	tp->maplet_xdim = *xdim = w;
+	tp->maplet_ydim = *ydim = h;
+	tpq_cache_size ( tp );
+
+	return 1;
+}
+
+/* Keep track of what getting maplets costs us, for the
+ * benchmark (bench.c).  The loader threads come through here
+ * too, so this needs a lock.
+ */
+static struct load_stats load_stats;
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static double
+stats_time ( void )
+{
+	struct timeval tv;
+
+	gettimeofday ( &tv, NULL );
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+/* bytes is zero if it came from the JPEG cache */
+static void
+stats_add ( long bytes, double secs )
+{
+	pthread_mutex_lock ( &stats_lock );
+	load_stats.loads++;
+	if ( bytes ) {
+	    load_stats.reads++;
+	    load_stats.bytes += bytes;
+	}
+	load_stats.decode += secs;
+	pthread_mutex_unlock ( &stats_lock );
+}
+
+void
+tpq_load_stats ( struct load_stats *sp )
+{
+	pthread_mutex_lock ( &stats_lock );
+	*sp = load_stats;
+	pthread_mutex_unlock ( &stats_lock );
+}
 
-	    /* Correct for a M_FILE object,
-	     * XXX - needs offseting for a SECTION object.
-	     */
-	    mp->world_x = tp->long_count - x_index - 1;
-	    mp->world_y = tp->lat_count - y_index - 1;
+/* Pull a maplet out of a TPQ file.
+ * expects mp->tpq_index and mp->tpq_path,
+ * and mp->scale if a quick preview will do.
+ * On return mp->pixbuf is the image (which for a preview
+ * is smaller than xdim by ydim).
+ */
+int
+load_tpq_maplet ( struct maplet *mp )
+{
+	unsigned char *buf;
+	unsigned char *jbuf;
+	long jsize;
+	void *jh;
+	double t0;
+#ifndef LOADER
+	char rbuf[BUFSIZE];
+	int fd, ofd;
+	int nw;
+#endif
+	int size;
+	off_t off;
+	struct tpq_info *tp;
 
-	    mp->tpq_index = y_index * tp->long_count + x_index;
+	/* The caller has usually looked this up already */
+	tp = mp->tpq;
+	if ( ! tp ) {
+	    tp = tpq_lookup ( mp->tpq_path );
+	    if ( ! tp )
+		return 0;
+	    mp->tpq = tp;
 	}
 
 	if ( mp->tpq_index < 0 || mp->tpq_index >= tp->index_size )
 	    return 0;
 
+	if ( mp->scale != 2 && mp->scale != 4 && mp->scale != 8 )
+	    mp->scale = 1;
+
 #ifdef LOADER
-	fd = open ( mp->tpq_path, O_RDONLY );
-	if ( fd < 0 )
-	    return 0;
+	/* Maybe we have been here before */
+	jh = jpeg_cache_get ( tp, mp->tpq_index, &jbuf, &jsize );
+	if ( jh ) {
+	    t0 = stats_time ();
+	    mp->pixbuf = jpeg_decode ( mp, jbuf, jsize );
+	    if ( ! mp->pixbuf ) {
+		mp->scale = 1;
+		mp->pixbuf = loader_decode ( mp, jbuf, jsize );
+	    }
+	    stats_add ( 0, stats_time () - t0 );
+	    jpeg_cache_release ( jh );
+	    goto done;
+	}
 
 	off = tp->index[mp->tpq_index].offset;
-	lseek ( fd, off, SEEK_SET );
 	size = tp->index[mp->tpq_index].size;
 
-	/* Rumor has it that a loader cannot be reused, so
-	 * we must allocate a new loader each time.
+	if ( ! tpq_pool_get ( tp ) )
+	    return 0;
+
+	/* The usual case, hand the decoder the bytes right
+	 * out of the mapping.  Otherwise, pread them.
 	 */
-	loader = gdk_pixbuf_loader_new_with_type ( "jpeg", NULL );
+	if ( tp->map && off + size <= tp->map_size ) {
+	    if ( ! mp->hinted )
+		tpq_willneed ( tp, off, size );
+	    buf = tp->map + off;
+	} else {
+	    buf = (unsigned char *) gmalloc ( size );
+	    if ( pread ( tp->fd, buf, size, off ) != size ) {
+		/* We may be on a loader or server thread here, so
+		 * calling error() and exiting is no way to handle
+		 * an NFS hiccup.  Just give up on this one maplet.
+		 */
+		if ( settings.verbose & V_MAPLET )
+		    printf ( "TPQ file read error %s %lld %d\n", mp->tpq_path, (long long) off, size );
+		free ( (char *) buf );
+		tpq_pool_put ( tp );
+		return 0;
+	    }
+	}
 
-	while ( size > 0 ) {
-	    nw = size < BUFSIZE ? size : BUFSIZE;
-	    if ( read( fd, buf, nw ) != nw )
-		error ( "TPQ file read error %s %d %d\n", mp->tpq_path, off, size );
-	    gdk_pixbuf_loader_write ( loader, (guchar *)buf, nw, NULL );
-	    size -= nw;
+	t0 = stats_time ();
+	mp->pixbuf = jpeg_decode ( mp, buf, size );
+	if ( ! mp->pixbuf ) {
+	    mp->scale = 1;
+	    mp->pixbuf = loader_decode ( mp, buf, size );
 	}
+	stats_add ( size, stats_time () - t0 );
 
-	close ( fd );
+	/* Only worth keeping if it was good */
+	if ( mp->pixbuf )
+	    jpeg_cache_put ( tp, mp->tpq_index, buf, size );
 
-	/* The following two calls work in either order */
-	gdk_pixbuf_loader_close ( loader, NULL );
-	mp->pixbuf = gdk_pixbuf_loader_get_pixbuf ( loader );
+	if ( buf != tp->map + off )
+	    free ( (char *) buf );
 
-	/* be a good citizen and avoid a memory leak,
-	 */
-	g_object_ref ( mp->pixbuf );
-	g_object_unref ( loader );
+	tpq_pool_put ( tp );
+done:
 #else
 	/* open a temp file for R/W */
 	ofd = temp_file_open ();
@@ -589,9 +1442,9 @@ load_tpq_maplet ( struct maplet *mp )
 
 	while ( size > 0 ) {
 	    nw = size < BUFSIZE ? size : BUFSIZE;
-	    if ( read( fd, buf, nw ) != nw )
+	    if ( read( fd, rbuf, nw ) != nw )
 		error ( "TPQ file read error %s %d\n", mp->tpq_path, size );
-	    if ( write ( ofd, buf, nw ) != nw )
+	    if ( write ( ofd, rbuf, nw ) != nw )
 		error ( "tmp file write error %s\n", tmpname );
 	    size -= nw;
 	}
@@ -601,10 +1454,16 @@ load_tpq_maplet ( struct maplet *mp )
 
 	mp->pixbuf = gdk_pixbuf_new_from_file ( tmpname, NULL );
 	remove ( tmpname );
+	mp->scale = 1;
+	if ( mp->pixbuf ) {
+	    mp->xdim = gdk_pixbuf_get_width ( mp->pixbuf );
+	    mp->ydim = gdk_pixbuf_get_height ( mp->pixbuf );
+	}
 #endif
 
-	if ( ! mp->pixbuf && settings.verbose & V_TPQ ) {
-	    printf ("Cannot get pixbuf from %s (%d)\n", mp->tpq_path, mp->tpq_index );
+	if ( ! mp->pixbuf ) {
+	    if ( settings.verbose & V_TPQ )
+		printf ("Cannot get pixbuf from %s (%d)\n", mp->tpq_path, mp->tpq_index );
 	    return 0;
 	}
 
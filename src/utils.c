@@ -224,6 +224,19 @@ strhide ( char *data )
 	return rv;
 }
 
+/* The usual FNV-1a string hash */
+unsigned int
+str_hash ( char *s )
+{
+	unsigned int h = 2166136261u;
+
+	while ( *s ) {
+	    h ^= (unsigned char) *s++;
+	    h *= 16777619u;
+	}
+	return h;
+}
+
 char *
 str_lower ( char *data )
 {
@@ -0,0 +1,826 @@
+/*
+ *  GTopo
+ *
+ *  Copyright (C) 2007, Thomas J. Trebisky
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Street #330, Boston, MA 02111-1307, USA.
+ */
+
+/* mktpq.c -- part of gtopo
+ * Tom Trebisky  MMT Observatory, Tucson, Arizona
+ *
+ * Make a synthetic map archive, i.e.
+ *  mktpq /tmp/fake -112,31,-109,34
+ *
+ * The USGS data on the TOPO! disks is not something we can pass
+ * around, and not everybody has a few states worth of disks
+ * copied onto their machine anyway.  This writes TPQ files that
+ * gtopo cannot tell from the real thing, laid out the way the real
+ * disks are, so the archive scan, the caches, and the benchmark
+ * (gtopo --bench) can be tried out on any Linux box.
+ *
+ * For every 1x1 degree section in the box (west, south, east, north,
+ * longitude negative to the west, and rounded out to whole degrees),
+ * we get a section directory like XX_D01/D31110 with:
+ *
+ *	64 7.5 minute quads (24K)	q31110a1.tpq .. q31110h8.tpq
+ *	2 100K quads			k31110a1.tpq, k31110e1.tpq
+ *	1 500K file			g31110a1.tpq
+ *
+ * The sections get spread out over disks XX_D01, XX_D02 and so on,
+ * -d at a time.  The first disk also gets XX1_MAP1 (the whole box as
+ * one maplet, the STATE series) and XX1_MAP2 (1x1 degree maplets,
+ * the ATLAS series).  With -u we also write a full USA disk, SI_D01,
+ * with US1_MAP1 and US1_MAP2 for the whole lower 48 and the 500K
+ * files in SI_D01/US_SW/B30110/D31110/G31110A1.TPQ and such (in which
+ * case gtopo ignores the 500K files in the sections, as it does with
+ * the real ones).
+ *
+ * Each TPQ file is a 1024 byte header (see read_tpq_header() in
+ * tpq_io.c), a table of little endian offsets, the JPEG maplets
+ * (NW corner first, in rows just like text), and then a couple of
+ * PNG images.  The real files have a legend and such there, and
+ * build_index() counts on finding something other than a JPEG
+ * after the last maplet.  The last offset in the table is the end
+ * of the file.  The maplets are the size gtopo would stretch them
+ * to anyway (see maplet_norm_xdim()), so nothing gets resampled.
+ *
+ * Encoding JPEG is what takes the time, so by default we encode a
+ * few plain tinted maplets (with a border, so you can see the grid)
+ * for each size and use them over and over.  That writes tens of
+ * thousands of quads about as fast as the disk will take them.
+ * With -x every maplet is drawn from its own position, a pattern
+ * that runs smoothly across maplet and file boundaries, so anything
+ * drawn in the wrong place stands right out.  That is slower.
+ * With -r the maplets are made smaller by that factor, which saves
+ * a lot of disk space for a big archive.
+ *
+ * gtopo keeps archive paths in 100 byte buffers, so keep the
+ * archive directory name short.  Then put it in ~/.gtopo/settings:
+ *	archive /tmp/fake
+ *
+ * Alaska (with its own grid) is not something we try to do.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <math.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <jpeglib.h>
+
+#define TPQ_HEADER_SIZE	1024
+#define NUM_VARIANTS	8
+#define NUM_PNG		2
+
+#define DEGTORAD	(M_PI / 180.0)
+
+/* The lower 48, as US1_MAP1 and US1_MAP2 cover it */
+#define USA_WEST	-125.0
+#define USA_SOUTH	24.0
+#define USA_LONG	12
+#define USA_LAT		8
+#define USA_STATE_LONG	4.9167
+#define USA_STATE_LAT	3.25
+
+/* One kind of TPQ file, what the maplets are like.
+ * The maplet width in pixels depends on latitude,
+ * so we remember which width the variants are for.
+ */
+struct kind {
+	char *name;
+	double maplet_long;	/* degrees */
+	double maplet_lat;
+	int ydim;		/* pixels */
+	int xdim;		/* the variants are this wide */
+	unsigned char *variant[NUM_VARIANTS];
+	unsigned long variant_size[NUM_VARIANTS];
+};
+
+static struct kind k_24k =	{ .name = "24K", .maplet_long = 0.025, .maplet_lat = 0.0125, .ydim = 256 };
+static struct kind k_100k =	{ .name = "100K", .maplet_long = 0.0625, .maplet_lat = 0.0625, .ydim = 393 };
+static struct kind k_500k =	{ .name = "500K", .maplet_long = 0.5, .maplet_lat = 0.5, .ydim = 480 };
+static struct kind k_atlas =	{ .name = "atlas", .maplet_long = 1.0, .maplet_lat = 1.0, .ydim = 364 };
+static struct kind k_usa =	{ .name = "USA", .maplet_long = USA_STATE_LONG, .maplet_lat = USA_STATE_LAT, .ydim = 256 };
+
+/* The STATE file for our box is one maplet, which is not a
+ * fixed size, so this one is filled in when we know the box.
+ */
+static struct kind k_state =	{ .name = "state", .maplet_long = 1.0, .maplet_lat = 1.0 };
+
+/* About what the real state maps have */
+#define STATE_PIXELS_PER_DEG	79
+
+static int verbose = 0;
+static int unique = 0;
+static int quality = 75;
+static int reduce = 1;
+
+static unsigned char *png_data[NUM_PNG];
+static long png_size[NUM_PNG];
+
+/* What we did */
+static long n_files = 0;
+static long n_maplets = 0;
+static long n_bytes = 0;
+
+static void
+error ( char *msg, char *arg )
+{
+	fprintf ( stderr, "mktpq: " );
+	fprintf ( stderr, msg, arg );
+	fprintf ( stderr, "\n" );
+	exit ( 1 );
+}
+
+/* All the path buffers are this big */
+#define PATH_SIZE	1024
+
+/* sprintf a path, but refuse to run off the end */
+static void
+make_path ( char *buf, char *fmt, ... )
+{
+	va_list args;
+	int n;
+
+	va_start ( args, fmt );
+	n = vsnprintf ( buf, PATH_SIZE, fmt, args );
+	va_end ( args );
+
+	if ( n < 0 || n >= PATH_SIZE )
+	    error ( "path too long: %s", buf );
+}
+
+static void *
+gmalloc ( long size )
+{
+	void *rv;
+
+	rv = malloc ( size );
+	if ( ! rv )
+	    error ( "out of memory", NULL );
+	return rv;
+}
+
+/* ---------------------------------------------------- */
+
+/* Little endian, whatever we are */
+static void
+put_i4 ( unsigned char *buf, unsigned int val )
+{
+	buf[0] = val;
+	buf[1] = val >> 8;
+	buf[2] = val >> 16;
+	buf[3] = val >> 24;
+}
+
+static void
+put_double ( unsigned char *buf, double val )
+{
+	union {
+	    double dval;
+	    unsigned long long ival;
+	} u;
+	int i;
+
+	u.dval = val;
+	for ( i=0; i<8; i++ )
+	    buf[i] = u.ival >> (8*i);
+}
+
+/* Big endian, for PNG */
+static void
+put_b4 ( unsigned char *buf, unsigned int val )
+{
+	buf[0] = val >> 24;
+	buf[1] = val >> 16;
+	buf[2] = val >> 8;
+	buf[3] = val;
+}
+
+/* ---------------------------------------------------- */
+
+/* Just enough PNG to make a valid file without needing zlib.
+ * A stored (uncompressed) deflate block is fine for something
+ * this small.  These only need to be there, nobody looks at them.
+ */
+static unsigned int crc_table[256];
+
+static void
+crc_init ( void )
+{
+	unsigned int c;
+	int n, k;
+
+	for ( n=0; n<256; n++ ) {
+	    c = n;
+	    for ( k=0; k<8; k++ )
+		c = (c & 1) ? 0xedb88320 ^ (c >> 1) : c >> 1;
+	    crc_table[n] = c;
+	}
+}
+
+static unsigned int
+crc ( unsigned char *buf, int len )
+{
+	unsigned int c = 0xffffffff;
+
+	while ( len-- )
+	    c = crc_table[(c ^ *buf++) & 0xff] ^ (c >> 8);
+	return c ^ 0xffffffff;
+}
+
+/* type and data are already in place after the length */
+static unsigned char *
+png_chunk ( unsigned char *p, char *type, int len )
+{
+	put_b4 ( p, len );
+	memcpy ( p+4, type, 4 );
+	put_b4 ( p+8+len, crc ( p+4, len+4 ) );
+	return p + 12 + len;
+}
+
+/* A gray w by h image (w*h must stay under 64K) */
+static unsigned char *
+png_make ( int w, int h, int shade, long *size )
+{
+	static unsigned char sig[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+	unsigned char *buf;
+	unsigned char *p, *d;
+	unsigned int a, b;
+	int raw;
+	int x, y;
+
+	raw = h * (w + 1);
+	buf = (unsigned char *) gmalloc ( raw + 128 );
+
+	p = buf;
+	memcpy ( p, sig, 8 );
+	p += 8;
+
+	/* IHDR: 8 bit grayscale */
+	d = p + 8;
+	put_b4 ( d, w );
+	put_b4 ( d+4, h );
+	d[8] = 8;
+	d[9] = 0;
+	d[10] = d[11] = d[12] = 0;
+	p = png_chunk ( p, "IHDR", 13 );
+
+	/* IDAT: zlib header, one stored block, adler32 */
+	d = p + 8;
+	d[0] = 0x78;
+	d[1] = 0x01;
+	d[2] = 1;			/* final, stored */
+	d[3] = raw & 0xff;
+	d[4] = raw >> 8;
+	d[5] = ~raw & 0xff;
+	d[6] = (~raw >> 8) & 0xff;
+
+	a = 1;
+	b = 0;
+	for ( y=0; y<h; y++ ) {
+	    for ( x=0; x <= w; x++ ) {
+		/* each row starts with filter type 0 */
+		d[7 + y*(w+1) + x] = x ? shade + (x + y) % 16 : 0;
+		a = (a + d[7 + y*(w+1) + x]) % 65521;
+		b = (b + a) % 65521;
+	    }
+	}
+	put_b4 ( d + 7 + raw, (b << 16) | a );
+	p = png_chunk ( p, "IDAT", raw + 11 );
+
+	p = png_chunk ( p, "IEND", 0 );
+
+	*size = p - buf;
+	return buf;
+}
+
+/* ---------------------------------------------------- */
+
+static unsigned char *
+jpeg_encode ( unsigned char *rgb, int xdim, int ydim, unsigned long *size )
+{
+	struct jpeg_compress_struct cinfo;
+	struct jpeg_error_mgr jerr;
+	unsigned char *buf = NULL;
+	JSAMPROW row;
+
+	*size = 0;
+
+	cinfo.err = jpeg_std_error ( &jerr );
+	jpeg_create_compress ( &cinfo );
+	jpeg_mem_dest ( &cinfo, &buf, size );
+
+	cinfo.image_width = xdim;
+	cinfo.image_height = ydim;
+	cinfo.input_components = 3;
+	cinfo.in_color_space = JCS_RGB;
+	jpeg_set_defaults ( &cinfo );
+	jpeg_set_quality ( &cinfo, quality, TRUE );
+
+	jpeg_start_compress ( &cinfo, TRUE );
+	while ( cinfo.next_scanline < cinfo.image_height ) {
+	    row = rgb + cinfo.next_scanline * xdim * 3;
+	    (void) jpeg_write_scanlines ( &cinfo, &row, 1 );
+	}
+	jpeg_finish_compress ( &cinfo );
+	jpeg_destroy_compress ( &cinfo );
+
+	return buf;
+}
+
+/* Pale map colors, for the plain maplets */
+static unsigned char tints[NUM_VARIANTS][3] = {
+	{ 250, 245, 230 }, { 235, 245, 225 }, { 245, 235, 220 }, { 230, 240, 245 },
+	{ 250, 240, 240 }, { 240, 250, 235 }, { 245, 245, 215 }, { 235, 235, 245 }
+};
+
+static void
+paint_plain ( unsigned char *rgb, int xdim, int ydim, int variant )
+{
+	unsigned char *p;
+	int x, y;
+
+	p = rgb;
+	for ( y=0; y<ydim; y++ ) {
+	    for ( x=0; x<xdim; x++ ) {
+		if ( x == 0 || y == 0 ) {
+		    p[0] = 150; p[1] = 120; p[2] = 90;
+		} else {
+		    p[0] = tints[variant][0];
+		    p[1] = tints[variant][1];
+		    p[2] = tints[variant][2];
+		}
+		p += 3;
+	    }
+	}
+}
+
+/* Make up some terrain, smooth across the whole country,
+ * with contour lines every 100 (made up) feet and a
+ * graticule line every 1/8 degree.
+ */
+static void
+paint_unique ( unsigned char *rgb, int xdim, int ydim, double w_long, double n_lat,
+	double dlong, double dlat )
+{
+	unsigned char *p;
+	double lng, lat;
+	double h, c;
+	double step;
+	int x, y;
+
+	/* contours get sparse when we are zoomed out */
+	step = dlat > 0.1 ? 1000.0 : 100.0;
+
+	p = rgb;
+	for ( y=0; y<ydim; y++ ) {
+	    lat = n_lat - (y + 0.5) * dlat / ydim;
+	    for ( x=0; x<xdim; x++ ) {
+		lng = w_long + (x + 0.5) * dlong / xdim;
+
+		h = 3000.0 + 1500.0 * sin ( lng * 7.0 ) * cos ( lat * 5.0 )
+			+ 400.0 * sin ( lng * 41.0 + lat * 37.0 );
+
+		c = h / 6000.0;
+		p[0] = 200 + 50 * c;
+		p[1] = 235 - 30 * c;
+		p[2] = 190 - 40 * c;
+
+		if ( fabs ( h - step * floor ( h / step + 0.5 ) ) < step * 0.04 ) {
+		    p[0] = 170; p[1] = 120; p[2] = 80;
+		}
+
+		if ( fabs ( lng * 8.0 - floor ( lng * 8.0 + 0.5 ) ) < 0.5 * 8.0 * dlong / xdim ||
+			fabs ( lat * 8.0 - floor ( lat * 8.0 + 0.5 ) ) < 0.5 * 8.0 * dlat / ydim ) {
+		    p[0] = 200; p[1] = 40; p[2] = 40;
+		}
+		p += 3;
+	    }
+	}
+}
+
+/* The plain maplets for this kind of file at this width */
+static void
+make_variants ( struct kind *kp, int xdim, int ydim )
+{
+	unsigned char *rgb;
+	int i;
+
+	if ( kp->xdim == xdim && kp->variant[0] )
+	    return;
+
+	rgb = (unsigned char *) gmalloc ( xdim * ydim * 3 );
+	for ( i=0; i<NUM_VARIANTS; i++ ) {
+	    if ( kp->variant[i] )
+		free ( kp->variant[i] );
+	    paint_plain ( rgb, xdim, ydim, i );
+	    kp->variant[i] = jpeg_encode ( rgb, xdim, ydim, &kp->variant_size[i] );
+	}
+	free ( rgb );
+
+	kp->xdim = xdim;
+}
+
+/* ---------------------------------------------------- */
+
+/* Make a directory and anything above it */
+static void
+make_dirs ( char *path )
+{
+	char buf[PATH_SIZE];
+	char *p;
+
+	if ( strlen ( path ) >= sizeof(buf) )
+	    error ( "path too long: %s", path );
+	strcpy ( buf, path );
+
+	for ( p = buf + 1; *p; p++ ) {
+	    if ( *p != '/' )
+		continue;
+	    *p = '\0';
+	    if ( mkdir ( buf, 0755 ) < 0 && errno != EEXIST )
+		error ( "cannot make directory %s", buf );
+	    *p = '/';
+	}
+	if ( mkdir ( buf, 0755 ) < 0 && errno != EEXIST )
+	    error ( "cannot make directory %s", buf );
+}
+
+/* Write one TPQ file covering w_long to e_long and s_lat to n_lat
+ * with maplets of the given kind.
+ */
+static void
+write_tpq ( char *path, char *quad, char *state, struct kind *kp,
+	double w_long, double s_lat, double e_long, double n_lat )
+{
+	unsigned char header[TPQ_HEADER_SIZE];
+	unsigned char **maplet;
+	unsigned long *size;
+	unsigned char *table;
+	unsigned char *rgb = NULL;
+	int long_count, lat_count;
+	int xdim, ydim;
+	int n, ntab;
+	int ix, iy;
+	int gx, gy;
+	int i;
+	unsigned long off;
+	double mid_lat;
+	double wl, nl;
+	FILE *fp;
+
+	long_count = (int) ((e_long - w_long) / kp->maplet_long + 0.5);
+	lat_count = (int) ((n_lat - s_lat) / kp->maplet_lat + 0.5);
+	n = long_count * lat_count;
+
+	/* What maplet_norm_xdim() will want */
+	mid_lat = (n_lat + s_lat) / 2.0;
+	ydim = kp->ydim / reduce;
+	xdim = ydim * kp->maplet_long / kp->maplet_lat * cos ( mid_lat * DEGTORAD );
+	if ( ydim < 8 )
+	    ydim = 8;
+	if ( xdim < 8 )
+	    xdim = 8;
+
+	maplet = (unsigned char **) gmalloc ( n * sizeof(unsigned char *) );
+	size = (unsigned long *) gmalloc ( n * sizeof(unsigned long) );
+
+	if ( unique )
+	    rgb = (unsigned char *) gmalloc ( xdim * ydim * 3 );
+	else
+	    make_variants ( kp, xdim, ydim );
+
+	i = 0;
+	for ( iy = 0; iy < lat_count; iy++ ) {
+	    for ( ix = 0; ix < long_count; ix++ ) {
+		wl = w_long + ix * kp->maplet_long;
+		nl = n_lat - iy * kp->maplet_lat;
+		if ( unique ) {
+		    paint_unique ( rgb, xdim, ydim, wl, nl, kp->maplet_long, kp->maplet_lat );
+		    maplet[i] = jpeg_encode ( rgb, xdim, ydim, &size[i] );
+		} else {
+		    /* neighbors mostly differ, so the grid shows up */
+		    gx = (int) floor ( -wl / kp->maplet_long + 0.5 );
+		    gy = (int) floor ( nl / kp->maplet_lat + 0.5 );
+		    maplet[i] = kp->variant[(gx * 3 + gy * 5) & (NUM_VARIANTS-1)];
+		    size[i] = kp->variant_size[(gx * 3 + gy * 5) & (NUM_VARIANTS-1)];
+		}
+		i++;
+	    }
+	}
+
+	/* The header, everything we don't fill in is zero */
+	memset ( header, 0, TPQ_HEADER_SIZE );
+	put_i4 ( header, 1 );
+	put_double ( header + 4, w_long );
+	put_double ( header + 12, n_lat );
+	put_double ( header + 20, e_long );
+	put_double ( header + 28, s_lat );
+	strcpy ( (char *) header + 36, "TOPO!" );
+	strncpy ( (char *) header + 256, quad, 127 );
+	strncpy ( (char *) header + 384, state, 31 );
+	strcpy ( (char *) header + 416, "MKTPQ" );
+	memcpy ( header + 448, "20242024", 8 );
+	strcpy ( (char *) header + 456, "100 ft" );
+
+	memcpy ( header + 480, ".jpg", 4 );
+	put_i4 ( header + 492, long_count );
+	put_i4 ( header + 496, lat_count );
+
+	memcpy ( header + 600, ".png", 4 );
+	put_i4 ( header + 612, 1 );
+	put_i4 ( header + 616, 1 );
+	memcpy ( header + 660, ".png", 4 );
+	put_i4 ( header + 672, 1 );
+	put_i4 ( header + 676, 1 );
+
+	/* The offsets: maplets, PNGs, and the end of the file */
+	ntab = n + NUM_PNG + 1;
+	table = (unsigned char *) gmalloc ( ntab * 4 );
+
+	off = TPQ_HEADER_SIZE + ntab * 4;
+	for ( i=0; i<n; i++ ) {
+	    put_i4 ( table + 4*i, off );
+	    off += size[i];
+	}
+	for ( i=0; i<NUM_PNG; i++ ) {
+	    put_i4 ( table + 4*(n+i), off );
+	    off += png_size[i];
+	}
+	put_i4 ( table + 4*(n+NUM_PNG), off );
+
+	if ( ! (fp = fopen ( path, "w" )) )
+	    error ( "cannot create %s", path );
+
+	fwrite ( header, 1, TPQ_HEADER_SIZE, fp );
+	fwrite ( table, 1, ntab * 4, fp );
+	for ( i=0; i<n; i++ )
+	    fwrite ( maplet[i], 1, size[i], fp );
+	for ( i=0; i<NUM_PNG; i++ )
+	    fwrite ( png_data[i], 1, png_size[i], fp );
+
+	if ( fclose ( fp ) != 0 )
+	    error ( "write failed on %s", path );
+
+	if ( verbose )
+	    printf ( "%s: %d by %d maplets of %d by %d, %lu bytes\n",
+		path, long_count, lat_count, xdim, ydim, off );
+
+	n_files++;
+	n_maplets += n;
+	n_bytes += off;
+
+	if ( unique ) {
+	    for ( i=0; i<n; i++ )
+		free ( maplet[i] );
+	    free ( rgb );
+	}
+	free ( maplet );
+	free ( size );
+	free ( table );
+}
+
+/* ---------------------------------------------------- */
+
+/* One 1x1 degree section, lat is the south edge and
+ * west_deg is the east edge in degrees west (as in D31110).
+ */
+static void
+make_section ( char *disk, char *state, int lat, int west_deg, int usa )
+{
+	char path[PATH_SIZE];
+	char quad[64];
+	double e_long;
+	double s_lat;
+	int lat_q, long_q;
+
+	make_path ( path, "%s/D%2d%03d", disk, lat, west_deg );
+	make_dirs ( path );
+
+	for ( lat_q = 0; lat_q < 8; lat_q++ ) {
+	    for ( long_q = 0; long_q < 8; long_q++ ) {
+		e_long = - (west_deg + long_q * 0.125);
+		s_lat = lat + lat_q * 0.125;
+		make_path ( path, "%s/D%2d%03d/q%2d%03d%c%d.tpq", disk, lat, west_deg,
+		    lat, west_deg, 'a' + lat_q, long_q + 1 );
+		sprintf ( quad, "Quad %2d%03d%c%d", lat, west_deg, 'A' + lat_q, long_q + 1 );
+		write_tpq ( path, quad, state, &k_24k, e_long - 0.125, s_lat, e_long, s_lat + 0.125 );
+	    }
+	}
+
+	/* 100K, the south and north halves */
+	for ( lat_q = 0; lat_q < 8; lat_q += 4 ) {
+	    s_lat = lat + lat_q * 0.125;
+	    make_path ( path, "%s/D%2d%03d/k%2d%03d%c1.tpq", disk, lat, west_deg,
+		lat, west_deg, 'a' + lat_q );
+	    sprintf ( quad, "100K %2d%03d%c1", lat, west_deg, 'A' + lat_q );
+	    write_tpq ( path, quad, state, &k_100k, -(west_deg + 1.0), s_lat, - (double) west_deg, s_lat + 0.5 );
+	}
+
+	/* With a full USA disk, the 500K files go there */
+	if ( usa )
+	    return;
+
+	make_path ( path, "%s/D%2d%03d/g%2d%03da1.tpq", disk, lat, west_deg, lat, west_deg );
+	sprintf ( quad, "500K %2d%03d", lat, west_deg );
+	write_tpq ( path, quad, state, &k_500k, -(west_deg + 1.0), lat, - (double) west_deg, lat + 1.0 );
+}
+
+/* The 500K file for a section on the full USA disk */
+static void
+make_usa_section ( char *si, int lat, int west_deg )
+{
+	char dir[PATH_SIZE];
+	char path[PATH_SIZE];
+	char quad[64];
+
+	make_path ( dir, "%s/US_%c%c/B%2d%03d/D%2d%03d", si,
+	    lat >= 37 ? 'N' : 'S', west_deg >= 100 ? 'W' : 'E',
+	    (lat / 5) * 5, (west_deg / 5) * 5, lat, west_deg );
+	make_dirs ( dir );
+
+	make_path ( path, "%s/G%2d%03dA1.TPQ", dir, lat, west_deg );
+	sprintf ( quad, "500K %2d%03d", lat, west_deg );
+	write_tpq ( path, quad, "US", &k_500k, -(west_deg + 1.0), lat, - (double) west_deg, lat + 1.0 );
+}
+
+static void
+usage ( void )
+{
+	printf ( "Usage: mktpq [-v] [-x] [-u] [-s XX] [-d sections] [-q quality] [-r reduce] dir w,s,e,n\n" );
+	printf ( "  -v  tell about every file\n" );
+	printf ( "  -x  draw every maplet (slow), otherwise reuse a few plain ones\n" );
+	printf ( "  -u  also write SI_D01 (level 1, 2 and 3 for the full USA)\n" );
+	printf ( "  -s  two letter state code for the disk names (ZZ)\n" );
+	printf ( "  -d  sections per disk (100)\n" );
+	printf ( "  -q  JPEG quality (75)\n" );
+	printf ( "  -r  make maplets smaller by this factor (1)\n" );
+	printf ( "Longitude is negative to the west, and the box gets rounded out to whole degrees.\n" );
+	exit ( 1 );
+}
+
+int
+main ( int argc, char **argv )
+{
+	char path[PATH_SIZE];
+	char disk[PATH_SIZE];
+	char state[8];
+	char *dir;
+	double w, s, e, n;
+	int lat1, lat2;
+	int west1, west2;
+	int per_disk = 100;
+	int usa = 0;
+	int count;
+	int lat, west_deg;
+	int i;
+	struct timeval t1, t2;
+
+	strcpy ( state, "ZZ" );
+
+	argc--;
+	argv++;
+
+	while ( argc > 0 && argv[0][0] == '-' && isalpha ( argv[0][1] ) ) {
+	    if ( strcmp ( argv[0], "-v" ) == 0 )
+		verbose = 1;
+	    else if ( strcmp ( argv[0], "-x" ) == 0 )
+		unique = 1;
+	    else if ( strcmp ( argv[0], "-u" ) == 0 )
+		usa = 1;
+	    else if ( argc > 1 && strcmp ( argv[0], "-s" ) == 0 ) {
+		if ( strlen ( argv[1] ) != 2 )
+		    usage ();
+		state[0] = toupper ( argv[1][0] );
+		state[1] = toupper ( argv[1][1] );
+		argc--;
+		argv++;
+	    } else if ( argc > 1 && strcmp ( argv[0], "-d" ) == 0 ) {
+		per_disk = atoi ( argv[1] );
+		argc--;
+		argv++;
+	    } else if ( argc > 1 && strcmp ( argv[0], "-q" ) == 0 ) {
+		quality = atoi ( argv[1] );
+		argc--;
+		argv++;
+	    } else if ( argc > 1 && strcmp ( argv[0], "-r" ) == 0 ) {
+		reduce = atoi ( argv[1] );
+		argc--;
+		argv++;
+	    } else
+		usage ();
+	    argc--;
+	    argv++;
+	}
+
+	if ( argc != 2 )
+	    usage ();
+	if ( per_disk < 1 || reduce < 1 || quality < 1 || quality > 100 )
+	    usage ();
+
+	dir = argv[0];
+	if ( sscanf ( argv[1], "%lf,%lf,%lf,%lf", &w, &s, &e, &n ) != 4 )
+	    usage ();
+
+	if ( w > e || s > n ) {
+	    printf ( "The box is west,south,east,north\n" );
+	    return 1;
+	}
+	if ( e > 0.0 || w < -179.0 || s < 0.0 || n > 52.0 ) {
+	    printf ( "Only the lower 48 (north and west) please\n" );
+	    return 1;
+	}
+
+	/* Everything we add on the end is well under 64 bytes */
+	if ( strlen ( dir ) > PATH_SIZE - 64 ) {
+	    printf ( "Directory name is too long: %s\n", dir );
+	    return 1;
+	}
+	if ( strlen ( dir ) > 50 )
+	    printf ( "Warning: gtopo may not like paths this long: %s\n", dir );
+
+	/* sections are named by their south and east edges */
+	lat1 = (int) floor ( s );
+	lat2 = (int) ceil ( n );
+	west1 = (int) floor ( -e );
+	west2 = (int) ceil ( -w );
+	if ( lat2 == lat1 )
+	    lat2++;
+	if ( west2 == west1 )
+	    west2++;
+
+	crc_init ();
+	for ( i=0; i<NUM_PNG; i++ )
+	    png_data[i] = png_make ( 64 + 32*i, 32, 64 + 64*i, &png_size[i] );
+
+	gettimeofday ( &t1, NULL );
+
+	count = 0;
+	for ( lat = lat1; lat < lat2; lat++ ) {
+	    for ( west_deg = west1; west_deg < west2; west_deg++ ) {
+		make_path ( disk, "%s/%s_D%02d", dir, state, count / per_disk + 1 );
+		make_section ( disk, state, lat, west_deg, usa );
+		count++;
+	    }
+	    if ( ! verbose )
+		printf ( "Latitude %d done, %ld files so far\n", lat, n_files );
+	}
+
+	/* The whole box as one maplet (STATE), and in 1 degree maplets (ATLAS) */
+	make_path ( disk, "%s/%s_D01/%s1_MAP1", dir, state, state );
+	make_dirs ( disk );
+	make_path ( path, "%s/%s1_MAP1.TPQ", disk, state );
+	k_state.maplet_long = west2 - west1;
+	k_state.maplet_lat = lat2 - lat1;
+	k_state.ydim = (lat2 - lat1) * STATE_PIXELS_PER_DEG;
+	write_tpq ( path, "State", state, &k_state, -west2, lat1, -west1, lat2 );
+
+	make_path ( disk, "%s/%s_D01/%s1_MAP2", dir, state, state );
+	make_dirs ( disk );
+	make_path ( path, "%s/%s1_MAP2.TPQ", disk, state );
+	write_tpq ( path, "Atlas", state, &k_atlas, -west2, lat1, -west1, lat2 );
+
+	if ( usa ) {
+	    make_path ( disk, "%s/SI_D01/USMAPS", dir );
+	    make_dirs ( disk );
+	    make_path ( path, "%s/US1_MAP1.TPQ", disk );
+	    write_tpq ( path, "United States", "US", &k_usa, USA_WEST, USA_SOUTH,
+		USA_WEST + USA_LONG * USA_STATE_LONG, USA_SOUTH + USA_LAT * USA_STATE_LAT );
+	    make_path ( path, "%s/US1_MAP2.TPQ", disk );
+	    write_tpq ( path, "United States", "US", &k_atlas, USA_WEST, USA_SOUTH,
+		USA_WEST + 59.0, USA_SOUTH + 26.0 );
+
+	    make_path ( disk, "%s/SI_D01", dir );
+	    for ( lat = lat1; lat < lat2; lat++ )
+		for ( west_deg = west1; west_deg < west2; west_deg++ )
+		    make_usa_section ( disk, lat, west_deg );
+	}
+
+	gettimeofday ( &t2, NULL );
+
+	printf ( "%d sections, %d 24K quads, %ld files, %ld maplets, %ld bytes in %.1f seconds\n",
+	    count, count * 64, n_files, n_maplets, n_bytes,
+	    (t2.tv_sec - t1.tv_sec) + (t2.tv_usec - t1.tv_usec) / 1000000.0 );
+
+	return 0;
+}
+
+/* THE END */